@@ -27,6 +27,13 @@ ARCH ?= default
 RTLIB ?= $(RTDIR)/acceptrt.$(ARCH).bc
 EXTRABC += $(RTLIB)
 
+# Reduced-accuracy math routines for "fastmath" sites, which fall back to
+# libm outside their ranges (host target only). Only the relaxed build
+# links them; see below.
+ifeq ($(ARCH),default)
+	MATHLIB := $(RTDIR)/acceptmath.bc
+endif
+
 # Host platform specifics.
 ifeq ($(shell uname -s),Darwin)
 	XCODEINCLUDES = $(shell xcrun --show-sdk-path)/usr/include
@@ -59,6 +66,25 @@ LLCARGS += -O2
 ENERCFLAGS :=  -Xclang -load -Xclang $(ENERCLIB) \
 	-Xclang -add-plugin -Xclang enerc-type-checker
 
+# Instrument lock and barrier sites to measure their contention. The
+# runtime writes the measurements to accept_syncprof.txt.
+ifneq ($(ACCEPT_SYNCPROF),)
+	OPTARGS += -accept-sync-profile
+endif
+
+# Instrument approximate loads to count their cache misses. The runtime
+# writes the counts to accept_loadprof.txt.
+ifneq ($(ACCEPT_LOADPROF),)
+	OPTARGS += -accept-load-profile
+endif
+
+# The software NPU backend and NPU tracing link against a native runtime
+# library.
+ifneq ($(filter -accept-npu-host -accept-npu-trace,$(OPTARGS)),)
+	NPULIB := $(RTDIR)/libacceptnpu.a
+	LIBS += $(NPULIB) -lm -lpthread
+endif
+
 # SOURCES is a list of source files, *.{c,cpp} by default.
 SOURCES ?= $(wildcard *.c) $(wildcard *.cpp)
 
@@ -67,6 +93,7 @@ TARGET ?= app
 BCFILES := $(SOURCES:.c=.bc)
 BCFILES := $(BCFILES:.cpp=.bc)
 LINKEDBC := $(TARGET)_all.bc
+OPTLINKEDBC := $(TARGET)_opt_all.bc
 LLFILES := $(BCFILES:.bc=.ll)
 
 # Attempt to guess which linker to use.
@@ -119,10 +146,23 @@ $(BUILD_TARGETS): build_%: setup $(EXTRADEPS) $(TARGET).%
 $(RTLIB):
 	make -C $(RTDIR) acceptrt.$(ARCH).bc CC="$(CC)" CFLAGS="$(CFLAGS)"
 
+# Build the fast math routines.
+$(RTDIR)/acceptmath.bc: $(RTDIR)/acceptmath.c
+	make -C $(RTDIR) acceptmath.bc CC="$(CC)" CFLAGS="$(CFLAGS)"
+
+# Build the native software NPU runtime.
+$(RTDIR)/libacceptnpu.a: $(RTDIR)/acceptnpu.c
+	make -C $(RTDIR) libacceptnpu.a
+
 # Link component bitcode files into a single file.
 $(LINKEDBC): $(BCFILES) $(EXTRABC)
 	$(LLVMLINK) $^ > $@
 
+# The relaxed build also gets the fast math routines, ahead of optimization
+# so that the calls substituted for libm can be inlined.
+$(OPTLINKEDBC): $(LINKEDBC) $(MATHLIB)
+	$(LLVMLINK) $^ > $@
+
 # For debugging: we can also disassemble to .ll files.
 #	for f in $(BCFILES); do \
 #		$(LLVMDIS) $$f; \
@@ -131,7 +171,7 @@ $(LINKEDBC): $(BCFILES) $(EXTRABC)
 # Versions of the amalgamated program.
 $(TARGET).orig.bc: $(LINKEDBC)
 	$(LLVMOPT) -load $(PASSLIB) -O1 $(OPTARGS) $< -o $@
-$(TARGET).opt.bc: $(LINKEDBC) accept_config.txt
+$(TARGET).opt.bc: $(OPTLINKEDBC) accept_config.txt
 	$(LLVMOPT) -load $(PASSLIB) -O1 -accept-relax $(OPTARGS) $< -o $@
 $(TARGET).dummy.bc: $(LINKEDBC)
 	cp $< $@
@@ -141,13 +181,24 @@ $(TARGET).%.s: $(TARGET).%.bc
 	$(LLVMLLC) $(LLCARGS) $< > $@
 
 # .s -> executable (assemble and link)
-$(TARGET).%: $(TARGET).%.s
+$(TARGET).%: $(TARGET).%.s $(NPULIB)
 	$(LINKER) $(LDFLAGS) -o $@ $< $(LIBS)
 
+# Only the relaxed build can contain parallel loops and fast math calls.
+# The runtime's pthread symbols are weak, so the other builds link without
+# threads.
+ifeq ($(ARCH),default)
+$(TARGET).opt: LIBS += -lm -lpthread
+endif
+
 clean:
 	$(RM) $(TARGET) $(TARGET).s $(BCFILES) $(LLFILES) $(LINKEDBC) \
-	accept-globals-info.txt accept_config.txt accept_config_desc.txt \
-	accept_log.txt accept_time.txt \
+	$(OPTLINKEDBC) \
+	accept-globals-info.txt accept_config.txt accept_config.bin \
+	accept_config_desc.txt \
+	accept_log.txt accept_log.jsonl accept_log.bin \
+	accept_time.txt accept_syncprof.txt accept_loadprof.txt \
+	accept_npu_trace.bin \
 	$(CONFIGS:%=$(TARGET).%.bc) $(CONFIGS:%=$(TARGET).%) \
 	accept-approxRetValueFunctions-info.txt accept-npuArrayArgs-info.txt \
 	$(CLEANMETOO)
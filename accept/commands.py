@@ -8,9 +8,11 @@ import os
 import subprocess
 import json
 import traceback
+import io
 from collections import namedtuple
 from . import core
 from . import cwmemo
+from . import npu
 
 
 APPS = ['streamcluster', 'sobel', 'canneal', 'fluidanimate',
@@ -19,7 +21,8 @@ RESULTS_JSON = 'results.json'
 
 
 GlobalConfig = namedtuple('GlobalConfig',
-                          'client reps test_reps keep_sandboxes simulate')
+                          'client reps test_reps keep_sandboxes simulate '
+                          'syncprof loadprof')
 
 
 @click.group(help='the ACCEPT approximate compiler driver')
@@ -37,9 +40,13 @@ GlobalConfig = namedtuple('GlobalConfig',
               help='do not delete sandbox dirs')
 @click.option('--simulate', '-s', is_flag=True,
               help='simulation (untrusted performance) mode')
+@click.option('--syncprof', '-p', is_flag=True,
+              help='prioritize lock and barrier sites by contention')
+@click.option('--loadprof', '-l', is_flag=True,
+              help='prioritize load prediction sites by cache misses')
 @click.pass_context
 def cli(ctx, verbose, cluster, force, reps, test_reps, keep_sandboxes,
-        simulate):
+        simulate, syncprof, loadprof):
     # Set up logging.
     logging.getLogger().addHandler(logging.StreamHandler(sys.stderr))
     if verbose >= 3:
@@ -55,7 +62,8 @@ def cli(ctx, verbose, cluster, force, reps, test_reps, keep_sandboxes,
     # Testing reps fall back to training reps if unspecified.
     test_reps = test_reps or reps
 
-    ctx.obj = GlobalConfig(client, reps, test_reps, keep_sandboxes, simulate)
+    ctx.obj = GlobalConfig(client, reps, test_reps, keep_sandboxes, simulate,
+                           syncprof, loadprof)
 
 
 # Utilities.
@@ -64,7 +72,9 @@ def get_eval(appdir, config):
     """Get an Evaluation object given the configured `GlobalConfig`.
     """
     return core.Evaluation(appdir, config.client, config.reps,
-                           config.test_reps, config.simulate)
+                           config.test_reps, config.simulate,
+                           syncprof=config.syncprof,
+                           loadprof=config.loadprof)
 
 
 def dump_config(config):
@@ -155,7 +165,7 @@ def dump_results_json(results):
 
 OPT_KINDS = {
     'loopperf': ('loop',),
-    'desync':   ('lock', 'barrier'),
+    'desync':   ('lock', 'barrier', 'condvar'),
     'npu':      ('npu_region',),
 }
 
@@ -324,10 +334,15 @@ def run(ctx, appdir, verbose, test):
 
 # Get the compilation log or compiler output.
 
-def log_and_output(directory, fn='accept_log.txt', keep=False):
+def log_and_output(directory, fmt='text', keep=False):
     """Build the benchmark in `directory` and return the contents of the
-    compilation log.
+    compilation log, written in the format `fmt` (see `core.LOG_FILES`).
     """
+    fn = core.LOG_FILES[fmt]
+    optargs = '-accept-log'
+    if fmt != 'text':
+        optargs += ' -accept-log-format={}'.format(fmt)
+
     with core.chdir(directory):
         with core.sandbox(True, keep):
             if keep:
@@ -337,10 +352,10 @@ def log_and_output(directory, fn='accept_log.txt', keep=False):
                 os.remove(fn)
 
             output = core.build(require=False,
-                                make_args=['OPTARGS=-accept-log'])
+                                make_args=['OPTARGS={}'.format(optargs)])
 
             if os.path.exists(fn):
-                with open(fn) as f:
+                with open(fn, 'rb') as f:
                     log = f.read()
             else:
                 log = ''
@@ -350,18 +365,29 @@ def log_and_output(directory, fn='accept_log.txt', keep=False):
 
 @cli.command()
 @click.argument('appdir', default='.')
+@click.option('--format', '-F', 'fmt', default='text',
+              type=click.Choice(sorted(core.LOG_FILES)),
+              help='compiler log format')
 @click.pass_context
-def log(ctx, appdir):
+def log(ctx, appdir, fmt):
     """Show ACCEPT optimization log.
 
     Compile the program---using the same memoized compilation as the
-    `build` command---and show the resulting optimization log.
+    `build` command---and show the resulting optimization log. With a
+    structured format, the log is shown as JSON lines.
     """
     appdir = core.normpath(appdir)
+    # The memoization key only includes positional arguments.
+    args = (appdir,) if fmt == 'text' else (appdir, fmt)
     with ctx.obj.client:
-        ctx.obj.client.submit(log_and_output, appdir,
+        ctx.obj.client.submit(log_and_output, *args,
                               keep=ctx.obj.keep_sandboxes)
-        logtxt, _ = ctx.obj.client.get(log_and_output, appdir)
+        logtxt, _ = ctx.obj.client.get(log_and_output, *args)
+
+    if fmt != 'text':
+        records = core.read_log(io.BytesIO(logtxt))
+        logtxt = ''.join(json.dumps(dict(r._asdict(), site=r.site)) + '\n'
+                         for r in records)
 
     # Pass the log file through c++filt.
     filtproc = subprocess.Popen(['c++filt'], stdin=subprocess.PIPE,
@@ -434,6 +460,54 @@ def approx(ctx, num, appdir):
         print()
 
 
+@cli.command()
+@click.argument('trace', default=npu.TRACE_FILE)
+@click.option('--output', '-o', default=npu.WEIGHTS_FILE,
+              help='weights file to write')
+@click.option('--hidden', '-H', default=None,
+              help='hidden layer sizes (e.g., 8,8); default: search')
+@click.option('--epochs', '-e', type=int, default=50,
+              help='training passes over the samples')
+def train(trace, output, hidden, epochs):
+    """Train NPU networks from a trace.
+
+    Read the region samples recorded by a program built with
+    `-accept-npu-trace` and fit a neural network to each region. The
+    networks are written in the format read by the software NPU
+    (`-accept-npu-host`).
+    """
+    if hidden:
+        try:
+            hidden = [int(n) for n in hidden.split(',')]
+        except ValueError:
+            raise core.UserError('invalid hidden layer sizes')
+
+    try:
+        with open(trace, 'rb') as f:
+            regions = npu.read_trace(f)
+    except IOError:
+        raise core.UserError('could not read trace {}'.format(trace))
+    except npu.TraceError as exc:
+        raise core.UserError('{}: {}'.format(trace, exc))
+
+    networks = []
+    for region in regions:
+        net = npu.train_region(region, hidden, epochs)
+        if net is None:
+            print('{}: no samples'.format(region.name))
+            continue
+        print('{}: topology {}, {} samples, error {:.4f}'.format(
+            region.name,
+            ' '.join(str(n) for n in net.mlp.topology),
+            len(region.samples),
+            net.error,
+        ))
+        networks.append(net)
+
+    with io.open(output, 'w') as f:
+        npu.write_weights(networks, f)
+
+
 def main():
     try:
         cli()
@@ -18,10 +18,20 @@ from collections import namedtuple
 import itertools
 import errno
 import math
+import struct
+import json
 
 
 EVALSCRIPT = 'eval.py'
 CONFIGFILE = 'accept_config.txt'
+BINCONFIGFILE = 'accept_config.bin'
+SYNCPROF_FILE = 'accept_syncprof.txt'
+LOADPROF_FILE = 'accept_loadprof.txt'
+LOG_FILES = {
+    'text': 'accept_log.txt',
+    'jsonl': 'accept_log.jsonl',
+    'binary': 'accept_log.bin',
+}
 BASEDIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
 OUTPUTS_DIR = os.path.join(BASEDIR, 'saved_outputs')
 MAX_ERROR = 0.3
@@ -31,9 +41,31 @@ PARAM_MAX = {
     'loop': 10,
     'lock': 1,
     'barrier': 1,
+    'condvar': 4,
     'alias': 1,
-    'npu_region': 1,
+    'npu_region': 4,
+    'npu_precision': 2,
+    'precision': 3,
+    'storage': 3,
+    'memo': 5,
+    'fastmath': 3,
+    'parallel': 7,
+    'store': 6,
+    'load': 4,
+    'convergence': 5,
+    'subsample': 4,
+    'reuse': 3,
+    'branch': 4,
+}
+SYNC_WORDS = ('lock', 'barrier')
+# Sites that only take effect when another site at the same location is
+# enabled: an NPU region's precision is meaningless if the region is not
+# replaced.
+DEPENDENT_SITES = {
+    'npu_precision': 'npu_region',
 }
+SYNC_MIN_WAIT_SHARE = 0.01  # Fraction of total wait time to consider a site.
+LOAD_MIN_SLOW_SHARE = 0.01  # Fraction of all slow loads to consider a site.
 EPSILON_ERROR = 0.001
 EPSILON_SPEEDUP = 0.01
 BUILD_TIMEOUT = 60 * 20
@@ -248,6 +280,201 @@ def dump_relax_config(config, f):
         f.write('{} {}\n'.format(param, ident))
 
 
+def fnv1a_64(s):
+    """The 64-bit FNV-1a hash of a string, which identifies sites in
+    binary configuration files.
+    """
+    h = 14695981039346656037
+    for c in bytearray(s.encode('utf8')):
+        h ^= c
+        h = (h * 1099511628211) & 0xffffffffffffffff
+    return h
+
+
+def dump_relax_config_binary(config, f):
+    """Write a relaxation configuration in the compiler's binary format
+    to a file-like object (opened in binary mode): a header with a magic
+    number, a version, and the entry count, followed by (hash, parameter)
+    entries sorted by site hash.
+    """
+    entries = {}
+    for ident, param in config:
+        entries[fnv1a_64(ident)] = param
+    f.write(struct.pack('<4sIQ', b'ACFG', 1, len(entries)))
+    for h in sorted(entries):
+        f.write(struct.pack('<QiI', h, entries[h], 0))
+
+
+# Contention profiles for synchronization sites.
+
+def parse_sync_profile(f):
+    """Parse a contention profile written by the ACCEPT runtime. Return
+    a dict mapping site idents to (wait, hold, count) tuples, where the
+    wait and hold times are in seconds.
+    """
+    profile = {}
+    for line in f:
+        line = line.strip()
+        if line:
+            wait, hold, count, ident = line.split(None, 3)
+            old_wait, old_hold, old_count = profile.get(ident, (0.0, 0.0, 0))
+            profile[ident] = (old_wait + float(wait), old_hold + float(hold),
+                              old_count + int(count))
+    return profile
+
+
+def prioritize_sync_configs(configs, profile):
+    """Given a list of base configurations and a contention profile,
+    return a new list in which the configurations for lock and barrier
+    sites are ordered by decreasing wait time. Sync sites that never
+    executed or account for only a small share of the total wait time
+    are dropped. Other configurations are kept in their original order.
+    """
+    total_wait = sum(wait for wait, _, _ in profile.values())
+
+    other = []
+    sync = []
+    for config in configs:
+        idents = [ident for ident, param in config if param]
+        if len(idents) == 1 and idents[0].startswith(SYNC_WORDS):
+            ident = idents[0]
+            if ident not in profile:
+                continue
+            wait = profile[ident][0]
+            if total_wait and wait / total_wait < SYNC_MIN_WAIT_SHARE:
+                continue
+            sync.append((wait, config))
+        else:
+            other.append(config)
+
+    sync.sort(key=lambda p: p[0], reverse=True)
+    return [config for _, config in sync] + other
+
+
+# Miss profiles for approximate load sites.
+
+def parse_load_profile(f):
+    """Parse a load miss profile written by the ACCEPT runtime. Return
+    a dict mapping site idents to (count, slow, cycles) tuples, where
+    `slow` is the number of accesses that took long enough to be
+    counted as cache misses.
+    """
+    profile = {}
+    for line in f:
+        line = line.strip()
+        if line:
+            count, slow, cycles, ident = line.split(None, 3)
+            old_count, old_slow, old_cycles = profile.get(ident, (0, 0, 0))
+            profile[ident] = (old_count + int(count), old_slow + int(slow),
+                              old_cycles + int(cycles))
+    return profile
+
+
+def prioritize_load_configs(configs, profile):
+    """Given a list of base configurations and a load miss profile,
+    return a new list in which the configurations for load prediction
+    sites are ordered by decreasing number of slow accesses. Load sites
+    that never executed or account for only a small share of the slow
+    accesses are dropped. Other configurations keep their order.
+    """
+    total_slow = sum(slow for _, slow, _ in profile.values())
+
+    other = []
+    loads = []
+    for config in configs:
+        idents = [ident for ident, param in config if param]
+        if len(idents) == 1 and idents[0].startswith('load '):
+            ident = idents[0]
+            if ident not in profile:
+                continue
+            slow = profile[ident][1]
+            if not total_slow or slow / total_slow < LOAD_MIN_SLOW_SHARE:
+                continue
+            loads.append((slow, config))
+        else:
+            other.append(config)
+
+    loads.sort(key=lambda p: p[0], reverse=True)
+    return [config for _, config in loads] + other
+
+
+# Structured compilation logs.
+
+class LogRecord(namedtuple('LogRecord', ['id', 'kind', 'file', 'line',
+                                         'text', 'blockers'])):
+    """A description from a structured compilation log. `blockers` is a
+    list of (line, instruction description) pairs.
+    """
+    __slots__ = ()
+
+    @property
+    def site(self):
+        """The name of the site, which begins the description's text.
+        """
+        return self.text.split('\n', 1)[0]
+
+
+def _read_log_binary(f):
+    def read(n):
+        data = f.read(n)
+        if len(data) != n:
+            raise EOFError()
+        return data
+
+    def read_int():
+        return struct.unpack('<i', read(4))[0]
+
+    def read_str():
+        return read(struct.unpack('<I', read(4))[0]).decode('utf8',
+                                                            'replace')
+
+    version = struct.unpack('<I', read(4))[0]
+    if version != 1:
+        raise ValueError('unsupported log version {}'.format(version))
+    while True:
+        try:
+            header = f.read(4)
+            if not header:
+                return
+            if len(header) != 4:
+                raise EOFError()
+            ident = struct.unpack('<I', header)[0]
+            kind = read_str()
+            fn = read_str()
+            line = read_int()
+            text = read_str()
+            blockers = [(read_int(), read_str())
+                        for _ in range(read_int())]
+        except EOFError:
+            # The compiler stopped partway through a record.
+            logging.warn('truncated compilation log')
+            return
+        yield LogRecord(ident, kind, fn, line, text, blockers)
+
+
+def read_log(f):
+    """Parse a structured compilation log, written by the compiler with
+    `-accept-log-format=jsonl` or `binary`, from a file-like object
+    opened in binary mode. Generate LogRecord objects in the order the
+    compiler produced them.
+    """
+    magic = f.read(4)
+    if magic == b'ALOG':
+        for record in _read_log_binary(f):
+            yield record
+        return
+
+    first = magic + f.readline()
+    for line in itertools.chain([first], f):
+        line = line.strip()
+        if not line:
+            continue
+        obj = json.loads(line.decode('utf8', 'replace'))
+        yield LogRecord(obj['id'], obj['kind'], obj['file'], obj['line'],
+                        obj['text'],
+                        [(b['line'], b['inst']) for b in obj['blockers']])
+
+
 # Loading the evaluation script.
 
 def load_eval_funcs(appdir):
@@ -286,8 +513,12 @@ def build_and_execute(directory, relax_config, test, rep, timeout=None):
             if relax_config:
                 with open(CONFIGFILE, 'w') as f:
                     dump_relax_config(relax_config, f)
-            elif os.path.exists(CONFIGFILE):
-                os.remove(CONFIGFILE)
+                with open(BINCONFIGFILE, 'wb') as f:
+                    dump_relax_config_binary(relax_config, f)
+            else:
+                for fn in (CONFIGFILE, BINCONFIGFILE):
+                    if os.path.exists(fn):
+                        os.remove(fn)
 
             approx = bool(relax_config)
             build(approx)
@@ -346,6 +577,47 @@ def build_and_execute(directory, relax_config, test, rep, timeout=None):
                      roitime, execlog)
 
 
+def _profile(directory, make_arg, filename, parse, test=False):
+    """Build the application in the given directory with a profiling
+    make variable set, run it precisely, and parse the profile file it
+    writes with `parse`. Return an empty profile if the program did not
+    write one.
+    """
+    with chdir(directory):
+        with sandbox(True):
+            run_cmd(['make', 'clean'] + _make_args())
+            for fn in (CONFIGFILE, BINCONFIGFILE):
+                if os.path.exists(fn):
+                    os.remove(fn)
+
+            build(make_args=['{}=1'.format(make_arg)])
+            _, status, _ = execute(None, test=test)
+            if status:
+                logging.warn('profiling run failed')
+
+            try:
+                with open(filename) as f:
+                    return parse(f)
+            except (OSError, IOError):
+                return {}
+
+
+def profile_sync(directory, test=False):
+    """Build and run the application with contention profiling enabled
+    and return its contention profile (see `parse_sync_profile`).
+    """
+    return _profile(directory, 'ACCEPT_SYNCPROF', SYNCPROF_FILE,
+                    parse_sync_profile, test)
+
+
+def profile_loads(directory, test=False):
+    """Build and run the application with load miss profiling enabled
+    and return its miss profile (see `parse_load_profile`).
+    """
+    return _profile(directory, 'ACCEPT_LOADPROF', LOADPROF_FILE,
+                    parse_load_profile, test)
+
+
 # Configuration space exploration.
 
 
@@ -354,12 +626,23 @@ def permute_config(base, param=1):
     (relaxed) configurations.
 
     These are *base* configurations: in each, exactly one site is
-    enabled and its parameter is set to `param` (default 1).
+    enabled and its parameter is set to `param` (default 1). A
+    dependent site (see `DEPENDENT_SITES`) also enables the site it
+    depends on, and is skipped if that site does not exist.
     """
+    indices = dict((ident, i) for i, (ident, _) in enumerate(base))
     for i in range(len(base)):
         config = list(base)
         ident, _ = config[i]
         config[i] = ident, param
+
+        kind, _, loc = ident.partition(' ')
+        if kind in DEPENDENT_SITES:
+            parent = DEPENDENT_SITES[kind] + ' ' + loc
+            if parent not in indices:
+                continue
+            config[indices[parent]] = parent, 1
+
         yield tuple(config)
 
 
@@ -695,7 +978,7 @@ class Evaluation(object):
     """The state for the evaluation of a single application.
     """
     def __init__(self, appdir, client, reps, test_reps, simulate=False,
-                 timeout_factor=3):
+                 timeout_factor=3, syncprof=False, loadprof=False):
         """Set up an experiment. Takes an active CWMemo instance,
         `client`, through which jobs will be submitted and outputs
         collected.
@@ -709,6 +992,11 @@ class Evaluation(object):
         `timeout_factor` sets how long relaxed executions have to
         finish, as a multiple of the precise running time. If it is
         `None`, there is no timeout.
+
+        `syncprof` enables a contention profiling run that is used to
+        prioritize (and prune) lock and barrier elision candidates.
+        `loadprof` does the same for load prediction candidates with a
+        cache miss profiling run.
         """
         self.appdir = normpath(appdir)
         self.client = client
@@ -717,6 +1005,8 @@ class Evaluation(object):
         self.reps = reps
         self.test_reps = test_reps
         self.timeout_factor = timeout_factor
+        self.syncprof = syncprof
+        self.loadprof = loadprof
 
         self.appname = os.path.basename(self.appdir)
 
@@ -729,6 +1019,8 @@ class Evaluation(object):
         self.base_elapsed = None
         self.base_config = None
         self.base_configs = None
+        self.sync_profile = None
+        self.load_profile = None
         self.results = []
 
         # Results for the *testing* executions.
@@ -774,6 +1066,12 @@ class Evaluation(object):
                 timeout=None
             )
 
+        # Contention profile, used to order the sync elision candidates.
+        if self.syncprof and not test:
+            self.client.submit(profile_sync, self.appdir)
+        if self.loadprof and not test:
+            self.client.submit(profile_loads, self.appdir)
+
         # Get information from the first execution. The rest of the
         # executions are for timing and can finish later.
         pex = self.client.get(build_and_execute, self.appdir, None, test, 0)
@@ -786,6 +1084,23 @@ class Evaluation(object):
             self.base_config = pex.config
             self.base_configs = list(permute_config(self.base_config))
 
+            if self.syncprof:
+                self.sync_profile = self.client.get(profile_sync,
+                                                    self.appdir)
+                self.base_configs = prioritize_sync_configs(
+                    self.base_configs, self.sync_profile
+                )
+                logging.info('{} base configs after contention '
+                             'profiling'.format(len(self.base_configs)))
+            if self.loadprof:
+                self.load_profile = self.client.get(profile_loads,
+                                                    self.appdir)
+                self.base_configs = prioritize_load_configs(
+                    self.base_configs, self.load_profile
+                )
+                logging.info('{} base configs after load miss '
+                             'profiling'.format(len(self.base_configs)))
+
     def precise_times(self, test=False):
         """Generate the durations for the precise executions. Must be
         called after `setup`.
@@ -0,0 +1,280 @@
+"""Offline training for NPU regions.
+
+Programs built with `-accept-npu-trace` record the inputs and outputs of
+each NPU candidate region in `accept_npu_trace.bin`. This module reads
+such traces, fits a small multilayer perceptron to each region, and
+writes the networks in the format the software NPU runtime
+(`rt/acceptnpu.c`) loads from `accept_npu_weights.txt`.
+
+The networks are small and the samples few, so training uses plain
+Python (stochastic gradient descent with momentum) to avoid adding
+dependencies to the driver.
+"""
+from __future__ import print_function
+from __future__ import division
+import struct
+import random
+import math
+import logging
+
+
+TRACE_MAGIC = b'ANPT'
+TRACE_VERSION = 1
+TRACE_FILE = 'accept_npu_trace.bin'
+WEIGHTS_FILE = 'accept_npu_weights.txt'
+
+# Candidate hidden-layer shapes, tried in order when no topology is given.
+HIDDEN_CANDIDATES = [(2,), (4,), (8,), (8, 8)]
+MAX_SAMPLES = 2000  # Samples used for training each region.
+HOLDOUT = 0.2  # Fraction of samples used to compare topologies.
+
+
+class TraceError(Exception):
+    """The trace file is malformed."""
+
+
+class Region(object):
+    """The samples recorded for one NPU region."""
+    def __init__(self, name, nin, nout):
+        self.name = name
+        self.nin = nin
+        self.nout = nout
+        self.samples = []  # (inputs, outputs) tuples.
+
+
+def read_trace(f):
+    """Read a binary trace from a file-like object. Return a list of
+    Region objects in the order they first appear.
+    """
+    header = f.read(8)
+    if len(header) != 8 or header[:4] != TRACE_MAGIC:
+        raise TraceError('not an NPU trace')
+    version, = struct.unpack('<I', header[4:])
+    if version != TRACE_VERSION:
+        raise TraceError('unsupported trace version {}'.format(version))
+
+    regions = {}
+    order = []
+    while True:
+        tag = f.read(1)
+        if not tag:
+            break
+
+        if tag == b'R':
+            ident, nin, nout, namelen = struct.unpack('<HHHH', f.read(8))
+            name = f.read(namelen).decode('utf8')
+            region = Region(name, nin, nout)
+            regions[ident] = region
+            order.append(region)
+
+        elif tag == b'S':
+            ident, = struct.unpack('<H', f.read(2))
+            if ident not in regions:
+                raise TraceError('sample for unknown region {}'.format(ident))
+            region = regions[ident]
+            count = region.nin + region.nout
+            data = f.read(4 * count)
+            if len(data) != 4 * count:
+                # Truncated by an abnormal exit; ignore the partial sample.
+                break
+            values = struct.unpack('<{}f'.format(count), data)
+            region.samples.append((values[:region.nin],
+                                   values[region.nin:]))
+
+        else:
+            raise TraceError('unknown record type {!r}'.format(tag))
+
+    return order
+
+
+# The network.
+
+def _sigmoid(x):
+    if x < -60.0:
+        return 0.0
+    return 1.0 / (1.0 + math.exp(-x))
+
+
+class MLP(object):
+    """A multilayer perceptron with sigmoid hidden layers and a linear
+    output layer, matching the software NPU's evaluator.
+    """
+    def __init__(self, topology, rand):
+        self.topology = list(topology)
+        self.weights = []  # Per layer: list of rows (one per output).
+        self.biases = []
+        for nin, nout in zip(self.topology, self.topology[1:]):
+            bound = math.sqrt(6.0 / (nin + nout))
+            self.weights.append([[rand.uniform(-bound, bound)
+                                  for _ in range(nin)]
+                                 for _ in range(nout)])
+            self.biases.append([0.0] * nout)
+
+    def forward(self, x):
+        """Evaluate the network, returning the activations of every
+        layer (including the input).
+        """
+        acts = [list(x)]
+        last = len(self.weights) - 1
+        for l, (w, b) in enumerate(zip(self.weights, self.biases)):
+            prev = acts[-1]
+            out = []
+            for row, bias in zip(w, b):
+                s = bias
+                for wi, xi in zip(row, prev):
+                    s += wi * xi
+                out.append(s if l == last else _sigmoid(s))
+            acts.append(out)
+        return acts
+
+    def train(self, samples, epochs, rate=0.05, momentum=0.9, rand=None):
+        """Fit the network to (input, target) pairs by stochastic
+        gradient descent on the squared error.
+        """
+        vw = [[[0.0] * len(row) for row in w] for w in self.weights]
+        vb = [[0.0] * len(b) for b in self.biases]
+        samples = list(samples)
+        last = len(self.weights) - 1
+
+        for epoch in range(epochs):
+            if rand:
+                rand.shuffle(samples)
+            lr = rate / (1.0 + epoch * 0.1)
+            for x, y in samples:
+                acts = self.forward(x)
+
+                # Output layer error (linear).
+                delta = [o - t for o, t in zip(acts[-1], y)]
+                for l in range(last, -1, -1):
+                    prev = acts[l]
+                    w = self.weights[l]
+
+                    # Error for the previous layer (sigmoid derivative).
+                    if l > 0:
+                        prev_delta = []
+                        for i, a in enumerate(prev):
+                            s = 0.0
+                            for j, d in enumerate(delta):
+                                s += w[j][i] * d
+                            prev_delta.append(s * a * (1.0 - a))
+
+                    for j, d in enumerate(delta):
+                        row = w[j]
+                        vrow = vw[l][j]
+                        for i, a in enumerate(prev):
+                            vrow[i] = momentum * vrow[i] - lr * d * a
+                            row[i] += vrow[i]
+                        vb[l][j] = momentum * vb[l][j] - lr * d
+                        self.biases[l][j] += vb[l][j]
+
+                    if l > 0:
+                        delta = prev_delta
+
+    def error(self, samples):
+        """Mean squared error over (input, target) pairs."""
+        if not samples:
+            return 0.0
+        total = 0.0
+        for x, y in samples:
+            out = self.forward(x)[-1]
+            total += sum((o - t) ** 2 for o, t in zip(out, y)) / len(y)
+        return total / len(samples)
+
+
+# Normalization.
+
+def _stats(vectors, n):
+    """Per-component mean and standard deviation."""
+    count = len(vectors)
+    means = [sum(v[i] for v in vectors) / count for i in range(n)]
+    stds = []
+    for i in range(n):
+        var = sum((v[i] - means[i]) ** 2 for v in vectors) / count
+        std = math.sqrt(var)
+        stds.append(std if std > 1e-12 else 1.0)
+    return means, stds
+
+
+class Network(object):
+    """A trained network for a region, with its normalization."""
+    def __init__(self, name, mlp, in_offset, in_scale, out_offset,
+                 out_scale, error):
+        self.name = name
+        self.mlp = mlp
+        self.in_offset = in_offset
+        self.in_scale = in_scale
+        self.out_offset = out_offset
+        self.out_scale = out_scale
+        self.error = error  # Normalized validation MSE.
+
+
+def train_region(region, hidden=None, epochs=50, seed=0):
+    """Fit a network to a region's samples. If `hidden` (a sequence of
+    hidden layer sizes) is not given, several small topologies are tried
+    and the one with the lowest held-out error is kept. Return a Network
+    or None if the region has no samples.
+    """
+    if not region.samples:
+        return None
+    rand = random.Random(seed)
+
+    samples = list(region.samples)
+    rand.shuffle(samples)
+    samples = samples[:MAX_SAMPLES]
+
+    inputs = [s[0] for s in samples]
+    outputs = [s[1] for s in samples]
+    in_mean, in_std = _stats(inputs, region.nin)
+    out_mean, out_std = _stats(outputs, region.nout)
+    norm = [
+        ([(x - m) / s for x, m, s in zip(inp, in_mean, in_std)],
+         [(y - m) / s for y, m, s in zip(out, out_mean, out_std)])
+        for inp, out in samples
+    ]
+
+    split = max(1, int(len(norm) * (1.0 - HOLDOUT)))
+    train_set = norm[:split]
+    valid_set = norm[split:] or train_set
+
+    candidates = [tuple(hidden)] if hidden else HIDDEN_CANDIDATES
+    best = None
+    for shape in candidates:
+        topology = [region.nin] + list(shape) + [region.nout]
+        mlp = MLP(topology, rand)
+        mlp.train(train_set, epochs, rand=rand)
+        err = mlp.error(valid_set)
+        logging.info(u'{}: topology {} error {}'.format(
+            region.name, topology, err
+        ))
+        if best is None or err < best[1]:
+            best = mlp, err
+
+    mlp, err = best
+    return Network(region.name, mlp,
+                   in_mean, [1.0 / s for s in in_std],
+                   out_mean, out_std, err)
+
+
+def _floats(values):
+    return u' '.join(repr(float(v)) for v in values)
+
+
+def write_weights(networks, f):
+    """Write trained networks to a file-like object in the software
+    NPU's weights format.
+    """
+    for net in networks:
+        f.write(u'region {}\n'.format(net.name))
+        f.write(u'topology {}\n'.format(
+            u' '.join(str(n) for n in net.mlp.topology)
+        ))
+        f.write(u'input_offset {}\n'.format(_floats(net.in_offset)))
+        f.write(u'input_scale {}\n'.format(_floats(net.in_scale)))
+        f.write(u'output_offset {}\n'.format(_floats(net.out_offset)))
+        f.write(u'output_scale {}\n'.format(_floats(net.out_scale)))
+        f.write(u'weights\n')
+        for w, b in zip(net.mlp.weights, net.mlp.biases):
+            for row in w:
+                f.write(_floats(row) + u'\n')
+            f.write(_floats(b) + u'\n')
+        f.write(u'end\n')
@@ -0,0 +1,55 @@
+#include <enerc.h>
+#include <stdio.h>
+
+// Kernels whose loops LLVM cannot vectorize or hoist from on its own
+// because approximate outputs might alias their inputs. With alias
+// relaxation enabled, ACCEPT's alias analysis separates them.
+
+#define N 4096
+#define REPS 1000
+
+APPROX float xs[N];
+APPROX float ys[N];
+APPROX float zs[N];
+float gain = 1.5f;
+
+// The gain is loaded on every iteration unless the stores to `out` are
+// known not to modify it.
+void scale(APPROX float *out, APPROX float *in, float *k, int n) {
+  int i;
+  for (i = 0; i < n; ++i)
+    out[i] = in[i] * *k;
+}
+
+// Both arrays are approximate: relaxation lets the loop run without
+// overlap checks.
+void saxpy(APPROX float *y, APPROX float *x, float a, int n) {
+  int i;
+  for (i = 0; i < n; ++i)
+    y[i] += a * x[i];
+}
+
+// An accumulator in memory: relaxation allows it to be kept in a register
+// for the whole loop.
+void accumulate(APPROX float *sum, APPROX float *in, int n) {
+  int i;
+  for (i = 0; i < n; ++i)
+    *sum += in[i];
+}
+
+int main() {
+  int i, r;
+  APPROX float total = 0.0f;
+
+  for (i = 0; i < N; ++i) {
+    xs[i] = (float)i / N;
+    ys[i] = 1.0f - xs[i];
+  }
+  for (r = 0; r < REPS; ++r) {
+    scale(zs, xs, &gain, N);
+    saxpy(ys, zs, 0.001f, N);
+    accumulate(&total, ys, N);
+  }
+  printf("%f\n", ENDORSE(total));
+  return 0;
+}
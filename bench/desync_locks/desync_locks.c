@@ -0,0 +1,67 @@
+#include <enerc.h>
+#include <pthread.h>
+#include <stdio.h>
+
+// A synthetic module with hundreds of lock-protected updates to approximate
+// counters spread over a few large functions.
+
+#define NCOUNTERS 16
+#define NTHREADS 4
+#define NITERS 1000
+
+pthread_mutex_t locks[NCOUNTERS];
+APPROX int counters[NCOUNTERS];
+
+// One critical section, guarded by a branch so the region spans blocks.
+#define SECTION(i, n) \
+  if ((n) & 1) { \
+    pthread_mutex_lock(&locks[(i) % NCOUNTERS]); \
+    counters[(i) % NCOUNTERS] += (n); \
+    pthread_mutex_unlock(&locks[(i) % NCOUNTERS]); \
+  } else { \
+    pthread_mutex_lock(&locks[(i) % NCOUNTERS]); \
+    if ((n) & 2) \
+      counters[(i) % NCOUNTERS] -= 1; \
+    else \
+      counters[(i) % NCOUNTERS] += 1; \
+    pthread_mutex_unlock(&locks[(i) % NCOUNTERS]); \
+  }
+
+#define SECTION4(i, n) \
+  SECTION(i, n) SECTION(i + 1, n + 1) SECTION(i + 2, n + 2) SECTION(i + 3, n + 3)
+#define SECTION16(i, n) \
+  SECTION4(i, n) SECTION4(i + 4, n) SECTION4(i + 8, n) SECTION4(i + 12, n)
+#define SECTION64(i, n) \
+  SECTION16(i, n) SECTION16(i + 1, n) SECTION16(i + 2, n) SECTION16(i + 3, n)
+
+void update0(int n) { SECTION64(0, n) SECTION64(5, n) }
+void update1(int n) { SECTION64(1, n) SECTION64(6, n) }
+void update2(int n) { SECTION64(2, n) SECTION64(7, n) }
+void update3(int n) { SECTION64(3, n) SECTION64(8, n) }
+
+void *worker(void *arg) {
+  int i;
+  for (i = 0; i < NITERS; ++i) {
+    update0(i);
+    update1(i);
+    update2(i);
+    update3(i);
+  }
+  return NULL;
+}
+
+int main(int argc, char **argv) {
+  pthread_t threads[NTHREADS];
+  int i;
+
+  for (i = 0; i < NCOUNTERS; ++i)
+    pthread_mutex_init(&locks[i], NULL);
+  for (i = 0; i < NTHREADS; ++i)
+    pthread_create(&threads[i], NULL, worker, NULL);
+  for (i = 0; i < NTHREADS; ++i)
+    pthread_join(threads[i], NULL);
+
+  for (i = 0; i < NCOUNTERS; ++i)
+    printf("%i\n", ENDORSE(counters[i]));
+  return 0;
+}
@@ -0,0 +1,38 @@
+#include <enerc.h>
+#include <stdio.h>
+
+// An in-place Gauss-Seidel solver for Laplace's equation on a large grid.
+// After the first sweeps, most cells change very little, so with store
+// elision most of the grid's cache lines stay clean.
+
+#define SIZE 2048
+#define SWEEPS 50
+
+APPROX float grid[SIZE][SIZE];
+
+void sweep() {
+  int i, j;
+  for (i = 1; i < SIZE - 1; ++i)
+    for (j = 1; j < SIZE - 1; ++j)
+      grid[i][j] = 0.25f * (grid[i - 1][j] + grid[i + 1][j] +
+                            grid[i][j - 1] + grid[i][j + 1]);
+}
+
+int main() {
+  int i, s;
+  APPROX float total = 0.0f;
+
+  // Fixed boundary: one hot edge.
+  for (i = 0; i < SIZE; ++i)
+    grid[0][i] = 100.0f;
+
+  accept_roi_begin();
+  for (s = 0; s < SWEEPS; ++s)
+    sweep();
+  accept_roi_end();
+
+  for (i = 0; i < SIZE; ++i)
+    total += grid[i][SIZE / 2];
+  printf("%f\n", ENDORSE(total));
+  return 0;
+}
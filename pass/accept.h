@@ -8,10 +8,16 @@
 #include "llvm/DebugInfo.h"
 #include "llvm/Analysis/ProfileInfo.h"
 #include "llvm/Analysis/LoopPass.h"
+#include "llvm/ADT/BitVector.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/ValueHandle.h"
+#include "llvm/IRBuilder.h"
 
 #include <set>
 #include <map>
 #include <string>
+#include <vector>
 #include <cassert>
 
 #define ECQ_PRECISE 0
@@ -33,8 +39,35 @@ namespace llvm {
   LoopPass *createLoopNPUPass();
   FunctionPass *createErrorInjectionPass();
   void initializeErrorInjectionPass(PassRegistry &Registry);
+  FunctionPass *createPrecisionReductionPass();
+  void initializePrecisionReductionPass(PassRegistry &Registry);
+  FunctionPass *createStorageCompactionPass();
+  void initializeStorageCompactionPass(PassRegistry &Registry);
+  FunctionPass *createMemoizationPass();
+  void initializeMemoizationPass(PassRegistry &Registry);
+  FunctionPass *createFastMathPass();
+  void initializeFastMathPass(PassRegistry &Registry);
+  FunctionPass *createLoopParallelPass();
+  void initializeLoopParallelPass(PassRegistry &Registry);
+  FunctionPass *createStoreElisionPass();
+  void initializeStoreElisionPass(PassRegistry &Registry);
+  FunctionPass *createLoadPredictionPass();
+  void initializeLoadPredictionPass(PassRegistry &Registry);
+  FunctionPass *createBranchRelaxPass();
+  void initializeBranchRelaxPass(PassRegistry &Registry);
   void initializeApproxInfoPass(PassRegistry &Registry);
 
+  // Conversions between float and 16-bit storage (IEEE half or bfloat16).
+  // The instructions they insert are tagged with `quals`.
+  Value *packFloat16(IRBuilder<> &builder, Value *v, bool bfloat,
+                     MDNode *quals = NULL);
+  Value *unpackFloat16(IRBuilder<> &builder, Value *v, bool bfloat,
+                       MDNode *quals = NULL);
+
+  // Whether |value - old| <= tolerance * |old| (false for NaNs).
+  Value *createWithinTolerance(IRBuilder<> &builder, Value *value, Value *old,
+                               double tolerance, const Twine &name = "");
+
   std::string srcPosDesc(const Module &mod, const DebugLoc &dl);
   std::string instDesc(const Module &mod, const Instruction *inst);
   std::string getFilename(const Module &mod, const DebugLoc &dl);
@@ -50,24 +83,60 @@ typedef enum {
   markerForbid
 } LineMarker;
 
+// Formats for the ACCEPT log (-accept-log-format).
+enum LogFormat {
+  logText,    // Human-readable, grouped by kind and location at exit.
+  logJSONL,   // One JSON object per description, streamed.
+  logBinary   // Length-prefixed records, streamed.
+};
+
 // Logging: a section of the ACCEPT log.
 class LogDescription {
 public:
-  LogDescription() : text(""), stream(NULL) {}
+  LogDescription() : text(""), stream(text), module(NULL) {
+    stream.SetUnbuffered();
+  }
   LogDescription(const LogDescription &d)
-    : text(d.text), blockers(d.blockers), stream(NULL) {}
+    : text(d.text), stream(text), module(d.module), blockers(d.blockers),
+      rendered(d.rendered) {
+    stream.SetUnbuffered();
+  }
   void operator=(const LogDescription &d);
-  ~LogDescription();
   bool operator==(const LogDescription &rhs);
   operator llvm::raw_ostream &();
   std::string &getText();
   void blocker(int lineno, llvm::StringRef s);
   void operator<<(const llvm::Instruction *inst);
+  void renderBlockers();
+  const std::vector< std::pair<int, std::string> > &getBlockers();
   std::string text;
-  std::map< int, std::vector<std::string> > blockers;
-  llvm::raw_string_ostream *stream;
+  llvm::raw_string_ostream stream;
+
+  // Blockers are recorded as references to the instructions and only
+  // described when the log is written (or before the instructions might be
+  // deleted). The handle is cleared if a transformation deletes the
+  // instruction first, in which case only its source position is shown.
+  // Unlike a WeakVH, it does not follow replaceAllUsesWith, which would
+  // describe the replacement (possibly not an instruction) instead.
+  class BlockerHandle : public llvm::CallbackVH {
+  public:
+    BlockerHandle(llvm::Value *v) : llvm::CallbackVH(v) {}
+    virtual void deleted() { setValPtr(NULL); }
+    virtual void allUsesReplacedWith(llvm::Value *) {}
+  };
+  struct Blocker {
+    int line;
+    llvm::DebugLoc loc;
+    BlockerHandle inst;
+    Blocker(int l, llvm::Instruction *i)
+      : line(l), loc(i->getDebugLoc()), inst(i) {}
+  };
+  const llvm::Module *module;
+  std::vector<Blocker> blockers;
+  std::vector< std::pair<int, std::string> > rendered;  // Sorted by line.
 
-  // The location of a LogDescription for positioning in the log.
+  // The location of a LogDescription for positioning in the log. The
+  // strings are interned by ApproxInfo.
   class Location {
     public:
       Location() : kind(""), fileName(""), lineNumber(0) {}
@@ -80,8 +149,8 @@ public:
             (this->fileName == rhs.fileName) &&
             (this->lineNumber == rhs.lineNumber);
       }
-      std::string kind;
-      std::string fileName;
+      llvm::StringRef kind;
+      llvm::StringRef fileName;
       int lineNumber;
   };
 
@@ -156,8 +225,79 @@ private:
   // Logging.
   std::map<LogDescription::Location, std::vector<LogDescription*>, LogDescription::cmpLocation> logDescs;
   bool logEnabled;
+  LogFormat logFormat;
   llvm::raw_fd_ostream *logFile;
+  llvm::BumpPtrAllocator logAlloc;  // Holds the LogDescriptions.
+  llvm::StringSet<llvm::BumpPtrAllocator> logStrings;  // Kinds and files.
   void dumpLog();
+  void renderLog();
+
+  // Streaming logs: descriptions are held only until the passes are done
+  // with the current function.
+  std::vector< std::pair<LogDescription::Location, LogDescription*> >
+      pendingDescs;
+  unsigned logRecords;
+  void flushLog();
+  void writeRecord(const LogDescription::Location &loc,
+                   LogDescription *desc);
+};
+
+// Synchronization calls in a function, cached for critical section discovery.
+// The calls are stored in dominator-tree preorder so that the sync points
+// dominated by an acquire immediately follow it.
+struct SyncCache {
+  llvm::Function *func;
+  std::vector<llvm::Instruction*> points;
+  std::map<llvm::Instruction*, unsigned> pointIndex;
+  std::map<llvm::BasicBlock*, unsigned> blockIndex;
+  llvm::BitVector syncBlocks;  // Blocks containing any sync call.
+
+  SyncCache() : func(NULL) {}
+};
+
+// A lock or barrier site to be instrumented for contention profiling. The
+// release is NULL for barriers and for acquires without a matching release.
+struct SyncProfileSite {
+  llvm::Instruction *acq;
+  llvm::Instruction *rel;
+  std::string name;
+
+  SyncProfileSite(llvm::Instruction *a, llvm::Instruction *r,
+                  const std::string &n) : acq(a), rel(r), name(n) {}
+};
+
+// The relaxation configuration: a parameter for each site. Lookups go
+// through a table sorted by 64-bit hashes of the site names, which can be
+// loaded directly from the binary format (accept_config.bin). The names
+// themselves are only kept for sites added by the analysis, so they can be
+// written to the text format (accept_config.txt).
+class RelaxConfig {
+public:
+  RelaxConfig() : sorted(true) {}
+
+  // The parameter for a site, or 0 if it is not in the configuration.
+  int lookup(const std::string &ident) const;
+  // Add or update a site.
+  void insert(const std::string &ident, int param);
+  size_t size() const;
+
+  bool loadText(const char *path);
+  bool loadBinary(const char *path);
+  void dumpText(const char *path) const;
+
+  static uint64_t hash(const std::string &ident);
+
+private:
+  struct Entry {
+    uint64_t hash;
+    int param;
+    bool operator<(const Entry &other) const { return hash < other.hash; }
+  };
+  mutable std::vector<Entry> entries;
+  mutable bool sorted;
+  std::map<std::string, int> names;
+
+  void sort() const;
 };
 
 // The pass that actually performs optimizations.
@@ -165,7 +305,7 @@ struct ACCEPTPass : public llvm::FunctionPass {
   static char ID;
 
   llvm::Module *module;
-  std::map<std::string, int> relaxConfig;  // ident -> param
+  RelaxConfig relaxConfig;
   int opportunityId;
   std::map<llvm::Function*, llvm::DISubprogram> funcDebugInfo;
   ApproxInfo *AI;
@@ -188,13 +328,26 @@ struct ACCEPTPass : public llvm::FunctionPass {
   void dumpRelaxConfig();
   void loadRelaxConfig();
 
+  SyncCache syncCache;
+  void buildSyncCache(llvm::Function &F);
+  bool critSecRegion(llvm::Instruction *acq, llvm::Instruction *rel,
+      llvm::BitVector &region);
+
+  std::vector<SyncProfileSite> syncProfileSites;
+  void noteSyncSite(llvm::Instruction *acq, llvm::Instruction *rel,
+      const std::string &name);
+  void instrumentSyncSites();
+
+  void noteAliasSite(llvm::Function &F);
+
   bool optimizeSync(llvm::Function &F);
   bool optimizeAcquire(llvm::Instruction *inst);
   bool optimizeBarrier(llvm::Instruction *bar1);
+  bool optimizeCondWait(llvm::Instruction *wait);
   llvm::Instruction *findCritSec(llvm::Instruction *acq,
       std::set<llvm::Instruction*> &cs, LogDescription *desc);
   llvm::Instruction *findApproxCritSec(llvm::Instruction *acq,
-      LogDescription *desc);
+      LogDescription *desc, const std::set<llvm::Instruction*> *inner=NULL);
   bool nullifyApprox(llvm::Function &F);
 };
 
@@ -204,3 +357,6 @@ bool isApproxPtr(const llvm::Value *value);
 bool isCallOf(llvm::Instruction *inst, const char *fname);
 bool isAcquire(llvm::Instruction *inst);
 bool isRelease(llvm::Instruction *inst);
+llvm::AllocaInst *localBase(llvm::Value *ptr);
+bool isLocalPtr(llvm::Value *ptr);
+llvm::Value *setQuals(llvm::Value *v, llvm::MDNode *quals);
@@ -6,11 +6,30 @@
 #include "llvm/GlobalVariable.h"
 #include "accept.h"
 #include <fstream>
+#include <map>
+#include <set>
 #include <string>
+#include <vector>
 #include <ctime>
 
 using namespace llvm;
 
+// Approximate alias analysis. Code that only computes approximate results
+// can tolerate a reordering of its approximate memory accesses, so in
+// functions where it is enabled, this analysis tells LLVM's optimizations
+// (LICM, GVN, the vectorizers) that approximate memory does not alias:
+//
+// * A pointer to approximate data (as typed in the source) does not alias
+//   any other location. The type system keeps approximate and precise data
+//   apart, so only approximate accesses can be reordered this way.
+// * Other locations that merely look approximate (approximately computed
+//   pointers and heap buffers filled with approximate data) are assumed
+//   not to alias each other, but are still checked against precise ones.
+//
+// Each function that accesses approximate memory is an "alias relaxation"
+// site. The analysis runs in the module pipeline, after inlining, so the
+// setting of the function that code ends up in applies.
+
 namespace {
   bool isMalloc(const Value *val) {
       if (const CallInst *call = dyn_cast<CallInst>(val)) {
@@ -21,11 +40,55 @@ namespace {
       return false;
   }
 
+  bool isApproxStore(const Value *val) {
+    const StoreInst *store = dyn_cast<StoreInst>(val);
+    return store && (isApprox(store) || isApproxPtr(store));
+  }
+
+  // A heap allocation (or a cast of one) that receives approximate data.
+  bool isApproxAlloc(const Value *val) {
+    if (const BitCastInst *cast = dyn_cast<BitCastInst>(val))
+      val = cast->getOperand(0);
+    if (!isMalloc(val))
+      return false;
+
+    for (Value::const_use_iterator ui = val->use_begin();
+          ui != val->use_end();
+          ++ui) {
+      const User *user = *ui;
+      if (isApproxStore(user)) {
+        return true;
+      } else if (isa<GetElementPtrInst>(user) && isApproxPtr(user)) {
+        return true;
+      } else if (isa<BitCastInst>(user)) {
+        for (Value::const_use_iterator bc_ui = user->use_begin();
+              bc_ui != user->use_end();
+              ++bc_ui) {
+          if (isApproxStore(*bc_ui))
+            return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // The function containing a pointer value, if any.
+  const Function *valueFunction(const Value *val) {
+    if (const Instruction *inst = dyn_cast<Instruction>(val))
+      return inst->getParent()->getParent();
+    if (const Argument *arg = dyn_cast<Argument>(val))
+      return arg->getParent();
+    return NULL;
+  }
+
+  std::string aliasSiteName(const Function &F) {
+    return "alias relaxation in " + F.getName().str();
+  }
+
   struct AcceptAA : public ImmutablePass, public AliasAnalysis {
     static char ID;
     ACCEPTPass *transformPass;
-    int relaxId;
-    int relaxParam;
+    std::map<const Function*, int> relaxParams;
 
     AcceptAA() : ImmutablePass(ID) {
       initializeAcceptAAPass(*PassRegistry::getPassRegistry());
@@ -42,258 +105,129 @@ namespace {
 
     virtual void getAnalysisUsage(AnalysisUsage &AU) const {
       AliasAnalysis::getAnalysisUsage(AU);
-      // dependencies?
     }
 
     virtual void initializePass() {
       InitializeAliasAnalysis(this);
+    }
 
-      // One global optimization parameter controls whether we should enable
-      // alias relaxation. (For now.)
-      std::string relaxName = "alias relaxation";
-      if (transformPass->relax) {
-        relaxParam = transformPass->relaxConfig[relaxName];
-      } else {
-        relaxParam = 0;
-        transformPass->relaxConfig[relaxName] = 0;
+    // Whether alias relaxation is enabled for a function's code.
+    bool relaxed(const Function *F) {
+      if (!F || !transformPass->relax)
+        return false;
+      std::map<const Function*, int>::iterator it = relaxParams.find(F);
+      if (it != relaxParams.end())
+        return it->second;
+
+      int param = transformPass->relaxConfig.lookup(aliasSiteName(*F));
+      relaxParams[F] = param;
+      return param;
+    }
+    // A constant pointer (a global or a constant GEP into one) belongs to
+    // no function; queries about it come from the functions that use it, so
+    // it is relaxed if all of them are. (Not cached: inlining and other
+    // transformations change its users.)
+    bool relaxedUsers(const Value *val) {
+      bool used = false, all = true;
+      std::set<const Value*> seen;
+      std::vector<const Value*> work(1, val);
+      while (!work.empty() && all) {
+        const Value *v = work.back();
+        work.pop_back();
+        for (Value::const_use_iterator ui = v->use_begin();
+             ui != v->use_end() && all; ++ui) {
+          const User *user = *ui;
+          if (const Instruction *inst = dyn_cast<Instruction>(user)) {
+            used = true;
+            all = relaxed(inst->getParent()->getParent());
+          } else if (isa<Constant>(user) && seen.insert(user).second) {
+            work.push_back(user);
+          }
+        }
       }
+      return used && all;
+    }
+    bool relaxed(const Location &LocA, const Location &LocB) {
+      const Function *F = valueFunction(LocA.Ptr);
+      if (!F)
+        F = valueFunction(LocB.Ptr);
+      if (F)
+        return relaxed(F);
+      return relaxedUsers(LocA.Ptr) && relaxedUsers(LocB.Ptr);
     }
 
-    bool approxLoc(const Value *val) {
-      if (isApproxPtr(val))
+    // Locations typed as approximate in the source.
+    bool approxTyped(const Location &Loc) {
+      return isApproxPtr(Loc.Ptr);
+    }
+    // Locations that look approximate by any evidence.
+    bool approxLoc(const Location &Loc) {
+      const Value *val = Loc.Ptr;
+      if (isApproxPtr(val) || isApproxAlloc(val))
         return true;
       if (const Instruction *inst = dyn_cast<Instruction>(val))
         if (isApprox(inst))
           return true;
       return false;
     }
-    bool approxLoc(const Location &Loc) {
-      return approxLoc(Loc.Ptr);
-    }
-
-    virtual bool pointToConstantMemory(const Location &Loc,
-        bool OrLocal=false) {
-      bool result = AliasAnalysis::pointsToConstantMemory(Loc, OrLocal);
-      if (!relaxParam)
-        return result;
-
-      if (approxLoc(Loc)) {
-        return true;
-      }
 
-      return result;
+    bool isPrecisePure(ImmutableCallSite CS) {
+      const Function *func = CS.getCalledFunction();
+      return func &&
+          transformPass->AI->isPrecisePure(const_cast<Function*>(func));
     }
-    virtual ModRefBehavior getModRefBehavior (ImmutableCallSite CS) {
+
+    // A precise-pure callee writes only approximate memory, so it can be
+    // treated as a reader.
+    virtual ModRefBehavior getModRefBehavior(ImmutableCallSite CS) {
       ModRefBehavior result = AliasAnalysis::getModRefBehavior(CS);
-      if (!relaxParam)
+      if (!relaxed(CS.getInstruction()->getParent()->getParent()))
         return result;
 
-      if (result == UnknownModRefBehavior) {
-        const Function *func = CS.getCalledFunction();
-        if (func && transformPass->AI->isPrecisePure(const_cast<Function*>(func))) {
-          return OnlyReadsMemory;
-        }
-      }
-
+      if (result == UnknownModRefBehavior && isPrecisePure(CS))
+        return OnlyReadsMemory;
       return result;
     }
-    virtual ModRefBehavior getModRefBehavior (const Function *F) {
-      ModRefBehavior result = AliasAnalysis::getModRefBehavior(F);
-      if (!relaxParam)
-        return result;
-
-      if (result == UnknownModRefBehavior) {
-        if (transformPass->AI->isPrecisePure(const_cast<Function*>(F))) {
-          return OnlyReadsMemory;
-        }
-      }
 
-      return result;
-    }
-    virtual ModRefResult getModRefInfo (ImmutableCallSite CS,
+    virtual ModRefResult getModRefInfo(ImmutableCallSite CS,
         const Location &Loc) {
       ModRefResult result = AliasAnalysis::getModRefInfo(CS, Loc);
-      if (!relaxParam)
+      if (result == NoModRef ||
+          !relaxed(CS.getInstruction()->getParent()->getParent()))
         return result;
 
-      const Function *func = CS.getCalledFunction();
-      if (func && transformPass->AI->isPrecisePure(const_cast<Function*>(func))) {
-        return NoModRef;
-      } else if (approxLoc(Loc)) {
-        return NoModRef;
-      }
-
+      // Even a location typed as approximate may be filled by the call
+      // (fread, memcpy, an initialization routine), so only callees that
+      // write no memory the program relies on lose their Mod.
+      if (isPrecisePure(CS) || onlyReadsMemory(CS))
+        return ModRefResult(result & Ref);
       return result;
     }
-    virtual ModRefResult getModRefInfo (ImmutableCallSite CS1,
+
+    virtual ModRefResult getModRefInfo(ImmutableCallSite CS1,
         ImmutableCallSite CS2) {
       ModRefResult result = AliasAnalysis::getModRefInfo(CS1, CS2);
-      if (!relaxParam)
+      if (result == NoModRef ||
+          !relaxed(CS1.getInstruction()->getParent()->getParent()))
         return result;
 
-      const Function *func1 = CS1.getCalledFunction();
-      const Function *func2 = CS2.getCalledFunction();
-      if ((func1 && transformPass->AI->isPrecisePure(const_cast<Function*>(func1))) ||
-          (func2 && transformPass->AI->isPrecisePure(const_cast<Function*>(func2)))) {
+      // Two callees that write only approximate memory can be reordered.
+      if (isPrecisePure(CS1) && isPrecisePure(CS2))
         return NoModRef;
-      }
-
       return result;
     }
 
     virtual AliasResult alias(const Location &LocA, const Location &LocB) {
+      // Delegate to other alias analyses first.
       AliasResult result = AliasAnalysis::alias(LocA, LocB);
-      if (!relaxParam)
+      if (result == NoAlias || result == MustAlias || !relaxed(LocA, LocB))
         return result;
 
-      if (result == MustAlias) {
-        return MustAlias;
-      } else if (approxLoc(LocA) || approxLoc(LocB)) {
+      if (approxTyped(LocA) || approxTyped(LocB))
         return NoAlias;
-      }
-
-      // Mallocs, callocs...
-      if (const Instruction *inst = dyn_cast<Instruction>(LocA.Ptr)) {
-        if (isMalloc(inst)) {
-            for (Value::const_use_iterator ui = inst->use_begin();
-                  ui != inst->use_end();
-                  ++ui) {
-              if (const Instruction *user = dyn_cast<Instruction>(*ui)) {
-                if (const StoreInst *si = dyn_cast<StoreInst>(user)) {
-                  if (isApproxPtr(si) || isApprox(si)) {
-                      return NoAlias;
-                  }
-                } else if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(user)) {
-                  if (isApproxPtr(user)) {
-                      return NoAlias;
-                  }
-                } else if (const BitCastInst *bc = dyn_cast<BitCastInst>(user)) {
-                  for (Value::const_use_iterator bc_ui = user->use_begin();
-                        bc_ui != user->use_end();
-                        ++bc_ui) {
-                    if (const Instruction *bc_user = dyn_cast<Instruction>(*bc_ui))
-                      if (const StoreInst *si_bc_user = dyn_cast<StoreInst>(bc_user))
-                        if (isApproxPtr(si_bc_user) || isApprox(si_bc_user)) {
-                            return NoAlias;
-                        }
-                  }
-                }
-              }
-            }
-        }
-      }
-      if (const Instruction *inst = dyn_cast<Instruction>(LocB.Ptr)) {
-        if (isMalloc(inst)) {
-            for (Value::const_use_iterator ui = inst->use_begin();
-                  ui != inst->use_end();
-                  ++ui) {
-              if (const Instruction *user = dyn_cast<Instruction>(*ui)) {
-                if (const StoreInst *si = dyn_cast<StoreInst>(user)) {
-                  if (isApproxPtr(si) || isApprox(si)) {
-                      return NoAlias;
-                  }
-                } else if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(user)) {
-                  if (isApproxPtr(user)) {
-                      return NoAlias;
-                  }
-                } else if (const BitCastInst *bc = dyn_cast<BitCastInst>(user)) {
-                  for (Value::const_use_iterator bc_ui = user->use_begin();
-                        bc_ui != user->use_end();
-                        ++bc_ui) {
-                    if (const Instruction *bc_user = dyn_cast<Instruction>(*bc_ui))
-                      if (const StoreInst *si_bc_user = dyn_cast<StoreInst>(bc_user))
-                        if (isApproxPtr(si_bc_user) || isApprox(si_bc_user)) {
-                            return NoAlias;
-                        }
-                  }
-                }
-              }
-            }
-        }
-      }
-
-      // Globals
-      if (const GlobalValue *GV = dyn_cast<GlobalValue>(LocA.Ptr))
-        if (const GlobalVariable *V = dyn_cast<GlobalVariable>(GV))
-          if (isApproxPtr(V)) {
-              return NoAlias;
-          }
-      if (const GlobalValue *GV = dyn_cast<GlobalValue>(LocB.Ptr))
-        if (const GlobalVariable *V = dyn_cast<GlobalVariable>(GV))
-          if (isApproxPtr(V)) {
-              return NoAlias;
-          }
-
-      // Getelementptr
-      if (const Instruction *inst = dyn_cast<Instruction>(LocA.Ptr))
-        if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(inst))
-          if (isApproxPtr(GEP)) {
-              return NoAlias;
-          }
-      if (const Instruction *inst = dyn_cast<Instruction>(LocB.Ptr))
-        if (const GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(inst))
-          if (isApproxPtr(GEP)) {
-              return NoAlias;
-          }
-
-      // Bitcasts
-      if (const Instruction *inst = dyn_cast<Instruction>(LocA.Ptr))
-        if (const BitCastInst *BC = dyn_cast<BitCastInst>(inst)) {
-          if (isMalloc(inst->getOperand(0))) {
-            for (Value::const_use_iterator ui = inst->use_begin();
-                  ui != inst->use_end();
-                  ++ui) {
-              const Instruction *user = dyn_cast<Instruction>(*ui);
-              if (const StoreInst *st = dyn_cast<StoreInst>(user))
-                if (isApprox(st) || isApproxPtr(st)) {
-                    return NoAlias;
-                }
-            }
-          }
-        }
-      if (const Instruction *inst = dyn_cast<Instruction>(LocB.Ptr))
-        if (const BitCastInst *BC = dyn_cast<BitCastInst>(inst)) {
-          if (isMalloc(inst->getOperand(0))) {
-            for (Value::const_use_iterator ui = inst->use_begin();
-                  ui != inst->use_end();
-                  ++ui) {
-              const Instruction *user = dyn_cast<Instruction>(*ui);
-              if (const StoreInst *st = dyn_cast<StoreInst>(user))
-                if (isApprox(st) || isApproxPtr(st)) {
-                    return NoAlias;
-                }
-            }
-          }
-        }
-
-      // Ordinary instructions
-      if (const Instruction *inst = dyn_cast<Instruction>(LocA.Ptr))
-        if (isApprox(inst) || isApproxPtr(inst)) {
-            return NoAlias;
-        }
-      if (const Instruction *inst = dyn_cast<Instruction>(LocB.Ptr))
-        if (isApprox(inst) || isApproxPtr(inst)) {
-            return NoAlias;
-        } 
-
-      /* DEBUG
-      else if (instA && instB) {
-        errs() << "instructions:\n";
-        instA->dump();
-        instB->dump();
-      } else {
-        const GlobalValue *gvA = dyn_cast<GlobalValue>(LocA.Ptr);
-        const GlobalValue *gvB = dyn_cast<GlobalValue>(LocB.Ptr);
-        if (gvA && gvB) {
-          errs() << "global values:\n";
-          gvA->dump();
-          gvB->dump();
-        }
-      }
-      */
-
-      // Delegate to other alias analyses.
-      return AliasAnalysis::alias(LocA, LocB);
+      if (approxLoc(LocA) && approxLoc(LocB))
+        return NoAlias;
+      return result;
     }
 
     // This required bit works around C++'s multiple inheritance weirdness.
@@ -306,6 +240,39 @@ namespace {
   };
 }
 
+// Offer alias relaxation for each function that accesses approximate memory.
+// (The analysis itself runs later, in the module pipeline.)
+void ACCEPTPass::noteAliasSite(Function &F) {
+  unsigned accesses = 0;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      Value *ptr = NULL;
+      if (LoadInst *load = dyn_cast<LoadInst>(ii))
+        ptr = load->getPointerOperand();
+      else if (StoreInst *store = dyn_cast<StoreInst>(ii))
+        ptr = store->getPointerOperand();
+      if (ptr && (isApproxPtr(ptr) || isApproxAlloc(ptr)))
+        ++accesses;
+    }
+  }
+  if (!accesses || F.empty())
+    return;
+
+  std::string optName = aliasSiteName(F);
+  LogDescription *desc = AI->logAdd("Alias", F.getEntryBlock().begin());
+  ACCEPT_LOG << optName << "\n";
+  ACCEPT_LOG << accesses << " accesses to approximate memory\n";
+  if (relax) {
+    if (relaxConfig.lookup(optName))
+      ACCEPT_LOG << "relaxing aliasing\n";
+    else
+      ACCEPT_LOG << "not relaxing aliasing\n";
+  } else {
+    ACCEPT_LOG << "can relax aliasing\n";
+    relaxConfig.insert(optName, 0);
+  }
+}
+
 char AcceptAA::ID = 0;
 INITIALIZE_AG_PASS(AcceptAA, AliasAnalysis, "acceptaa",
                    "ACCEPT approximate alias analysis",
@@ -3,6 +3,7 @@
 #include "llvm/Metadata.h"
 #include "llvm/Analysis/CaptureTracking.h"
 #include "llvm/IntrinsicInst.h"
+#include "llvm/Operator.h"
 #include "llvm/DebugInfo.h"
 #include "llvm/Module.h"
 #include "llvm/Support/CommandLine.h"
@@ -187,6 +188,30 @@ bool isRelease(Instruction *inst) {
   return isCallOf(inst, FUNC_RELEASE);
 }
 
+// The local variable a pointer is derived from (through casts and GEPs), if
+// any.
+AllocaInst *localBase(Value *ptr) {
+  while (true) {
+    ptr = ptr->stripPointerCasts();
+    if (GEPOperator *gep = dyn_cast<GEPOperator>(ptr))
+      ptr = gep->getPointerOperand();
+    else
+      break;
+  }
+  return dyn_cast<AllocaInst>(ptr);
+}
+bool isLocalPtr(Value *ptr) {
+  return localBase(ptr) != NULL;
+}
+
+// Give code that a transformation inserts the qualifiers of the code it
+// replaces, so later passes still see it as approximate. Returns the value.
+Value *setQuals(Value *v, MDNode *quals) {
+  if (Instruction *inst = dyn_cast<Instruction>(v))
+    inst->setMetadata("quals", quals);
+  return v;
+}
+
 // An internal whitelist for functions considered to be pure.
 char const* _funcWhitelistArray[] = {
   // math.h
@@ -229,25 +254,48 @@ bool acceptLogEnabled;
 cl::opt<bool, true> acceptLogEnabledOpt("accept-log",
     cl::desc("ACCEPT: write analysis log"),
     cl::location(acceptLogEnabled));
+cl::opt<LogFormat> acceptLogFormat("accept-log-format",
+    cl::desc("ACCEPT: format of the analysis log"),
+    cl::values(
+      clEnumValN(logText, "text", "human-readable (accept_log.txt)"),
+      clEnumValN(logJSONL, "jsonl", "streamed JSON lines (accept_log.jsonl)"),
+      clEnumValN(logBinary, "binary", "streamed records (accept_log.bin)"),
+      clEnumValEnd),
+    cl::init(logText));
 
 ApproxInfo::ApproxInfo() : FunctionPass(ID) {
   initializeApproxInfoPass(*PassRegistry::getPassRegistry());
   std::string error;
   logEnabled = acceptLogEnabled;
+  logFormat = acceptLogFormat;
+  logRecords = 0;
   if (logEnabled) {
-    logFile = new raw_fd_ostream("accept_log.txt", error);
+    if (logFormat == logJSONL)
+      logFile = new raw_fd_ostream("accept_log.jsonl", error);
+    else if (logFormat == logBinary)
+      logFile = new raw_fd_ostream("accept_log.bin", error,
+                                   raw_fd_ostream::F_Binary);
+    else
+      logFile = new raw_fd_ostream("accept_log.txt", error);
   }
 }
 
 ApproxInfo::~ApproxInfo() {
   if (logEnabled) {
-    dumpLog();
+    if (logFormat == logText)
+      dumpLog();
+    else
+      flushLog();
     logFile->close();
     delete logFile;
   }
 }
 
 bool ApproxInfo::runOnFunction(Function &F) {
+  // The other passes are done with the previous function, so its log
+  // descriptions can be written out.
+  if (logEnabled && logFormat != logText)
+    flushLog();
   return false;
 }
 
@@ -261,6 +309,13 @@ bool ApproxInfo::doInitialization(Module &M) {
 }
 
 bool ApproxInfo::doFinalization(Module &M) {
+  // Describe blockers while their instructions still exist.
+  if (logEnabled) {
+    if (logFormat == logText)
+      renderLog();
+    else
+      flushLog();
+  }
   return false;
 }
 
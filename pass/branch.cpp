@@ -0,0 +1,367 @@
+#include "llvm/Function.h"
+#include "llvm/Module.h"
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/Operator.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/PostDominators.h"
+#include "llvm/Support/CFG.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// Branch relaxation. EnerC only allows branching on approximate data through
+// an endorsement, and those branches tend to be hard to predict. A
+// conditional branch whose condition is computed from approximate values is
+// a "branch" site, relaxed in one of two ways:
+//
+// * If-conversion (level 1). When each side of the branch is a single block
+//   of simple instructions that rejoin, both sides are executed and their
+//   stores choose between the new and old values with selects. Loads and
+//   stores are only speculated on local variables and globals, so this does
+//   not change the results, except that calls to precise-pure functions
+//   (which may write approximate memory) run on both sides.
+// * Biasing (higher levels). The branch follows the direction it took the
+//   last time the condition was evaluated, and the condition is only
+//   evaluated once every 2^k executions. This is only offered when both
+//   sides of the branch have only approximate effects.
+
+namespace {
+  const int BRANCH_MAX_LEVEL = 4;
+  const unsigned BRANCH_MAX_SPECULATE = 64;
+
+  // Whether a condition is computed from approximate values (loaded or
+  // computed), looking through a few levels of instructions.
+  bool approxDerived(Value *val, int depth) {
+    Instruction *inst = dyn_cast<Instruction>(val);
+    if (!inst || depth == 0)
+      return false;
+    if (isApprox(inst))
+      return true;
+    if (isa<LoadInst>(inst) || isa<CallInst>(inst) || isa<PHINode>(inst))
+      return false;
+    for (unsigned i = 0; i < inst->getNumOperands(); ++i) {
+      if (approxDerived(inst->getOperand(i), depth - 1))
+        return true;
+    }
+    return false;
+  }
+
+  // Whether a pointer refers to a local variable or a global (or a
+  // constant offset into one), which is always safe to access.
+  bool isSafePtr(Value *ptr) {
+    while (true) {
+      ptr = ptr->stripPointerCasts();
+      GEPOperator *gep = dyn_cast<GEPOperator>(ptr);
+      if (!gep || !gep->hasAllConstantIndices())
+        break;
+      ptr = gep->getPointerOperand();
+    }
+    return isa<AllocaInst>(ptr) || isa<GlobalVariable>(ptr);
+  }
+}
+
+struct BranchRelax : public FunctionPass {
+  static char ID;
+  ACCEPTPass *transformPass;
+  ApproxInfo *AI;
+  Module *module;
+  LoopInfo *LI;
+  PostDominatorTree *PDT;
+
+  BranchRelax();
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual const char *getPassName() const;
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+  virtual bool runOnFunction(llvm::Function &F);
+
+  bool canSpeculate(BasicBlock *side, BasicBlock *pred, BasicBlock *join);
+  BasicBlock *convertibleJoin(BranchInst *br);
+  bool sidesApproximate(BranchInst *br);
+  bool tryToRelax(BranchInst *br);
+  void ifConvert(BranchInst *br, BasicBlock *join);
+  void bias(BranchInst *br, int logPeriod);
+};
+
+void BranchRelax::getAnalysisUsage(AnalysisUsage &AU) const {
+  FunctionPass::getAnalysisUsage(AU);
+  AU.addRequired<LoopInfo>();
+  AU.addRequired<PostDominatorTree>();
+}
+
+BranchRelax::BranchRelax() : FunctionPass(ID) {
+  initializeBranchRelaxPass(*PassRegistry::getPassRegistry());
+  module = 0;
+}
+
+const char *BranchRelax::getPassName() const {
+  return "ACCEPT branch relaxation";
+}
+
+bool BranchRelax::doInitialization(Module &M) {
+  module = &M;
+  transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
+  return false;
+}
+
+bool BranchRelax::doFinalization(Module &M) {
+  return false;
+}
+
+bool BranchRelax::runOnFunction(Function &F) {
+  AI = transformPass->AI;
+  LI = &getAnalysis<LoopInfo>();
+  PDT = &getAnalysis<PostDominatorTree>();
+
+  // Skip optimizing functions that seem to be in standard libraries.
+  if (transformPass->shouldSkipFunc(F))
+    return false;
+
+  std::vector<BranchInst*> branches;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    BranchInst *br = dyn_cast<BranchInst>(bi->getTerminator());
+    if (br && br->isConditional() &&
+        br->getSuccessor(0) != br->getSuccessor(1) &&
+        approxDerived(br->getCondition(), 6))
+      branches.push_back(br);
+  }
+
+  bool modified = false;
+  for (std::vector<BranchInst*>::iterator bi = branches.begin();
+       bi != branches.end(); ++bi)
+    modified |= tryToRelax(*bi);
+  return modified;
+}
+
+// Whether a side of a branch is a single block, entered only from the
+// branch, that falls through to the join and only contains instructions
+// that can be executed unconditionally.
+bool BranchRelax::canSpeculate(BasicBlock *side, BasicBlock *pred,
+                               BasicBlock *join) {
+  if (side->getSinglePredecessor() != pred)
+    return false;
+  BranchInst *br = dyn_cast<BranchInst>(side->getTerminator());
+  if (!br || br->isConditional() || br->getSuccessor(0) != join)
+    return false;
+  if (side->size() > BRANCH_MAX_SPECULATE)
+    return false;
+
+  for (BasicBlock::iterator ii = side->begin(); ii != side->end(); ++ii) {
+    if (isa<TerminatorInst>(ii) || isa<DbgInfoIntrinsic>(ii))
+      continue;
+    if (LoadInst *load = dyn_cast<LoadInst>(ii)) {
+      if (!load->isSimple() || !isSafePtr(load->getPointerOperand()))
+        return false;
+    } else if (StoreInst *store = dyn_cast<StoreInst>(ii)) {
+      if (!store->isSimple() || !isSafePtr(store->getPointerOperand()))
+        return false;
+    } else if (CallInst *call = dyn_cast<CallInst>(ii)) {
+      Function *callee = call->getCalledFunction();
+      if (!callee || !AI->isPrecisePure(callee))
+        return false;
+    } else if (BinaryOperator *op = dyn_cast<BinaryOperator>(ii)) {
+      switch (op->getOpcode()) {
+      case Instruction::UDiv:
+      case Instruction::SDiv:
+      case Instruction::URem:
+      case Instruction::SRem:
+        return false;  // May trap.
+      default:
+        break;
+      }
+    } else if (!isa<CastInst>(ii) && !isa<CmpInst>(ii) &&
+               !isa<SelectInst>(ii) && !isa<GetElementPtrInst>(ii)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The block where a triangle (one side) or diamond (two sides) rejoins, if
+// the branch has that shape and its sides can be speculated.
+BasicBlock *BranchRelax::convertibleJoin(BranchInst *br) {
+  BasicBlock *head = br->getParent();
+  BasicBlock *thenBlock = br->getSuccessor(0);
+  BasicBlock *elseBlock = br->getSuccessor(1);
+  BasicBlock *join = NULL;
+
+  if (thenBlock->getTerminator()->getNumSuccessors() == 1 &&
+      thenBlock->getTerminator()->getSuccessor(0) == elseBlock) {
+    // Triangle: if (c) { then }.
+    join = elseBlock;
+    if (!canSpeculate(thenBlock, head, join))
+      return NULL;
+  } else if (elseBlock->getTerminator()->getNumSuccessors() == 1 &&
+             elseBlock->getTerminator()->getSuccessor(0) == thenBlock) {
+    // Triangle: if (!c) { else }.
+    join = thenBlock;
+    if (!canSpeculate(elseBlock, head, join))
+      return NULL;
+  } else {
+    // Diamond.
+    if (thenBlock->getTerminator()->getNumSuccessors() != 1)
+      return NULL;
+    join = thenBlock->getTerminator()->getSuccessor(0);
+    if (!canSpeculate(thenBlock, head, join) ||
+        !canSpeculate(elseBlock, head, join))
+      return NULL;
+  }
+
+  if (isa<PHINode>(join->begin()))
+    return NULL;
+  return join;
+}
+
+// Whether both sides of a branch, up to where they rejoin, only affect
+// approximate data, so that taking the wrong side is acceptable.
+bool BranchRelax::sidesApproximate(BranchInst *br) {
+  BasicBlock *head = br->getParent();
+  if (LI->isLoopHeader(head))
+    return false;
+  DomTreeNode *node = PDT->getNode(head);
+  if (!node || !node->getIDom() || !node->getIDom()->getBlock())
+    return false;
+  BasicBlock *join = node->getIDom()->getBlock();
+
+  // Collect the blocks between the branch and the join.
+  std::set<BasicBlock*> region;
+  std::vector<BasicBlock*> worklist;
+  for (unsigned i = 0; i < br->getNumSuccessors(); ++i) {
+    if (br->getSuccessor(i) != join &&
+        region.insert(br->getSuccessor(i)).second)
+      worklist.push_back(br->getSuccessor(i));
+  }
+  while (!worklist.empty()) {
+    BasicBlock *block = worklist.back();
+    worklist.pop_back();
+    if (block == head)
+      return false;  // The branch is in a loop within the region.
+    for (succ_iterator si = succ_begin(block); si != succ_end(block); ++si) {
+      if (*si != join && region.insert(*si).second)
+        worklist.push_back(*si);
+    }
+  }
+
+  std::set<Instruction*> blockers = AI->preciseEscapeCheck(region);
+  return blockers.empty();
+}
+
+bool BranchRelax::tryToRelax(BranchInst *br) {
+  std::string optName = transformPass->siteName("branch", br);
+  LogDescription *desc = AI->logAdd("Branch", br);
+  ACCEPT_LOG << optName << "\n";
+
+  BasicBlock *join = convertibleJoin(br);
+  bool canBias = sidesApproximate(br);
+  if (join)
+    ACCEPT_LOG << "can if-convert\n";
+  if (canBias)
+    ACCEPT_LOG << "both sides approximate\n";
+  if (!join && !canBias) {
+    ACCEPT_LOG << "cannot relax branch\n";
+    return false;
+  }
+
+  if (transformPass->relax) {
+    int param = transformPass->relaxConfig.lookup(optName);
+    if (param) {
+      if (param > BRANCH_MAX_LEVEL)
+        param = BRANCH_MAX_LEVEL;
+      if (join && (param == 1 || !canBias)) {
+        ACCEPT_LOG << "if-converting\n";
+        ifConvert(br, join);
+      } else {
+        int logPeriod = join ? param - 1 : param;
+        ACCEPT_LOG << "evaluating once every " << (1 << logPeriod)
+                   << " executions\n";
+        bias(br, logPeriod);
+      }
+      return true;
+    } else {
+      ACCEPT_LOG << "not relaxing\n";
+    }
+  } else {
+    ACCEPT_LOG << "can relax branch\n";
+    transformPass->relaxConfig.insert(optName, 0);
+  }
+  return false;
+}
+
+// Execute both sides in the branch's block, guarding each store with a
+// select between the stored value and the old one.
+void BranchRelax::ifConvert(BranchInst *br, BasicBlock *join) {
+  BasicBlock *head = br->getParent();
+  Value *cond = br->getCondition();
+  IRBuilder<> builder(br);
+  Value *notCond = builder.CreateNot(cond);
+
+  for (unsigned i = 0; i < 2; ++i) {
+    BasicBlock *side = br->getSuccessor(i);
+    if (side == join)
+      continue;
+    Value *guard = i == 0 ? cond : notCond;
+
+    while (!isa<TerminatorInst>(side->begin())) {
+      Instruction *inst = side->begin();
+      inst->moveBefore(br);
+      if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+        builder.SetInsertPoint(store);
+        Value *old = builder.CreateLoad(store->getPointerOperand());
+        store->setOperand(0, builder.CreateSelect(guard,
+            store->getValueOperand(), old));
+      }
+    }
+  }
+
+  BasicBlock *sides[] = { br->getSuccessor(0), br->getSuccessor(1) };
+  BranchInst::Create(join, head);
+  br->eraseFromParent();
+  for (unsigned i = 0; i < 2; ++i) {
+    if (sides[i] != join)
+      sides[i]->eraseFromParent();
+  }
+}
+
+// Follow the last evaluated direction, evaluating the condition once every
+// 2^logPeriod executions. The state is per thread.
+void BranchRelax::bias(BranchInst *br, int logPeriod) {
+  LLVMContext &ctx = module->getContext();
+  Type *int32Ty = Type::getInt32Ty(ctx);
+  Type *int1Ty = Type::getInt1Ty(ctx);
+  Type *fields[] = { int1Ty, int32Ty };
+  StructType *stateTy = StructType::get(ctx, fields);
+  GlobalVariable *state = new GlobalVariable(*module, stateTy, false,
+      GlobalValue::InternalLinkage, Constant::getNullValue(stateTy),
+      "accept_branch", NULL, GlobalVariable::GeneralDynamicTLSModel);
+
+  IRBuilder<> builder(br);
+  Value *dirPtr = builder.CreateStructGEP(state, 0);
+  Value *countPtr = builder.CreateStructGEP(state, 1);
+  Value *countdown = builder.CreateLoad(countPtr);
+  Value *evaluate = builder.CreateIsNull(countdown);
+  Value *dir = builder.CreateSelect(evaluate, br->getCondition(),
+                                    builder.CreateLoad(dirPtr));
+  builder.CreateStore(dir, dirPtr);
+  builder.CreateStore(builder.CreateSelect(evaluate,
+      ConstantInt::get(int32Ty, (1 << logPeriod) - 1),
+      builder.CreateSub(countdown, ConstantInt::get(int32Ty, 1))), countPtr);
+  br->setCondition(dir);
+}
+
+char BranchRelax::ID = 0;
+INITIALIZE_PASS_BEGIN(BranchRelax, "branch-relax", "ACCEPT branch relaxation",
+                      false, false)
+INITIALIZE_PASS_DEPENDENCY(LoopInfo)
+INITIALIZE_PASS_DEPENDENCY(PostDominatorTree)
+INITIALIZE_PASS_END(BranchRelax, "branch-relax", "ACCEPT branch relaxation",
+                    false, false)
+FunctionPass *llvm::createBranchRelaxPass() { return new BranchRelax(); }
@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// The binary configuration format, written by the driver: a 16-byte header
+// (the magic "ACFG", a 32-bit version, and a 64-bit entry count) followed
+// by 16-byte entries (a 64-bit FNV-1a hash of the site name, a 32-bit
+// parameter, and 32 reserved bits) sorted by hash. All fields are
+// little-endian.
+
+namespace {
+  const char CONFIG_MAGIC[4] = { 'A', 'C', 'F', 'G' };
+  const uint32_t CONFIG_VERSION = 1;
+  const size_t CONFIG_HEADER_SIZE = 16;
+  const size_t CONFIG_ENTRY_SIZE = 16;
+
+  uint64_t readLE(const unsigned char *buf, unsigned bytes) {
+    uint64_t val = 0;
+    for (unsigned i = 0; i < bytes; ++i)
+      val |= (uint64_t)buf[i] << (8 * i);
+    return val;
+  }
+}
+
+uint64_t RelaxConfig::hash(const std::string &ident) {
+  uint64_t h = 14695981039346656037ULL;
+  for (std::string::const_iterator i = ident.begin(); i != ident.end(); ++i) {
+    h ^= (unsigned char)*i;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// Sort the entries by hash. When a site was inserted more than once, the
+// last insertion wins.
+void RelaxConfig::sort() const {
+  if (sorted)
+    return;
+  std::stable_sort(entries.begin(), entries.end());
+  std::vector<Entry> unique;
+  for (std::vector<Entry>::iterator i = entries.begin(); i != entries.end();
+       ++i) {
+    if (!unique.empty() && unique.back().hash == i->hash)
+      unique.back() = *i;
+    else
+      unique.push_back(*i);
+  }
+  entries.swap(unique);
+  sorted = true;
+}
+
+int RelaxConfig::lookup(const std::string &ident) const {
+  sort();
+  Entry key;
+  key.hash = hash(ident);
+  key.param = 0;
+  std::vector<Entry>::const_iterator it =
+      std::lower_bound(entries.begin(), entries.end(), key);
+  if (it != entries.end() && it->hash == key.hash)
+    return it->param;
+  return 0;
+}
+
+void RelaxConfig::insert(const std::string &ident, int param) {
+  Entry entry;
+  entry.hash = hash(ident);
+  entry.param = param;
+  if (sorted && !entries.empty() && !(entries.back() < entry))
+    sorted = false;
+  entries.push_back(entry);
+  names[ident] = param;
+}
+
+size_t RelaxConfig::size() const {
+  sort();
+  return entries.size();
+}
+
+bool RelaxConfig::loadText(const char *path) {
+  std::ifstream configFile(path);
+  if (!configFile.good())
+    return false;
+
+  while (configFile.good()) {
+    std::string ident;
+    int param;
+    configFile >> param;
+    if (!configFile.good())
+      break;
+    configFile.ignore(); // Skip space.
+    getline(configFile, ident);
+
+    Entry entry;
+    entry.hash = hash(ident);
+    entry.param = param;
+    entries.push_back(entry);
+  }
+  sorted = false;
+
+  configFile.close();
+  return true;
+}
+
+bool RelaxConfig::loadBinary(const char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f)
+    return false;
+
+  unsigned char header[CONFIG_HEADER_SIZE];
+  if (fread(header, 1, CONFIG_HEADER_SIZE, f) != CONFIG_HEADER_SIZE ||
+      !std::equal(CONFIG_MAGIC, CONFIG_MAGIC + 4, header)) {
+    errs() << "ACCEPT: " << path << " is not a configuration file\n";
+    fclose(f);
+    return false;
+  }
+  uint32_t version = readLE(header + 4, 4);
+  if (version != CONFIG_VERSION) {
+    errs() << "ACCEPT: unsupported configuration version " << version
+           << " in " << path << "\n";
+    fclose(f);
+    return false;
+  }
+  uint64_t count = readLE(header + 8, 8);
+
+  // Check the count against the file size before allocating anything: a
+  // corrupt header must not turn into a huge allocation.
+  long size = -1;
+  if (fseek(f, 0, SEEK_END) == 0)
+    size = ftell(f);
+  if (size < (long)CONFIG_HEADER_SIZE ||
+      (uint64_t)(size - CONFIG_HEADER_SIZE) / CONFIG_ENTRY_SIZE != count ||
+      (size - CONFIG_HEADER_SIZE) % CONFIG_ENTRY_SIZE != 0 ||
+      fseek(f, CONFIG_HEADER_SIZE, SEEK_SET) != 0) {
+    errs() << "ACCEPT: truncated configuration file " << path << "\n";
+    fclose(f);
+    return false;
+  }
+
+  std::vector<unsigned char> buf(count * CONFIG_ENTRY_SIZE);
+  if (count && fread(&buf[0], 1, buf.size(), f) != buf.size()) {
+    errs() << "ACCEPT: truncated configuration file " << path << "\n";
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  entries.resize(count);
+  for (uint64_t i = 0; i < count; ++i) {
+    const unsigned char *rec = &buf[i * CONFIG_ENTRY_SIZE];
+    entries[i].hash = readLE(rec, 8);
+    entries[i].param = (int32_t)readLE(rec + 8, 4);
+    if (i && entries[i].hash <= entries[i - 1].hash)
+      sorted = false;
+  }
+  return true;
+}
+
+void RelaxConfig::dumpText(const char *path) const {
+  std::ofstream configFile(path, std::ios_base::out);
+  for (std::map<std::string, int>::const_iterator i = names.begin();
+        i != names.end(); ++i) {
+    configFile << i->second << " "
+               << i->first << "\n";
+  }
+  configFile.close();
+}
@@ -1,70 +1,124 @@
 #include "accept.h"
 #include "llvm/Analysis/Dominators.h"
 #include "llvm/Analysis/PostDominators.h"
+#include "llvm/ADT/DepthFirstIterator.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Module.h"
+#include "llvm/Support/CommandLine.h"
 
 #include <sstream>
 
 using namespace llvm;
 
+cl::opt<bool> optSyncProfile("accept-sync-profile",
+    cl::desc("ACCEPT: instrument lock and barrier sites to measure "
+             "contention"));
+
 const char *FUNC_BARRIER = "pthread_barrier_wait";
 const char *FUNC_PARSEC_BARRIER = "_Z19parsec_barrier_waitP16parsec_barrier_t";
 bool isBarrier(Instruction *inst) {
   return isCallOf(inst, FUNC_BARRIER) || isCallOf(inst, FUNC_PARSEC_BARRIER);
 }
 
-void instructionsBetweenHelper(Instruction *end,
-    std::set<Instruction *> &instrs, BasicBlock *curBB,
-    std::set<BasicBlock *> &visited) {
-  // Mark visit.
-  if (visited.count(curBB))
-    return;
-  visited.insert(curBB);
+const char *FUNC_COND_WAIT = "pthread_cond_wait";
+bool isCondWait(Instruction *inst) {
+  return isCallOf(inst, FUNC_COND_WAIT);
+}
 
-  // Collect instructions.
-  for (BasicBlock::iterator i = curBB->begin(); i != curBB->end(); ++i) {
-    if (end == i) {
-      return;
-    }
-    instrs.insert(i);
-  }
+bool isSync(Instruction *inst) {
+  return isAcquire(inst) || isRelease(inst) || isBarrier(inst);
+}
 
-  // Recurse into successors.
-  TerminatorInst *term = curBB->getTerminator();
-  if (term->getNumSuccessors() == 0) {
-    errs() << "found exit in begin/end chain!\n";
-    return;
+// Collect the synchronization calls in a function in dominator-tree preorder.
+// The blocks dominated by an acquire's block form the contiguous run of the
+// preorder that follows it, so the candidate releases for an acquire are the
+// sync points directly after it in this order.
+void ACCEPTPass::buildSyncCache(Function &F) {
+  DominatorTree &domTree = getAnalysis<DominatorTree>();
+
+  syncCache.func = &F;
+  syncCache.points.clear();
+  syncCache.pointIndex.clear();
+  syncCache.blockIndex.clear();
+
+  unsigned numBlocks = 0;
+  for (Function::iterator fi = F.begin(); fi != F.end(); ++fi) {
+    syncCache.blockIndex[fi] = numBlocks++;
   }
-  for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
-    instructionsBetweenHelper(end, instrs, term->getSuccessor(i), visited);
+  syncCache.syncBlocks.clear();
+  syncCache.syncBlocks.resize(numBlocks);
+
+  DomTreeNode *root = domTree.getRootNode();
+  for (df_iterator<DomTreeNode*> ni = df_begin(root), ne = df_end(root);
+        ni != ne; ++ni) {
+    BasicBlock *bb = ni->getBlock();
+    for (BasicBlock::iterator bi = bb->begin(); bi != bb->end(); ++bi) {
+      if (isSync(bi)) {
+        syncCache.pointIndex[bi] = syncCache.points.size();
+        syncCache.points.push_back(bi);
+        syncCache.syncBlocks.set(syncCache.blockIndex[bb]);
+      }
+    }
   }
 }
 
-void instructionsBetween(Instruction *start, Instruction *end,
-                         std::set<Instruction *> &instrs) {
-  // Handle the first basic block.
-  BasicBlock *startBB = start->getParent();
-  bool entered = false;
-  for (BasicBlock::iterator i = startBB->begin(); i != startBB->end(); ++i) {
-    if (!entered && start == i) {
-      entered = true;
-    } else if (entered && end == i) {
-      return;
-    } else if (entered && start != i) {
-      instrs.insert(i);
+// Compute the blocks between an acquire and a release: those reachable from
+// the acquire's block without passing through the release's block (which is
+// itself included). The acquire's own block is never part of the region.
+// Returns false if there is another synchronization call between the two.
+bool ACCEPTPass::critSecRegion(Instruction *acq, Instruction *rel,
+                               BitVector &region) {
+  BasicBlock *acqBB = acq->getParent();
+  BasicBlock *relBB = rel->getParent();
+  region.clear();
+  region.resize(syncCache.syncBlocks.size());
+
+  // The rest of the acquire's block.
+  BasicBlock::iterator bi = acq;
+  for (++bi; bi != acqBB->end(); ++bi) {
+    if (rel == bi) {
+      return true;
+    } else if (isSync(bi)) {
+      return false;
     }
   }
 
-  // Recurse into successors.
-  std::set<BasicBlock *> visited;
-  visited.insert(startBB);
-  TerminatorInst *term = startBB->getTerminator();
-  if (term->getNumSuccessors() == 0) {
-    errs() << "found exit in begin/end chain!\n";
-    return;
+  // Flood the blocks reachable from the acquire, stopping at the release.
+  std::vector<BasicBlock*> worklist;
+  worklist.push_back(acqBB);
+  while (!worklist.empty()) {
+    BasicBlock *bb = worklist.back();
+    worklist.pop_back();
+    TerminatorInst *term = bb->getTerminator();
+    if (term->getNumSuccessors() == 0) {
+      errs() << "found exit in begin/end chain!\n";
+      continue;
+    }
+    for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
+      BasicBlock *succ = term->getSuccessor(i);
+      unsigned idx = syncCache.blockIndex[succ];
+      if (succ == acqBB || region.test(idx))
+        continue;
+      region.set(idx);
+      if (succ != relBB)
+        worklist.push_back(succ);
+    }
   }
-  for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
-    instructionsBetweenHelper(end, instrs, term->getSuccessor(i), visited);
+
+  // Whole blocks strictly inside the critical section must be sync-free.
+  BitVector inner(region);
+  inner.reset(syncCache.blockIndex[relBB]);
+  inner &= syncCache.syncBlocks;
+  if (inner.any())
+    return false;
+
+  // The beginning of the release's block.
+  for (bi = relBB->begin(); rel != bi; ++bi) {
+    if (isSync(bi))
+      return false;
   }
+
+  return true;
 }
 
 // Given an acquire call or a barrier call, find all the instructions between
@@ -74,9 +128,6 @@ void instructionsBetween(Instruction *start, Instruction *end,
 Instruction *ACCEPTPass::findCritSec(Instruction *acq,
                                      std::set<Instruction*> &cs,
                                      LogDescription *desc) {
-  bool acquired = false;
-  BasicBlock *bb = acq->getParent();
-
   bool isLock;
   if (isAcquire(acq)) {
     isLock = true;
@@ -87,43 +138,35 @@ Instruction *ACCEPTPass::findCritSec(Instruction *acq,
     return NULL;
   }
 
+  Function *func = acq->getParent()->getParent();
+  if (syncCache.func != func)
+    buildSyncCache(*func);
+
   // Look for a release call that is dominated by the acquire and
-  // post-dominates the acquire.
+  // post-dominates the acquire. Only the sync points immediately following
+  // the acquire in dominator-tree order can be dominated by it.
   DominatorTree &domTree = getAnalysis<DominatorTree>();
   PostDominatorTree &postDomTree = getAnalysis<PostDominatorTree>();
-  Function *func = acq->getParent()->getParent();
   Instruction *rel = NULL;
-  for (Function::iterator fi = func->begin(); fi != func->end(); ++fi) {
-    for (BasicBlock::iterator bi = fi->begin(); bi != fi->end(); ++bi) {
-      if ((isLock && isRelease(bi)) ||
-          (!isLock && acq != bi && isBarrier(bi))) {
-        // Candidate pair.
-        if (domTree.dominates(acq, bi) &&
-            postDomTree.dominates(bi->getParent(), acq->getParent())) {
-
-          // Evaluate the candidate critical section.
-          bool good = true;
-          rel = bi;
-          cs.clear();
-          instructionsBetween(acq, rel, cs);
-          for (std::set<Instruction *>::iterator i = cs.begin();
-                i != cs.end(); ++i) {
-            if (isAcquire(*i) || isRelease(*i) || isBarrier(*i)) {
-              good = false;
-              break;
-            }
-          }
-
-          if (good)
-            break;
-          else
-            rel = NULL;
+  BitVector region;
+  std::map<Instruction*, unsigned>::iterator pi =
+      syncCache.pointIndex.find(acq);
+  if (pi != syncCache.pointIndex.end()) {
+    for (unsigned i = pi->second + 1; i < syncCache.points.size(); ++i) {
+      Instruction *cand = syncCache.points[i];
+      if (!domTree.dominates(acq, cand))
+        break;
+      if (!((isLock && isRelease(cand)) || (!isLock && isBarrier(cand))))
+        continue;
+      if (!postDomTree.dominates(cand->getParent(), acq->getParent()))
+        continue;
 
-        }
+      // Evaluate the candidate critical section.
+      if (critSecRegion(acq, cand, region)) {
+        rel = cand;
+        break;
       }
     }
-    if (rel)
-      break;
   }
 
   if (rel == NULL) {
@@ -131,6 +174,23 @@ Instruction *ACCEPTPass::findCritSec(Instruction *acq,
     return NULL;
   }
 
+  // Collect the instructions in the chosen region.
+  cs.clear();
+  BasicBlock *acqBB = acq->getParent();
+  BasicBlock::iterator bi = acq;
+  for (++bi; bi != acqBB->end() && rel != bi; ++bi) {
+    cs.insert(bi);
+  }
+  if (rel->getParent() != acqBB) {
+    for (Function::iterator fi = func->begin(); fi != func->end(); ++fi) {
+      if (!region.test(syncCache.blockIndex[fi]))
+        continue;
+      for (bi = fi->begin(); bi != fi->end() && rel != bi; ++bi) {
+        cs.insert(bi);
+      }
+    }
+  }
+
   return rel;
 }
 
@@ -143,10 +203,13 @@ std::string ACCEPTPass::siteName(std::string kind, Instruction *at) {
 
 // Find the critical section beginning with an acquire (or barrier), check for
 // approximateness, and return the release (or next barrier). If the critical
-// section cannot be identified or is not approximate, return null.
+// section cannot be identified or is not approximate, return null. The
+// optional `inner` instructions must lie inside the critical section and are
+// exempt from the precise side effect check.
 Instruction *ACCEPTPass::findApproxCritSec(
     Instruction *acq,
-    LogDescription *desc) {
+    LogDescription *desc,
+    const std::set<Instruction*> *inner) {
   // Find all the instructions between this acquire and the next release.
   std::set<Instruction*> critSec;
   Instruction *rel = findCritSec(acq, critSec, desc);
@@ -158,6 +221,16 @@ Instruction *ACCEPTPass::findApproxCritSec(
   std::set<Instruction*> blessed;
   blessed.insert(rel);
   critSec.insert(rel);
+  if (inner) {
+    for (std::set<Instruction*>::const_iterator i = inner->begin();
+          i != inner->end(); ++i) {
+      if (!critSec.count(*i)) {
+        ACCEPT_LOG << "not inside the critical section\n";
+        return NULL;
+      }
+      blessed.insert(*i);
+    }
+  }
   std::set<Instruction*> blockers = AI->preciseEscapeCheck(critSec, &blessed);
 
   // Print the blockers to the log.
@@ -181,13 +254,14 @@ bool ACCEPTPass::optimizeAcquire(Instruction *acq) {
 
   Instruction *rel = findApproxCritSec(acq, desc);
   if (!rel) {
+    noteSyncSite(acq, NULL, optName);
     return false;
   }
 
   // Success.
   ACCEPT_LOG << "can elide lock\n";
   if (relax) {
-    int param = relaxConfig[optName];
+    int param = relaxConfig.lookup(optName);
     if (param) {
       // Remove the acquire and release calls.
       ACCEPT_LOG << "eliding lock\n";
@@ -196,8 +270,9 @@ bool ACCEPTPass::optimizeAcquire(Instruction *acq) {
       return true;
     }
   } else {
-    relaxConfig[optName] = 0;
+    relaxConfig.insert(optName, 0);
   }
+  noteSyncSite(acq, rel, optName);
   return false;
 }
 
@@ -208,13 +283,14 @@ bool ACCEPTPass::optimizeBarrier(Instruction *bar1) {
 
   Instruction *rel = findApproxCritSec(bar1, desc);
   if (!rel) {
+    noteSyncSite(bar1, NULL, optName);
     return false;
   }
 
   // Success.
   ACCEPT_LOG << "can elide barrier\n";
   if (relax) {
-    int param = relaxConfig[optName];
+    int param = relaxConfig.lookup(optName);
     if (param) {
       // Remove the first barrier.
       ACCEPT_LOG << "eliding barrier wait\n";
@@ -222,28 +298,174 @@ bool ACCEPTPass::optimizeBarrier(Instruction *bar1) {
       return true;
     }
   } else {
-    relaxConfig[optName] = 0;
+    relaxConfig.insert(optName, 0);
+  }
+  // The next barrier may itself be elided, so only the wait is measured.
+  noteSyncSite(bar1, NULL, optName);
+  return false;
+}
+
+// Relax a condition variable wait inside an approximate critical section.
+// The wait must be re-checked by a loop within the critical section (the
+// usual `while (!ready) pthread_cond_wait(...)` idiom), so returning early
+// only costs another trip around the loop. The relaxed wait polls the
+// predicate and bounds each blocking wait with a short timeout, trading
+// extra wakeups for lower wakeup latency.
+bool ACCEPTPass::optimizeCondWait(Instruction *wait) {
+  std::string optName = siteName("condvar wait", wait);
+  LogDescription *desc = AI->logAdd("Loop", wait);
+  ACCEPT_LOG << optName << "\n";
+
+  // Find the innermost acquire of the wait's mutex dominating the wait.
+  // Dominating sync points appear before the wait's block in the cached
+  // dominator-tree order, so the last one found is the innermost.
+  Function *func = wait->getParent()->getParent();
+  if (syncCache.func != func)
+    buildSyncCache(*func);
+  DominatorTree &domTree = getAnalysis<DominatorTree>();
+  Value *waitMutex =
+      cast<CallInst>(wait)->getArgOperand(1)->stripPointerCasts();
+  Instruction *acq = NULL;
+  for (std::vector<Instruction*>::iterator i = syncCache.points.begin();
+        i != syncCache.points.end(); ++i) {
+    if (isAcquire(*i) && domTree.dominates(*i, wait) &&
+        cast<CallInst>(*i)->getArgOperand(0)->stripPointerCasts() ==
+            waitMutex)
+      acq = *i;
+  }
+  if (!acq) {
+    ACCEPT_LOG << "no enclosing lock found\n";
+    return false;
+  }
+
+  // The wait must be in a loop that starts inside the critical section.
+  LoopInfo &loopInfo = getAnalysis<LoopInfo>();
+  Loop *loop = loopInfo.getLoopFor(wait->getParent());
+  if (!loop || loop->contains(acq)) {
+    ACCEPT_LOG << "wait is not re-checked by a loop\n";
+    return false;
+  }
+
+  std::set<Instruction*> inner;
+  inner.insert(wait);
+  Instruction *rel = findApproxCritSec(acq, desc, &inner);
+  if (!rel) {
+    return false;
+  }
+
+  // Success.
+  ACCEPT_LOG << "can relax condition wait\n";
+  if (relax) {
+    int param = relaxConfig.lookup(optName);
+    if (param) {
+      ACCEPT_LOG << "relaxing condition wait\n";
+      CallInst *call = cast<CallInst>(wait);
+      LLVMContext &ctx = module->getContext();
+      Type *ptrTy = Type::getInt8PtrTy(ctx);
+      Type *intTy = Type::getInt32Ty(ctx);
+      Constant *relaxedFunc = module->getOrInsertFunction(
+          "accept_cond_wait_relaxed", intTy, ptrTy, ptrTy, intTy, NULL);
+
+      IRBuilder<> builder(call);
+      Value *cond = builder.CreatePointerCast(call->getArgOperand(0), ptrTy);
+      Value *mutex = builder.CreatePointerCast(call->getArgOperand(1), ptrTy);
+      Value *relaxed = builder.CreateCall3(relaxedFunc, cond, mutex,
+                                           ConstantInt::get(intTy, param));
+      if (!call->use_empty())
+        call->replaceAllUsesWith(
+            builder.CreateIntCast(relaxed, call->getType(), true));
+      call->eraseFromParent();
+      return true;
+    }
+  } else {
+    relaxConfig.insert(optName, 0);
   }
   return false;
 }
 
+// Remember a lock or barrier site that was not elided so it can be
+// instrumented for contention profiling once the function has been
+// optimized. For locks without an approximate critical section, still try to
+// find the release so the hold time can be measured.
+void ACCEPTPass::noteSyncSite(Instruction *acq, Instruction *rel,
+                              const std::string &name) {
+  if (!optSyncProfile)
+    return;
+  if (!rel && isAcquire(acq)) {
+    std::set<Instruction*> cs;
+    rel = findCritSec(acq, cs, NULL);
+  }
+  syncProfileSites.push_back(SyncProfileSite(acq, rel, name));
+}
+
+// Wrap each noted site with calls into the runtime's contention profiler:
+//   t0 = accept_sync_now()
+//   <acquire or barrier>
+//   t1 = accept_sync_acquired(site, t0)  -- records wait time
+//   ...
+//   accept_sync_release(site, t1)        -- records hold time
+//   <release>
+void ACCEPTPass::instrumentSyncSites() {
+  if (syncProfileSites.empty())
+    return;
+
+  LLVMContext &ctx = module->getContext();
+  Type *timeTy = Type::getInt64Ty(ctx);
+  Type *siteTy = Type::getInt8PtrTy(ctx);
+  Constant *nowFunc = module->getOrInsertFunction(
+      "accept_sync_now", timeTy, NULL);
+  Constant *acquiredFunc = module->getOrInsertFunction(
+      "accept_sync_acquired", timeTy, siteTy, timeTy, NULL);
+  Constant *releaseFunc = module->getOrInsertFunction(
+      "accept_sync_release", Type::getVoidTy(ctx), siteTy, timeTy, NULL);
+
+  for (std::vector<SyncProfileSite>::iterator i = syncProfileSites.begin();
+        i != syncProfileSites.end(); ++i) {
+    IRBuilder<> builder(i->acq);
+    Value *site = builder.CreateGlobalStringPtr(i->name, "accept_sync_site");
+    Value *t0 = builder.CreateCall(nowFunc);
+
+    BasicBlock::iterator after = i->acq;
+    ++after;
+    builder.SetInsertPoint(i->acq->getParent(), after);
+    Value *t1 = builder.CreateCall2(acquiredFunc, site, t0);
+
+    if (i->rel) {
+      builder.SetInsertPoint(i->rel);
+      builder.CreateCall2(releaseFunc, site, t1);
+    }
+  }
+  syncProfileSites.clear();
+}
+
 bool ACCEPTPass::optimizeSync(Function &F) {
   bool changed = false;
+  buildSyncCache(F);
   for (Function::iterator fi = F.begin(); fi != F.end(); ++fi) {
     for (BasicBlock::iterator bi = fi->begin(); bi != fi->end(); ++bi) {
-      if (isAcquire(bi) || isBarrier(bi)) {
+      if (isAcquire(bi) || isBarrier(bi) || isCondWait(bi)) {
         bool optimized;
         if (isAcquire(bi))
           optimized = optimizeAcquire(bi);
-        else
+        else if (isBarrier(bi))
           optimized = optimizeBarrier(bi);
+        else
+          optimized = optimizeCondWait(bi);
         changed |= optimized;
-        if (optimized)
+        if (optimized) {
+          // The cached sync points include the erased calls.
+          buildSyncCache(F);
           // Stop iterating over this block, since it changed (and there's
           // almost certainly not another critical section in here anyway).
           break;
+        }
       }
     }
   }
+
+  // Instrument after the search so the profiling calls are not mistaken for
+  // side effects in other critical sections.
+  instrumentSyncSites();
+
   return changed;
 }
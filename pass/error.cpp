@@ -449,7 +449,7 @@ bool ErrorInjection::injectErrorRegion(InstId iid) {
   ACCEPT_LOG << instName << "\n";
 
   if (transformPass->relax) { // we're injecting error
-    int param = transformPass->relaxConfig[instName];
+    int param = transformPass->relaxConfig.lookup(instName);
     if (param) {
       ACCEPT_LOG << "injecting error " << param << "\n";
       return injectRegionHooks(inst, param);
@@ -459,7 +459,7 @@ bool ErrorInjection::injectErrorRegion(InstId iid) {
     }
   } else { // we're just logging
     ACCEPT_LOG << "can inject error\n";
-    transformPass->relaxConfig[instName] = 0;
+    transformPass->relaxConfig.insert(instName, 0);
   }
 
   return false;
@@ -487,7 +487,7 @@ bool ErrorInjection::injectErrorInst(InstId iid, Instruction* nextInst,
   bool approx = isApprox(inst);
 
   if (transformPass->relax && approx) { // we're injecting error
-    int param = transformPass->relaxConfig[instName];
+    int param = transformPass->relaxConfig.lookup(instName);
     if (param) {
       ACCEPT_LOG << "injecting error " << param << "\n";
       // param tells which error injection will be done e.g. bit flipping
@@ -499,7 +499,7 @@ bool ErrorInjection::injectErrorInst(InstId iid, Instruction* nextInst,
   } else { // we're just logging
     if (approx) {
       ACCEPT_LOG << "can inject error\n";
-      transformPass->relaxConfig[instName] = 0;
+      transformPass->relaxConfig.insert(instName, 0);
     } else {
       ACCEPT_LOG << "cannot inject error\n";
     }
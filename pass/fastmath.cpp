@@ -0,0 +1,159 @@
+#include "llvm/Function.h"
+#include "llvm/Module.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/IntrinsicInst.h"
+
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// Fast math substitution. Approximate calls to whitelisted libm functions
+// are redirected to the reduced-accuracy routines in rt/acceptmath.c, which
+// are linked into the program as bitcode. The site parameter selects the
+// accuracy tier: 1 is accurate to about 1e-8, 2 to about 1e-4, and 3 to
+// about 1e-2 (relative error). The routines are marked always-inline, so
+// each substituted call becomes a short polynomial evaluation.
+
+namespace {
+  const int FASTMATH_TIERS = 3;
+
+  // The libm functions with fast versions.
+  const char *fastMathFuncs[] = {
+    "exp", "log", "log10", "pow", "sin", "cos", "tan"
+  };
+
+  std::string fastName(StringRef name, int tier) {
+    std::stringstream ss;
+    ss << "accept_fast_" << name.str() << "_" << tier;
+    return ss.str();
+  }
+}
+
+struct FastMath : public FunctionPass {
+  static char ID;
+  ACCEPTPass *transformPass;
+  ApproxInfo *AI;
+  Module *module;
+
+  FastMath();
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual const char *getPassName() const;
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+  virtual bool runOnFunction(llvm::Function &F);
+
+  std::set<std::string> fastFuncs;
+  Function *getFast(Function *callee, int tier);
+  bool tryToSubstitute(CallInst *call);
+};
+
+void FastMath::getAnalysisUsage(AnalysisUsage &AU) const {
+  FunctionPass::getAnalysisUsage(AU);
+}
+
+FastMath::FastMath() : FunctionPass(ID) {
+  initializeFastMathPass(*PassRegistry::getPassRegistry());
+  module = 0;
+}
+
+const char *FastMath::getPassName() const {
+  return "ACCEPT fast math substitution";
+}
+
+bool FastMath::doInitialization(Module &M) {
+  module = &M;
+  transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
+
+  // Only offer functions whose fast versions are all linked in. (The
+  // library is not built for every target.)
+  unsigned nfuncs = sizeof(fastMathFuncs) / sizeof(fastMathFuncs[0]);
+  for (unsigned i = 0; i < nfuncs; ++i) {
+    bool linked = true;
+    for (int tier = 1; tier <= FASTMATH_TIERS; ++tier) {
+      Function *fast = M.getFunction(fastName(fastMathFuncs[i], tier));
+      if (!fast || fast->isDeclaration())
+        linked = false;
+    }
+    if (linked)
+      fastFuncs.insert(fastMathFuncs[i]);
+  }
+  return false;
+}
+
+bool FastMath::doFinalization(Module &M) {
+  return false;
+}
+
+bool FastMath::runOnFunction(Function &F) {
+  AI = transformPass->AI;
+
+  // Skip optimizing functions that seem to be in standard libraries.
+  if (transformPass->shouldSkipFunc(F))
+    return false;
+
+  std::vector<CallInst*> calls;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      CallInst *call = dyn_cast<CallInst>(ii);
+      if (call && !isa<IntrinsicInst>(call) && call->getCalledFunction() &&
+          fastFuncs.count(call->getCalledFunction()->getName()) &&
+          isApprox(call))
+        calls.push_back(call);
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<CallInst*>::iterator ci = calls.begin(); ci != calls.end();
+       ++ci)
+    modified |= tryToSubstitute(*ci);
+  return modified;
+}
+
+// The fast version of a libm function at a tier, or null if its signature
+// does not match the call's.
+Function *FastMath::getFast(Function *callee, int tier) {
+  Function *fast = module->getFunction(fastName(callee->getName(), tier));
+  if (!fast || fast->getFunctionType() != callee->getFunctionType())
+    return NULL;
+  return fast;
+}
+
+bool FastMath::tryToSubstitute(CallInst *call) {
+  Function *callee = call->getCalledFunction();
+  std::string optName = transformPass->siteName("fastmath", call);
+  LogDescription *desc = AI->logAdd("Fast math", call);
+  ACCEPT_LOG << optName << "\n";
+  ACCEPT_LOG << "call to " << callee->getName().str() << "\n";
+
+  if (!getFast(callee, 1)) {
+    ACCEPT_LOG << "signature does not match the fast version\n";
+    return false;
+  }
+
+  if (transformPass->relax) {
+    int param = transformPass->relaxConfig.lookup(optName);
+    if (param) {
+      if (param > FASTMATH_TIERS)
+        param = FASTMATH_TIERS;
+      ACCEPT_LOG << "substituting tier " << param << "\n";
+      call->setCalledFunction(getFast(callee, param));
+      return true;
+    } else {
+      ACCEPT_LOG << "not substituting\n";
+    }
+  } else {
+    ACCEPT_LOG << "can substitute\n";
+    transformPass->relaxConfig.insert(optName, 0);
+  }
+  return false;
+}
+
+char FastMath::ID = 0;
+INITIALIZE_PASS(FastMath, "fastmath", "ACCEPT fast math substitution",
+                false, false)
+FunctionPass *llvm::createFastMathPass() { return new FastMath(); }
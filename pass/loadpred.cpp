@@ -0,0 +1,245 @@
+#include "llvm/Function.h"
+#include "llvm/Module.h"
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Support/CommandLine.h"
+
+#include <string>
+#include <vector>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// Load value prediction. An approximate load in a loop, from memory other
+// than local variables, can be replaced by a prediction most of the time:
+// each site keeps a small thread-local predictor, and at level p only one
+// execution in 2^p performs the load. The others extrapolate the last
+// loaded value by the average per-execution change (the stride) between
+// the last two real loads.
+//
+// The loads worth predicting are the ones that miss in the cache. With
+// -accept-load-profile, each candidate load is also instrumented to time
+// its accesses, and the runtime writes accept_loadprof.txt, which the
+// driver uses to skip sites that rarely miss.
+
+namespace {
+  cl::opt<bool> optLoadProfile("accept-load-profile",
+      cl::desc("ACCEPT: instrument approximate loads to profile misses"));
+
+  const int LOAD_MAX_LEVEL = 4;
+
+  bool isPredictable(Type *type) {
+    return type->isFloatTy() || type->isDoubleTy() ||
+           (type->isIntegerTy() && type->getIntegerBitWidth() > 1 &&
+            type->getIntegerBitWidth() <= 64);
+  }
+}
+
+struct LoadPrediction : public FunctionPass {
+  static char ID;
+  ACCEPTPass *transformPass;
+  ApproxInfo *AI;
+  Module *module;
+  LoopInfo *LI;
+
+  LoadPrediction();
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual const char *getPassName() const;
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+  virtual bool runOnFunction(llvm::Function &F);
+
+  bool tryToPredict(LoadInst *load);
+  void probe(LoadInst *load, const std::string &name);
+  void predict(LoadInst *load, int level);
+};
+
+void LoadPrediction::getAnalysisUsage(AnalysisUsage &AU) const {
+  FunctionPass::getAnalysisUsage(AU);
+  AU.addRequired<LoopInfo>();
+}
+
+LoadPrediction::LoadPrediction() : FunctionPass(ID) {
+  initializeLoadPredictionPass(*PassRegistry::getPassRegistry());
+  module = 0;
+}
+
+const char *LoadPrediction::getPassName() const {
+  return "ACCEPT load value prediction";
+}
+
+bool LoadPrediction::doInitialization(Module &M) {
+  module = &M;
+  transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
+  return false;
+}
+
+bool LoadPrediction::doFinalization(Module &M) {
+  return false;
+}
+
+bool LoadPrediction::runOnFunction(Function &F) {
+  AI = transformPass->AI;
+  LI = &getAnalysis<LoopInfo>();
+
+  // Skip optimizing functions that seem to be in standard libraries.
+  if (transformPass->shouldSkipFunc(F))
+    return false;
+
+  std::vector<LoadInst*> loads;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    if (!LI->getLoopFor(bi))
+      continue;
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      LoadInst *load = dyn_cast<LoadInst>(ii);
+      if (load && isApprox(load) && isPredictable(load->getType()) &&
+          !isLocalPtr(load->getPointerOperand()))
+        loads.push_back(load);
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<LoadInst*>::iterator li = loads.begin(); li != loads.end();
+       ++li)
+    modified |= tryToPredict(*li);
+  return modified;
+}
+
+bool LoadPrediction::tryToPredict(LoadInst *load) {
+  std::string optName = transformPass->siteName("load", load);
+  LogDescription *desc = AI->logAdd("Load", load);
+  ACCEPT_LOG << optName << "\n";
+
+  if (!load->isSimple()) {
+    ACCEPT_LOG << "volatile or atomic load\n";
+    return false;
+  }
+
+  if (optLoadProfile) {
+    ACCEPT_LOG << "profiling load\n";
+    probe(load, optName);
+  }
+
+  if (transformPass->relax) {
+    int param = transformPass->relaxConfig.lookup(optName);
+    if (param) {
+      if (param > LOAD_MAX_LEVEL)
+        param = LOAD_MAX_LEVEL;
+      ACCEPT_LOG << "loading once every " << (1 << param) << " executions\n";
+      predict(load, param);
+      return true;
+    } else {
+      ACCEPT_LOG << "not predicting\n";
+    }
+  } else {
+    ACCEPT_LOG << "can predict load\n";
+    transformPass->relaxConfig.insert(optName, 0);
+  }
+  return optLoadProfile;
+}
+
+// Time the load's accesses (in the runtime) before it executes.
+void LoadPrediction::probe(LoadInst *load, const std::string &name) {
+  LLVMContext &ctx = module->getContext();
+  Type *ptrTy = Type::getInt8PtrTy(ctx);
+  Constant *probeFunc = module->getOrInsertFunction("accept_load_probe",
+      Type::getVoidTy(ctx), ptrTy, ptrTy, NULL);
+  IRBuilder<> builder(load);
+  Value *site = builder.CreateGlobalStringPtr(name, "accept_load_site");
+  builder.CreateCall2(probeFunc, site,
+      builder.CreateBitCast(load->getPointerOperand(), ptrTy));
+}
+
+void LoadPrediction::predict(LoadInst *load, int level) {
+  LLVMContext &ctx = module->getContext();
+  Type *type = load->getType();
+  Type *int32Ty = Type::getInt32Ty(ctx);
+  Type *int8Ty = Type::getInt8Ty(ctx);
+  unsigned period = 1 << level;
+
+  // The site's predictor: {last, stride, last loaded, countdown, valid},
+  // one per thread.
+  Type *fields[] = { type, type, type, int32Ty, int8Ty };
+  StructType *entryTy = StructType::get(ctx, fields);
+  GlobalVariable *entry = new GlobalVariable(*module, entryTy, false,
+      GlobalValue::InternalLinkage, Constant::getNullValue(entryTy),
+      "accept_loadpred", NULL, GlobalVariable::GeneralDynamicTLSModel);
+
+  BasicBlock *head = load->getParent();
+  Function *F = head->getParent();
+  BasicBlock *tail = head->splitBasicBlock(load, "loadpred.done");
+  BasicBlock *train = BasicBlock::Create(ctx, "loadpred.load", F, tail);
+  BasicBlock *guess = BasicBlock::Create(ctx, "loadpred.guess", F, tail);
+  head->getTerminator()->eraseFromParent();
+
+  IRBuilder<> builder(head);
+  Value *countdown = builder.CreateLoad(builder.CreateStructGEP(entry, 3));
+  builder.CreateCondBr(builder.CreateIsNull(countdown), train, guess);
+
+  // The predicted values are approximate data; the countdown and the valid
+  // flag only decide when to load, so they stay precise.
+  MDNode *quals = load->getMetadata("quals");
+
+  // Load for real and update the stride.
+  builder.SetInsertPoint(train);
+  BranchInst *trainBr = builder.CreateBr(tail);
+  load->moveBefore(trainBr);
+  builder.SetInsertPoint(trainBr);
+  Value *prev = setQuals(builder.CreateLoad(builder.CreateStructGEP(entry, 2)),
+                         quals);
+  Value *stride;
+  if (type->isFloatingPointTy())
+    stride = setQuals(builder.CreateFMul(
+        setQuals(builder.CreateFSub(load, prev), quals),
+        ConstantFP::get(type, 1.0 / period)), quals);
+  else
+    stride = setQuals(builder.CreateAShr(
+        setQuals(builder.CreateSub(load, prev), quals), level), quals);
+  Value *valid = builder.CreateIsNotNull(
+      builder.CreateLoad(builder.CreateStructGEP(entry, 4)));
+  stride = setQuals(builder.CreateSelect(valid, stride,
+                                         Constant::getNullValue(type)),
+                    quals);
+  setQuals(builder.CreateStore(load, builder.CreateStructGEP(entry, 0)),
+           quals);
+  setQuals(builder.CreateStore(stride, builder.CreateStructGEP(entry, 1)),
+           quals);
+  setQuals(builder.CreateStore(load, builder.CreateStructGEP(entry, 2)),
+           quals);
+  builder.CreateStore(ConstantInt::get(int32Ty, period - 1),
+                      builder.CreateStructGEP(entry, 3));
+  builder.CreateStore(ConstantInt::get(int8Ty, 1),
+                      builder.CreateStructGEP(entry, 4));
+
+  // Otherwise, extrapolate.
+  builder.SetInsertPoint(guess);
+  Value *last = setQuals(builder.CreateLoad(builder.CreateStructGEP(entry, 0)),
+                         quals);
+  Value *step = setQuals(builder.CreateLoad(builder.CreateStructGEP(entry, 1)),
+                         quals);
+  Value *predicted = setQuals(type->isFloatingPointTy() ?
+      builder.CreateFAdd(last, step) : builder.CreateAdd(last, step), quals);
+  setQuals(builder.CreateStore(predicted, builder.CreateStructGEP(entry, 0)),
+           quals);
+  builder.CreateStore(builder.CreateSub(countdown, ConstantInt::get(int32Ty, 1)),
+                      builder.CreateStructGEP(entry, 3));
+  builder.CreateBr(tail);
+
+  PHINode *result = PHINode::Create(type, 2, "loadpred", tail->begin());
+  result->setMetadata("quals", quals);
+  load->replaceAllUsesWith(result);
+  result->addIncoming(load, train);
+  result->addIncoming(predicted, guess);
+}
+
+char LoadPrediction::ID = 0;
+INITIALIZE_PASS_BEGIN(LoadPrediction, "load-prediction",
+                      "ACCEPT load value prediction", false, false)
+INITIALIZE_PASS_DEPENDENCY(LoopInfo)
+INITIALIZE_PASS_END(LoadPrediction, "load-prediction",
+                    "ACCEPT load value prediction", false, false)
+FunctionPass *llvm::createLoadPredictionPass() { return new LoadPrediction(); }
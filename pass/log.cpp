@@ -1,49 +1,72 @@
+#include <algorithm>
 #include <iostream>
 #include <cstdlib>
+#include <new>
 
 #include "accept.h"
 
 using namespace llvm;
 
+namespace {
+  bool lineBefore(int line, const std::pair<int, std::string> &b) {
+    return line < b.first;
+  }
+}
+
 void LogDescription::operator=(const LogDescription &d) {
   text = d.text;
+  module = d.module;
   blockers = d.blockers;
-  stream = NULL;
-}
-
-LogDescription::~LogDescription() {
-  if (stream)
-    delete stream;
+  rendered = d.rendered;
 }
 
 bool LogDescription::operator==(const LogDescription &rhs) {
-  return (this->text == rhs.text) &&
-      (this->blockers == rhs.blockers);
+  LogDescription &other = const_cast<LogDescription&>(rhs);
+  return (getText() == other.getText()) &&
+      (getBlockers() == other.getBlockers());
 }
 
 LogDescription::operator llvm::raw_ostream &() {
-  if (!stream) {
-    stream = new llvm::raw_string_ostream(text);
-  }
-  return *stream;
+  return stream;
 }
 
 std::string &LogDescription::getText() {
-  if (stream)
-    stream->flush();
+  stream.flush();
   return text;
 }
 
+// Add a blocker that is already described, after any others on its line.
 void LogDescription::blocker(int lineno, llvm::StringRef s) {
-  blockers[lineno].push_back(s);
+  rendered.insert(
+    std::upper_bound(rendered.begin(), rendered.end(), lineno, lineBefore),
+    std::make_pair(lineno, s.str())
+  );
 }
 
 void LogDescription::operator<<(const llvm::Instruction *inst) {
-  const llvm::Module *mod = inst->getParent()->getParent()->getParent();
-  blocker(
-    inst->getDebugLoc().getLine(),
-    instDesc(*mod, inst)
-  );
+  if (!module)
+    module = inst->getParent()->getParent()->getParent();
+  Instruction *i = const_cast<Instruction*>(inst);
+  blockers.push_back(Blocker(i->getDebugLoc().getLine(), i));
+}
+
+// Describe the blockers recorded so far.
+void LogDescription::renderBlockers() {
+  for (std::vector<Blocker>::iterator i = blockers.begin();
+       i != blockers.end(); ++i) {
+    Instruction *inst = dyn_cast_or_null<Instruction>((Value*)i->inst);
+    if (inst && inst->getParent())
+      blocker(i->line, instDesc(*module, inst));
+    else
+      blocker(i->line, srcPosDesc(*module, i->loc) + ": removed instruction");
+  }
+  blockers.clear();
+}
+
+const std::vector< std::pair<int, std::string> > &
+LogDescription::getBlockers() {
+  renderBlockers();
+  return rendered;
 }
 
 LogDescription *ApproxInfo::logAdd(llvm::StringRef kind,
@@ -54,10 +77,17 @@ LogDescription *ApproxInfo::logAdd(llvm::StringRef kind,
     return NULL;
   }
 
-  LogDescription::Location loc(kind, filename, lineno);
-  std::vector<LogDescription*> &descs = logDescs[loc];
-  LogDescription *desc = new LogDescription();
-  descs.push_back(desc);
+  // Kinds and filenames repeat across many descriptions, so they are
+  // interned, and the descriptions themselves live in an arena.
+  LogDescription::Location loc(logStrings.GetOrCreateValue(kind).getKey(),
+                               logStrings.GetOrCreateValue(filename).getKey(),
+                               lineno);
+  LogDescription *desc =
+      new (logAlloc.Allocate<LogDescription>()) LogDescription();
+  if (logFormat == logText)
+    logDescs[loc].push_back(desc);
+  else
+    pendingDescs.push_back(std::make_pair(loc, desc));
   return desc;
 }
 
@@ -100,7 +130,7 @@ void ApproxInfo::dumpLog() {
     }
     prevKind = newKind;
 
-    std::vector<LogDescription*> descVector = i->second;
+    std::vector<LogDescription*> &descVector = i->second;
     for (std::vector<LogDescription*>::iterator j = descVector.begin();
         j != descVector.end(); j++) {
       // Within the section for a kind, descriptions with blockers are
@@ -112,25 +142,143 @@ void ApproxInfo::dumpLog() {
       LogDescription *desc = *j;
       *logFile << "-----\n" << desc->getText();
 
-      std::map< int, std::vector<std::string> > blockers = desc->blockers;
-      unsigned count = 0;
-      for (std::map< int, std::vector<std::string> >::iterator
+      const std::vector< std::pair<int, std::string> > &blockers =
+          desc->getBlockers();
+      for (std::vector< std::pair<int, std::string> >::const_iterator
           k = blockers.begin(); k != blockers.end(); k++) {
-        std::vector<std::string> entryVector = k->second;
-        for (std::vector<std::string>::iterator l = entryVector.begin();
-            l != entryVector.end(); l++) {
-          *logFile << " * " << *l << "\n";
-          ++count;
-        }
+        *logFile << " * " << k->second << "\n";
       }
-      if (count == 1)
+      if (blockers.size() == 1)
         *logFile << "1 blocker\n";
-      else if (count)
-        *logFile << count << " blockers\n";
+      else if (blockers.size())
+        *logFile << blockers.size() << " blockers\n";
+
+      // Free the description. We're done. (Its memory belongs to the
+      // arena.)
+      desc->~LogDescription();
+    }
+  }
+}
+
+// Describe the blockers of every outstanding description. This is called
+// once the ACCEPT passes are done with the module: later optimizations
+// may delete the instructions the blockers refer to.
+void ApproxInfo::renderLog() {
+  for (std::map<LogDescription::Location, std::vector<LogDescription*>, LogDescription::cmpLocation>::iterator
+      i = logDescs.begin(); i != logDescs.end(); i++) {
+    for (std::vector<LogDescription*>::iterator j = i->second.begin();
+        j != i->second.end(); j++) {
+      (*j)->renderBlockers();
+    }
+  }
+  for (std::vector< std::pair<LogDescription::Location, LogDescription*> >
+       ::iterator i = pendingDescs.begin(); i != pendingDescs.end(); ++i) {
+    i->second->renderBlockers();
+  }
+}
+
+// Structured logs are written as the descriptions are completed rather
+// than collected until exit. Each record has a sequential ID, the kind and
+// source position of the description, its text (whose first line names the
+// site), and its blockers. In JSONL format, each record is an object on its
+// own line:
+//
+//   {"id": 0, "kind": "Loop", "file": "x.c", "line": 12, "text": "...",
+//    "blockers": [{"line": 14, "inst": "..."}]}
+//
+// The binary format starts with the magic "ALOG" and a 32-bit version. Each
+// record is the ID, kind, file, line, text, blocker count, and blockers
+// (line and description). Integers are 32-bit little-endian and strings
+// are a 32-bit length followed by the bytes.
+
+namespace {
+  const uint32_t LOG_VERSION = 1;
+
+  void writeLE(raw_ostream &os, uint32_t val) {
+    for (unsigned i = 0; i < 4; ++i)
+      os << (char)((val >> (8 * i)) & 0xff);
+  }
+
+  void writeString(raw_ostream &os, StringRef s) {
+    writeLE(os, s.size());
+    os << s;
+  }
+
+  void writeJSONString(raw_ostream &os, StringRef s) {
+    os << '"';
+    for (StringRef::iterator i = s.begin(); i != s.end(); ++i) {
+      unsigned char c = *i;
+      switch (c) {
+      case '"': os << "\\\""; break;
+      case '\\': os << "\\\\"; break;
+      case '\n': os << "\\n"; break;
+      case '\t': os << "\\t"; break;
+      default:
+        if (c < 0x20) {
+          static const char hex[] = "0123456789abcdef";
+          os << "\\u00" << hex[c >> 4] << hex[c & 0xf];
+        } else {
+          os << (char)c;
+        }
+      }
+    }
+    os << '"';
+  }
+}
+
+void ApproxInfo::writeRecord(const LogDescription::Location &loc,
+                             LogDescription *desc) {
+  typedef std::vector< std::pair<int, std::string> > BlockerList;
+  const BlockerList &blockers = desc->getBlockers();
+  unsigned id = logRecords++;
 
-      // Free the description. We're done.
-      delete desc;
+  if (logFormat == logJSONL) {
+    *logFile << "{\"id\": " << id << ", \"kind\": ";
+    writeJSONString(*logFile, loc.kind);
+    *logFile << ", \"file\": ";
+    writeJSONString(*logFile, loc.fileName);
+    *logFile << ", \"line\": " << loc.lineNumber << ", \"text\": ";
+    writeJSONString(*logFile, desc->getText());
+    *logFile << ", \"blockers\": [";
+    for (BlockerList::const_iterator i = blockers.begin();
+         i != blockers.end(); ++i) {
+      if (i != blockers.begin())
+        *logFile << ", ";
+      *logFile << "{\"line\": " << i->first << ", \"inst\": ";
+      writeJSONString(*logFile, i->second);
+      *logFile << "}";
+    }
+    *logFile << "]}\n";
+
+  } else {
+    writeLE(*logFile, id);
+    writeString(*logFile, loc.kind);
+    writeString(*logFile, loc.fileName);
+    writeLE(*logFile, loc.lineNumber);
+    writeString(*logFile, desc->getText());
+    writeLE(*logFile, blockers.size());
+    for (BlockerList::const_iterator i = blockers.begin();
+         i != blockers.end(); ++i) {
+      writeLE(*logFile, i->first);
+      writeString(*logFile, i->second);
     }
   }
 }
 
+// Write out and free the pending descriptions. This is called when the
+// passes have finished with a function, so the descriptions are complete.
+void ApproxInfo::flushLog() {
+  if (logFormat == logBinary && logFile->tell() == 0) {
+    *logFile << "ALOG";
+    writeLE(*logFile, LOG_VERSION);
+  }
+
+  for (std::vector< std::pair<LogDescription::Location, LogDescription*> >
+       ::iterator i = pendingDescs.begin(); i != pendingDescs.end(); ++i) {
+    writeRecord(i->first, i->second);
+    i->second->~LogDescription();
+  }
+  pendingDescs.clear();
+  logAlloc.Reset();
+  logFile->flush();
+}
@@ -2,11 +2,15 @@
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/IRBuilder.h"
 #include "llvm/Module.h"
+#include "llvm/Support/CFG.h"
 #include "llvm/Transforms/Utils/ValueMapper.h"
 #include "../llvm/lib/Transforms/Utils/LoopUnrollRuntime.cpp"
 #include "llvm/Support/CommandLine.h"
 
+#include <cmath>
+#include <set>
 #include <sstream>
+#include <vector>
 
 #include "accept.h"
 
@@ -20,6 +24,15 @@ namespace {
       cl::desc("ACCEPT: use partial loop body preservation"),
       cl::location(enablePreservation));
 
+  // Convergence tolerances are 10^(level - CONV_LEVEL_BASE).
+  const int CONV_LEVEL_BASE = 7;
+
+  // Subsampling levels split between rows and columns, up to 4x4.
+  const int SUBSAMPLE_MAX_LEVEL = 4;
+
+  // Reused loop nests run once every (level + 1) executions.
+  const int REUSE_MAX_LEVEL = 3;
+
   struct LoopPerfPass : public LoopPass {
     static char ID;
     ACCEPTPass *transformPass;
@@ -39,7 +52,11 @@ namespace {
           return false;
       module = loop->getHeader()->getParent()->getParent();
       LI = &getAnalysis<LoopInfo>();
-      return tryToOptimizeLoop(loop);
+      bool modified = tryToOptimizeLoop(loop);
+      modified |= tryToTerminateEarly(loop);
+      modified |= tryToSubsample(loop);
+      modified |= tryToReuse(loop);
+      return modified;
     }
     virtual bool doFinalization() {
       return false;
@@ -55,26 +72,9 @@ namespace {
                               layout.getPointerSizeInBits());
     }
 
-    // Assess whether a loop can be optimized and, if so, log some messages and
-    // update the configuration map. If optimization is turned on, the
-    // configuration map will be used to actually transform the loop. Returns a
-    // boolean indicating whether the code was changed (i.e., the loop
-    // perforated).
-    bool tryToOptimizeLoop(Loop *loop) {
-      Instruction *loopStart = loop->getHeader()->begin();
-      std::stringstream ss;
-      ss << "loop at " << srcPosDesc(*module, loopStart->getDebugLoc());
-      std::string loopName = ss.str();
-
-      LogDescription *desc = AI->logAdd("Loop", loopStart);
-      ACCEPT_LOG << loopName << "\n";
-
-      Instruction *inst = loop->getHeader()->begin();
-      Function *func = inst->getParent()->getParent();
-      std::string funcName = func->getName().str();
-
-      ACCEPT_LOG << "within function " << funcName << "\n";
-
+    // Check the shape requirements shared by perforation and convergence
+    // termination, logging the reason if the loop does not qualify.
+    bool checkLoopShape(Loop *loop, LogDescription *desc) {
       // Look for ACCEPT_FORBID marker.
       if (AI->instMarker(loop->getHeader()->begin()) == markerForbid) {
         ACCEPT_LOG << "optimization forbidden\n";
@@ -105,6 +105,32 @@ namespace {
         }
       }
 
+      return true;
+    }
+
+    // Assess whether a loop can be optimized and, if so, log some messages and
+    // update the configuration map. If optimization is turned on, the
+    // configuration map will be used to actually transform the loop. Returns a
+    // boolean indicating whether the code was changed (i.e., the loop
+    // perforated).
+    bool tryToOptimizeLoop(Loop *loop) {
+      Instruction *loopStart = loop->getHeader()->begin();
+      std::stringstream ss;
+      ss << "loop at " << srcPosDesc(*module, loopStart->getDebugLoc());
+      std::string loopName = ss.str();
+
+      LogDescription *desc = AI->logAdd("Loop", loopStart);
+      ACCEPT_LOG << loopName << "\n";
+
+      Instruction *inst = loop->getHeader()->begin();
+      Function *func = inst->getParent()->getParent();
+      std::string funcName = func->getName().str();
+
+      ACCEPT_LOG << "within function " << funcName << "\n";
+
+      if (!checkLoopShape(loop, desc))
+        return false;
+
       // Determine whether this is a for-like or while-like loop. This informs
       // the heuristic that determines which parts of the loop to perforate.
       bool isForLike = false;
@@ -116,7 +142,7 @@ namespace {
       }
 
       if (transformPass->relax) {
-        int param = transformPass->relaxConfig[loopName];
+        int param = transformPass->relaxConfig.lookup(loopName);
         if (param) {
           ACCEPT_LOG << "perforating with factor 2^" << param << "\n";
           perforateLoop(loop, param, isForLike);
@@ -170,7 +196,7 @@ namespace {
 
       if (!blockers.size()) {
         ACCEPT_LOG << "can perforate loop\n";
-        transformPass->relaxConfig[loopName] = 0;
+        transformPass->relaxConfig.insert(loopName, 0);
       } else {
         ACCEPT_LOG << "cannot perforate loop\n";
       }
@@ -295,6 +321,694 @@ namespace {
     }
 
 
+    /**** CONVERGENCE TERMINATION ****/
+
+    // Find the approximate value to monitor for convergence: a store of a
+    // floating-point scalar that the loop also reads, so its value carries
+    // from one iteration to the next. A store on a line marked with
+    // ACCEPT_PERMIT is preferred; otherwise, take the first such store in
+    // the loop itself (not in a nested loop).
+    StoreInst *findMonitor(Loop *loop) {
+      StoreInst *found = NULL;
+      for (Loop::block_iterator bi = loop->block_begin();
+            bi != loop->block_end(); ++bi) {
+        for (BasicBlock::iterator ii = (*bi)->begin();
+              ii != (*bi)->end(); ++ii) {
+          StoreInst *store = dyn_cast<StoreInst>(ii);
+          if (!store || !store->isSimple() ||
+              !store->getValueOperand()->getType()->isFloatingPointTy())
+            continue;
+          Value *ptr = store->getPointerOperand();
+          if (!isa<AllocaInst>(ptr) && !isa<GlobalVariable>(ptr))
+            continue;
+
+          bool marked = AI->instMarker(store) == markerPermit;
+          if (!marked && !isApprox(store))
+            continue;
+
+          bool carried = false;
+          for (Value::use_iterator ui = ptr->use_begin();
+                ui != ptr->use_end(); ++ui) {
+            LoadInst *load = dyn_cast<LoadInst>(*ui);
+            if (load && loop->contains(load->getParent())) {
+              carried = true;
+              break;
+            }
+          }
+          if (!carried)
+            continue;
+
+          if (marked)
+            return store;
+          if (!found && LI->getLoopFor(*bi) == loop)
+            found = store;
+        }
+      }
+      return found;
+    }
+
+    // Assess whether a loop can exit once an approximate value stops
+    // changing. Like perforation, this requires that the loop only affects
+    // approximate data, but here the whole loop is checked (including the
+    // condition and the increment) because the remaining iterations are
+    // skipped entirely.
+    bool tryToTerminateEarly(Loop *loop) {
+      Instruction *loopStart = loop->getHeader()->begin();
+      std::stringstream ss;
+      ss << "convergence at " << srcPosDesc(*module, loopStart->getDebugLoc());
+      std::string optName = ss.str();
+
+      LogDescription *desc = AI->logAdd("Convergence", loopStart);
+      ACCEPT_LOG << optName << "\n";
+
+      if (!checkLoopShape(loop, desc))
+        return false;
+
+      BasicBlock *exitBlock = loop->getExitBlock();
+      if (!exitBlock || isa<PHINode>(exitBlock->begin())) {
+        ACCEPT_LOG << "no single exit\n";
+        return false;
+      }
+
+      StoreInst *monitor = findMonitor(loop);
+      if (!monitor) {
+        ACCEPT_LOG << "no approximate value to monitor\n";
+        return false;
+      }
+      ACCEPT_LOG << "monitoring " << instDesc(*module, monitor) << "\n";
+
+      if (transformPass->relax) {
+        int param = transformPass->relaxConfig.lookup(optName);
+        if (param) {
+          ACCEPT_LOG << "exiting at relative change 10^"
+                     << (param - CONV_LEVEL_BASE) << "\n";
+          terminateEarly(loop, monitor, param);
+          return true;
+        } else {
+          ACCEPT_LOG << "not terminating early\n";
+          return false;
+        }
+      }
+
+      std::set<BasicBlock*> loopBlocks(loop->block_begin(), loop->block_end());
+      std::set<Instruction*> blockers = AI->preciseEscapeCheck(loopBlocks);
+      for (std::set<Instruction*>::iterator i = blockers.begin();
+            i != blockers.end(); ++i) {
+        ACCEPT_LOG << *i;
+      }
+
+      if (!blockers.size()) {
+        ACCEPT_LOG << "can terminate early\n";
+        transformPass->relaxConfig.insert(optName, 0);
+      } else {
+        ACCEPT_LOG << "cannot terminate early\n";
+      }
+      return false;
+    }
+
+    // Add a check on the back edge that leaves the loop when the monitored
+    // value changed by at most 10^(level - CONV_LEVEL_BASE) of its previous
+    // value during the last iteration.
+    void terminateEarly(Loop *loop, StoreInst *monitor, int level) {
+      BasicBlock *header = loop->getHeader();
+      BasicBlock *latch = loop->getLoopLatch();
+      BasicBlock *exitBlock = loop->getExitBlock();
+      Value *ptr = monitor->getPointerOperand();
+      Type *type = monitor->getValueOperand()->getType();
+      IRBuilder<> builder(module->getContext());
+
+      // The value at the end of the previous iteration. It starts out as NaN
+      // so the first check always fails.
+      builder.SetInsertPoint(header->getParent()->getEntryBlock().begin());
+      AllocaInst *prevAlloca = builder.CreateAlloca(type, 0, "accept_prev");
+      builder.SetInsertPoint(loop->getLoopPreheader()->getTerminator());
+      builder.CreateStore(ConstantFP::getNaN(type), prevAlloca);
+
+      BasicBlock *checkBlock = BasicBlock::Create(
+          module->getContext(),
+          "accept_conv",
+          header->getParent(),
+          exitBlock
+      );
+      builder.SetInsertPoint(checkBlock);
+      Value *cur = builder.CreateLoad(ptr, "accept_cur");
+      Value *prev = builder.CreateLoad(prevAlloca, "accept_prev");
+      builder.CreateStore(cur, prevAlloca);
+      Value *converged = createWithinTolerance(builder, cur, prev,
+          pow(10.0, level - CONV_LEVEL_BASE), "accept_converged");
+      builder.CreateCondBr(converged, exitBlock, header);
+
+      // Route the back edge through the check.
+      TerminatorInst *term = latch->getTerminator();
+      for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
+        if (term->getSuccessor(i) == header)
+          term->setSuccessor(i, checkBlock);
+      }
+      for (BasicBlock::iterator ii = header->begin(); isa<PHINode>(ii); ++ii) {
+        PHINode *phi = cast<PHINode>(ii);
+        int idx = phi->getBasicBlockIndex(latch);
+        if (idx != -1)
+          phi->setIncomingBlock(idx, checkBlock);
+      }
+
+      loop->addBasicBlockToLoop(checkBlock, LI->getBase());
+    }
+
+
+    /**** NEST SUBSAMPLING ****/
+
+    // Whether a value in an output store's address can be recomputed at the
+    // start of an inner-loop iteration: it is built from constants,
+    // arguments, values computed before the body, and local variables that
+    // the body does not assign, using only arithmetic, casts, and GEPs. This
+    // rules out indirect indexing, so the address is affine in the loop
+    // counters in practice.
+    bool recomputable(Value *val, std::set<BasicBlock*> &body) {
+      Instruction *inst = dyn_cast<Instruction>(val);
+      if (!inst)
+        return isa<Constant>(val) || isa<Argument>(val);
+      if (!body.count(inst->getParent()))
+        return true;
+
+      if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        AllocaInst *alloca = dyn_cast<AllocaInst>(load->getPointerOperand());
+        if (!alloca || !load->isSimple())
+          return false;
+        for (Value::use_iterator ui = alloca->use_begin();
+              ui != alloca->use_end(); ++ui) {
+          Instruction *user = dyn_cast<Instruction>(*ui);
+          if (user && !isa<LoadInst>(user) && body.count(user->getParent()))
+            return false;
+        }
+        return true;
+      }
+
+      if (BinaryOperator *op = dyn_cast<BinaryOperator>(inst)) {
+        if (op->getOpcode() != Instruction::Add &&
+            op->getOpcode() != Instruction::Sub &&
+            op->getOpcode() != Instruction::Mul &&
+            op->getOpcode() != Instruction::Shl)
+          return false;
+      } else if (!isa<CastInst>(inst) && !isa<GetElementPtrInst>(inst)) {
+        return false;
+      }
+      for (unsigned i = 0; i < inst->getNumOperands(); ++i) {
+        if (!recomputable(inst->getOperand(i), body))
+          return false;
+      }
+      return true;
+    }
+
+    // Copy the body instructions that compute a value (checked by
+    // recomputable) to the builder's insertion point.
+    Value *recompute(Value *val, std::set<BasicBlock*> &body,
+                     ValueToValueMapTy &VMap, IRBuilder<> &builder) {
+      Instruction *inst = dyn_cast<Instruction>(val);
+      if (!inst || !body.count(inst->getParent()))
+        return val;
+      if (VMap.count(inst))
+        return VMap[inst];
+
+      Instruction *copy = inst->clone();
+      for (unsigned i = 0; i < inst->getNumOperands(); ++i)
+        copy->setOperand(i, recompute(inst->getOperand(i), body, VMap,
+                                      builder));
+      builder.Insert(copy);
+      VMap[inst] = copy;
+      return copy;
+    }
+
+    // Whether every path through the body from its entry to the latch
+    // passes through a block.
+    bool onEveryPath(BasicBlock *block, BasicBlock *entry, BasicBlock *latch,
+                     std::set<BasicBlock*> &body) {
+      if (block == entry)
+        return true;
+      std::set<BasicBlock*> seen;
+      std::vector<BasicBlock*> worklist;
+      worklist.push_back(entry);
+      seen.insert(entry);
+      while (!worklist.empty()) {
+        BasicBlock *cur = worklist.back();
+        worklist.pop_back();
+        for (succ_iterator si = succ_begin(cur); si != succ_end(cur); ++si) {
+          if (*si == latch)
+            return false;
+          if (*si != block && body.count(*si) && seen.insert(*si).second)
+            worklist.push_back(*si);
+        }
+      }
+      return true;
+    }
+
+    // Assess whether a two-level loop nest can compute only a subsampled
+    // grid of its outputs. The inner loop's body must be perforatable, read
+    // approximate data from memory, and write approximate data to memory
+    // through stores that execute once per iteration at recomputable
+    // addresses. The site belongs to the outer loop.
+    bool tryToSubsample(Loop *outer) {
+      if (outer->getSubLoops().size() != 1)
+        return false;
+      Loop *inner = outer->getSubLoops()[0];
+
+      Instruction *loopStart = outer->getHeader()->begin();
+      std::stringstream ss;
+      ss << "subsample at " << srcPosDesc(*module, loopStart->getDebugLoc());
+      std::string optName = ss.str();
+
+      LogDescription *desc = AI->logAdd("Subsample", loopStart);
+      ACCEPT_LOG << optName << "\n";
+
+      if (!checkLoopShape(outer, desc) || !checkLoopShape(inner, desc))
+        return false;
+
+      // Skipped iterations jump to the inner loop's increment, so it must be
+      // a for-like loop.
+      if (!inner->getHeader()->getName().startswith("for.cond")) {
+        ACCEPT_LOG << "inner loop is not for-like\n";
+        return false;
+      }
+      BranchInst *condBranch = dyn_cast<BranchInst>(
+          inner->getHeader()->getTerminator());
+      BasicBlock *exitBlock = inner->getExitBlock();
+      if (!condBranch || !condBranch->isConditional() || !exitBlock ||
+          (condBranch->getSuccessor(0) != exitBlock &&
+           condBranch->getSuccessor(1) != exitBlock)) {
+        ACCEPT_LOG << "inner loop condition not recognized\n";
+        return false;
+      }
+      BasicBlock *bodyEntry = condBranch->getSuccessor(
+          condBranch->getSuccessor(0) == exitBlock ? 1 : 0);
+      BasicBlock *latch = inner->getLoopLatch();
+      if (isa<PHINode>(bodyEntry->begin()) || isa<PHINode>(latch->begin())) {
+        ACCEPT_LOG << "inner loop has phis\n";
+        return false;
+      }
+
+      std::set<BasicBlock*> body;
+      for (Loop::block_iterator bi = inner->block_begin();
+            bi != inner->block_end(); ++bi) {
+        if (*bi != inner->getHeader() && *bi != latch)
+          body.insert(*bi);
+      }
+      if (!body.count(bodyEntry)) {
+        ACCEPT_LOG << "empty body\n";
+        return false;
+      }
+
+      // Find the inputs and outputs.
+      unsigned inputs = 0;
+      std::vector<StoreInst*> outputs;
+      for (std::set<BasicBlock*>::iterator bi = body.begin();
+            bi != body.end(); ++bi) {
+        if (inner->isLoopExiting(*bi)) {
+          ACCEPT_LOG << "contains loop exit\n";
+          return false;
+        }
+        for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end();
+              ++ii) {
+          if (LoadInst *load = dyn_cast<LoadInst>(ii)) {
+            if (isApprox(load) && !isLocalPtr(load->getPointerOperand()))
+              ++inputs;
+          } else if (StoreInst *store = dyn_cast<StoreInst>(ii)) {
+            if (!isApprox(store) || isLocalPtr(store->getPointerOperand()))
+              continue;
+            if (!store->isSimple() || LI->getLoopFor(*bi) != inner ||
+                !onEveryPath(*bi, bodyEntry, latch, body)) {
+              ACCEPT_LOG << "output not stored on every iteration\n";
+              return false;
+            }
+            if (!recomputable(store->getPointerOperand(), body)) {
+              ACCEPT_LOG << "output address not recomputable\n";
+              return false;
+            }
+            outputs.push_back(store);
+          }
+        }
+      }
+      if (!inputs || outputs.empty()) {
+        ACCEPT_LOG << "no approximate inputs and outputs in memory\n";
+        return false;
+      }
+      ACCEPT_LOG << outputs.size() << " outputs\n";
+
+      if (transformPass->relax) {
+        int param = transformPass->relaxConfig.lookup(optName);
+        if (param) {
+          if (param > SUBSAMPLE_MAX_LEVEL)
+            param = SUBSAMPLE_MAX_LEVEL;
+          ACCEPT_LOG << "computing 1 in 2^" << (param / 2) << " rows and 2^"
+                     << ((param + 1) / 2) << " columns\n";
+          subsample(outer, inner, bodyEntry, body, outputs, param);
+          return true;
+        } else {
+          ACCEPT_LOG << "not subsampling\n";
+          return false;
+        }
+      }
+
+      std::set<Instruction*> blockers = AI->preciseEscapeCheck(body);
+      for (std::set<Instruction*>::iterator i = blockers.begin();
+            i != blockers.end(); ++i) {
+        ACCEPT_LOG << *i;
+      }
+
+      if (!blockers.size()) {
+        ACCEPT_LOG << "can subsample\n";
+        transformPass->relaxConfig.insert(optName, 0);
+      } else {
+        ACCEPT_LOG << "cannot subsample\n";
+      }
+      return false;
+    }
+
+    // Run the inner loop's body only on every 2^(level / 2)th outer
+    // iteration (row) and every 2^((level + 1) / 2)th inner iteration
+    // (column). Skipped iterations only store their outputs: a skipped
+    // column repeats the last value the store wrote, and a skipped row
+    // copies the value from the same column of the last computed row. The
+    // distance back to that row is the difference between the addresses
+    // stored to in the first column of each row.
+    void subsample(Loop *outer, Loop *inner, BasicBlock *bodyEntry,
+                   std::set<BasicBlock*> &body,
+                   std::vector<StoreInst*> &outputs, int level) {
+      LLVMContext &ctx = module->getContext();
+      IntegerType *nativeInt = getNativeIntegerType();
+      BasicBlock *header = inner->getHeader();
+      BasicBlock *latch = inner->getLoopLatch();
+      Function *func = header->getParent();
+      uint64_t rowMask = (1 << (level / 2)) - 1;
+      uint64_t colMask = (1 << ((level + 1) / 2)) - 1;
+      Value *zero = ConstantInt::get(nativeInt, 0);
+      Value *one = ConstantInt::get(nativeInt, 1);
+
+      // Allocate the counters and, for each output, its last value, the
+      // address of its first column in the last computed row, and the
+      // distance from there to the current row.
+      IRBuilder<> builder(func->getEntryBlock().begin());
+      AllocaInst *rowCounter = builder.CreateAlloca(nativeInt, 0,
+                                                    "accept_row");
+      AllocaInst *colCounter = builder.CreateAlloca(nativeInt, 0,
+                                                    "accept_col");
+      std::vector<AllocaInst*> lastValues, rowAddrs, deltas;
+      for (unsigned i = 0; i < outputs.size(); ++i) {
+        lastValues.push_back(builder.CreateAlloca(
+            outputs[i]->getValueOperand()->getType(), 0, "accept_last"));
+        rowAddrs.push_back(builder.CreateAlloca(nativeInt, 0,
+                                                "accept_rowaddr"));
+        deltas.push_back(builder.CreateAlloca(nativeInt, 0, "accept_delta"));
+      }
+
+      // Count the iterations of both loops.
+      builder.SetInsertPoint(outer->getLoopPreheader()->getTerminator());
+      builder.CreateStore(zero, rowCounter);
+      builder.SetInsertPoint(outer->getLoopLatch()->getTerminator());
+      builder.CreateStore(builder.CreateAdd(builder.CreateLoad(rowCounter),
+                                            one), rowCounter);
+      builder.SetInsertPoint(inner->getLoopPreheader()->getTerminator());
+      builder.CreateStore(zero, colCounter);
+      builder.SetInsertPoint(latch->getTerminator());
+      builder.CreateStore(builder.CreateAdd(builder.CreateLoad(colCounter),
+                                            one), colCounter);
+
+      // Computed iterations record what the skipped ones need.
+      for (unsigned i = 0; i < outputs.size(); ++i) {
+        StoreInst *store = outputs[i];
+        builder.SetInsertPoint(++BasicBlock::iterator(store));
+        builder.CreateStore(store->getValueOperand(), lastValues[i]);
+        Value *firstCol = builder.CreateIsNull(builder.CreateLoad(colCounter));
+        Value *addr = builder.CreatePtrToInt(store->getPointerOperand(),
+                                             nativeInt);
+        builder.CreateStore(
+            builder.CreateSelect(firstCol, addr,
+                                 builder.CreateLoad(rowAddrs[i])),
+            rowAddrs[i]);
+      }
+
+      // Choose between computing and filling in.
+      BasicBlock *dispatch = BasicBlock::Create(ctx, "accept_subsample",
+                                                func, bodyEntry);
+      BasicBlock *fill = BasicBlock::Create(ctx, "accept_fill", func,
+                                            bodyEntry);
+      BasicBlock *fillRow = BasicBlock::Create(ctx, "accept_fill_row", func,
+                                               bodyEntry);
+      BasicBlock *fillCol = BasicBlock::Create(ctx, "accept_fill_col", func,
+                                               bodyEntry);
+      builder.SetInsertPoint(dispatch);
+      Value *row = builder.CreateLoad(rowCounter);
+      Value *col = builder.CreateLoad(colCounter);
+      Value *skipRow = builder.CreateIsNotNull(
+          builder.CreateAnd(row, ConstantInt::get(nativeInt, rowMask)));
+      Value *skipCol = builder.CreateIsNotNull(
+          builder.CreateAnd(col, ConstantInt::get(nativeInt, colMask)));
+      builder.CreateCondBr(builder.CreateOr(skipRow, skipCol), fill,
+                           bodyEntry);
+      builder.SetInsertPoint(fill);
+      builder.CreateCondBr(skipRow, fillRow, fillCol);
+
+      // Skipped rows copy from the last computed row.
+      builder.SetInsertPoint(fillRow);
+      ValueToValueMapTy rowMap;
+      for (unsigned i = 0; i < outputs.size(); ++i) {
+        StoreInst *store = outputs[i];
+        Value *ptr = recompute(store->getPointerOperand(), body, rowMap,
+                               builder);
+        Value *addr = builder.CreatePtrToInt(ptr, nativeInt);
+        Value *delta = builder.CreateSelect(builder.CreateIsNull(col),
+            builder.CreateSub(addr, builder.CreateLoad(rowAddrs[i])),
+            builder.CreateLoad(deltas[i]));
+        builder.CreateStore(delta, deltas[i]);
+        Value *src = builder.CreateIntToPtr(builder.CreateSub(addr, delta),
+                                            ptr->getType());
+        StoreInst *copy = builder.CreateStore(builder.CreateLoad(src), ptr);
+        copy->setMetadata("quals", store->getMetadata("quals"));
+      }
+      builder.CreateBr(latch);
+
+      // Skipped columns repeat the last value.
+      builder.SetInsertPoint(fillCol);
+      ValueToValueMapTy colMap;
+      for (unsigned i = 0; i < outputs.size(); ++i) {
+        StoreInst *store = outputs[i];
+        Value *ptr = recompute(store->getPointerOperand(), body, colMap,
+                               builder);
+        StoreInst *copy = builder.CreateStore(
+            builder.CreateLoad(lastValues[i]), ptr);
+        copy->setMetadata("quals", store->getMetadata("quals"));
+      }
+      builder.CreateBr(latch);
+
+      // Enter the body through the dispatch block.
+      BranchInst *condBranch = cast<BranchInst>(header->getTerminator());
+      for (unsigned i = 0; i < condBranch->getNumSuccessors(); ++i) {
+        if (condBranch->getSuccessor(i) == bodyEntry)
+          condBranch->setSuccessor(i, dispatch);
+      }
+
+      inner->addBasicBlockToLoop(dispatch, LI->getBase());
+      inner->addBasicBlockToLoop(fill, LI->getBase());
+      inner->addBasicBlockToLoop(fillRow, LI->getBase());
+      inner->addBasicBlockToLoop(fillCol, LI->getBase());
+    }
+
+
+    /**** TEMPORAL REUSE ****/
+
+    // Whether a value in an output store's address is the same every time a
+    // loop nest runs within its parent loop. Values from outside the parent
+    // loop are fixed. Inside it, the address may use arithmetic, casts, and
+    // GEPs of local variables that the parent loop only assigns constants
+    // (like the nest's own counters) or values that are themselves stable.
+    bool stableAcross(Value *val, Loop *loop, Loop *parent,
+                      std::set<AllocaInst*> &seen) {
+      Instruction *inst = dyn_cast<Instruction>(val);
+      if (!inst)
+        return isa<Constant>(val) || isa<Argument>(val);
+      if (!parent->contains(inst->getParent()))
+        return true;
+
+      if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        AllocaInst *alloca = dyn_cast<AllocaInst>(load->getPointerOperand());
+        if (!alloca || !load->isSimple())
+          return false;
+        if (!seen.insert(alloca).second)
+          return true;
+        for (Value::use_iterator ui = alloca->use_begin();
+              ui != alloca->use_end(); ++ui) {
+          if (isa<LoadInst>(*ui))
+            continue;
+          StoreInst *store = dyn_cast<StoreInst>(*ui);
+          if (!store || store->getPointerOperand() != alloca)
+            return false;  // Captured.
+          if (!parent->contains(store->getParent()) ||
+              isa<Constant>(store->getValueOperand()))
+            continue;
+          if (!loop->contains(store->getParent()) ||
+              !stableAcross(store->getValueOperand(), loop, parent, seen))
+            return false;
+        }
+        return true;
+      }
+
+      if (BinaryOperator *op = dyn_cast<BinaryOperator>(inst)) {
+        if (op->getOpcode() != Instruction::Add &&
+            op->getOpcode() != Instruction::Sub &&
+            op->getOpcode() != Instruction::Mul &&
+            op->getOpcode() != Instruction::Shl)
+          return false;
+      } else if (!isa<CastInst>(inst) && !isa<GetElementPtrInst>(inst)) {
+        return false;
+      }
+      for (unsigned i = 0; i < inst->getNumOperands(); ++i) {
+        if (!stableAcross(inst->getOperand(i), loop, parent, seen))
+          return false;
+      }
+      return true;
+    }
+
+    // Assess whether a loop nest inside another loop can skip some of its
+    // executions and leave its previous outputs in place. Its live-outs
+    // must all be approximate (checked on the whole nest, as for
+    // convergence termination), and it must write its approximate outputs
+    // to the same memory each time.
+    bool tryToReuse(Loop *loop) {
+      Loop *parent = loop->getParentLoop();
+      if (!parent)
+        return false;
+
+      Instruction *loopStart = loop->getHeader()->begin();
+      std::stringstream ss;
+      ss << "reuse at " << srcPosDesc(*module, loopStart->getDebugLoc());
+      std::string optName = ss.str();
+
+      LogDescription *desc = AI->logAdd("Reuse", loopStart);
+      ACCEPT_LOG << optName << "\n";
+
+      if (!checkLoopShape(loop, desc))
+        return false;
+
+      BasicBlock *exitBlock = loop->getExitBlock();
+      BranchInst *entryBranch = dyn_cast<BranchInst>(
+          loop->getLoopPreheader()->getTerminator());
+      if (!exitBlock || isa<PHINode>(exitBlock->begin()) ||
+          !entryBranch || entryBranch->isConditional()) {
+        ACCEPT_LOG << "no single exit\n";
+        return false;
+      }
+      if (!parent->getLoopPreheader()) {
+        ACCEPT_LOG << "parent loop has no preheader\n";
+        return false;
+      }
+
+      std::vector<StoreInst*> outputs;
+      for (Loop::block_iterator bi = loop->block_begin();
+            bi != loop->block_end(); ++bi) {
+        for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end();
+              ++ii) {
+          for (Value::use_iterator ui = ii->use_begin(); ui != ii->use_end();
+                ++ui) {
+            Instruction *user = dyn_cast<Instruction>(*ui);
+            if (user && !loop->contains(user->getParent())) {
+              ACCEPT_LOG << "value used after loop\n";
+              return false;
+            }
+          }
+          StoreInst *store = dyn_cast<StoreInst>(ii);
+          if (store && isApprox(store) &&
+              !isLocalPtr(store->getPointerOperand()))
+            outputs.push_back(store);
+        }
+      }
+      if (outputs.empty()) {
+        ACCEPT_LOG << "no approximate outputs in memory\n";
+        return false;
+      }
+      for (std::vector<StoreInst*>::iterator si = outputs.begin();
+            si != outputs.end(); ++si) {
+        std::set<AllocaInst*> seen;
+        if (!stableAcross((*si)->getPointerOperand(), loop, parent, seen)) {
+          ACCEPT_LOG << "output location changes between executions\n";
+          return false;
+        }
+      }
+      ACCEPT_LOG << outputs.size() << " outputs\n";
+
+      if (transformPass->relax) {
+        int param = transformPass->relaxConfig.lookup(optName);
+        if (param) {
+          if (param > REUSE_MAX_LEVEL)
+            param = REUSE_MAX_LEVEL;
+          ACCEPT_LOG << "running once every " << (param + 1)
+                     << " executions\n";
+          reuseOutputs(loop, param);
+          return true;
+        } else {
+          ACCEPT_LOG << "not reusing\n";
+          return false;
+        }
+      }
+
+      std::set<BasicBlock*> loopBlocks(loop->block_begin(), loop->block_end());
+      std::set<Instruction*> blockers = AI->preciseEscapeCheck(loopBlocks);
+      for (std::set<Instruction*>::iterator i = blockers.begin();
+            i != blockers.end(); ++i) {
+        ACCEPT_LOG << *i;
+      }
+
+      if (!blockers.size()) {
+        ACCEPT_LOG << "can reuse outputs\n";
+        transformPass->relaxConfig.insert(optName, 0);
+      } else {
+        ACCEPT_LOG << "cannot reuse outputs\n";
+      }
+      return false;
+    }
+
+    // Skip the nest on all but one in (level + 1) of its executions in each
+    // run of the parent loop.
+    void reuseOutputs(Loop *loop, int level) {
+      IRBuilder<> builder(module->getContext());
+      IntegerType *nativeInt = getNativeIntegerType();
+      BasicBlock *preheader = loop->getLoopPreheader();
+
+      builder.SetInsertPoint(
+          preheader->getParent()->getEntryBlock().begin()
+      );
+      AllocaInst *counterAlloca = builder.CreateAlloca(
+          nativeInt,
+          0,
+          "accept_reuse"
+      );
+
+      // Count executions from the start of the parent loop.
+      builder.SetInsertPoint(
+          loop->getParentLoop()->getLoopPreheader()->getTerminator()
+      );
+      builder.CreateStore(ConstantInt::get(nativeInt, 0), counterAlloca);
+
+      // Branch around the nest unless the count is a multiple of the period.
+      // The check goes in a guard block split off the top of the preheader,
+      // so the nest keeps a preheader that only branches to its header.
+      BasicBlock *guard = preheader;
+      preheader = guard->splitBasicBlock(guard->getTerminator(),
+                                         "accept_reuse_enter");
+      loop->getParentLoop()->addBasicBlockToLoop(preheader, LI->getBase());
+      TerminatorInst *entryBranch = guard->getTerminator();
+      builder.SetInsertPoint(entryBranch);
+      Value *count = builder.CreateLoad(counterAlloca, "accept_tmp");
+      builder.CreateStore(
+          builder.CreateAdd(count, ConstantInt::get(nativeInt, 1)),
+          counterAlloca
+      );
+      Value *reuse = builder.CreateIsNotNull(
+          builder.CreateURem(count, ConstantInt::get(nativeInt, level + 1)),
+          "accept_reuse"
+      );
+      builder.CreateCondBr(reuse, loop->getExitBlock(), preheader);
+      entryBranch->eraseFromParent();
+    }
+
+
     /**** PARTIAL BODY PRESERVATION ****/
 
     // This class keeps track of some important instructions for a store
@@ -0,0 +1,303 @@
+#include "llvm/Function.h"
+#include "llvm/Module.h"
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/IRBuilder.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// Approximate memoization. A call whose result is approximate, whose
+// arguments are all scalars, and whose callee only computes on its
+// arguments (it is precise-pure and touches no memory but its own locals)
+// gets a small direct-mapped cache private to the call site and thread.
+// The cache is keyed on the arguments with floating-point mantissas
+// truncated: the site parameter p drops 4p + 3 mantissa bits from floats
+// (and as many significant bits, relative to single precision, from
+// doubles), so nearby inputs share an entry. Integer arguments are
+// compared exactly.
+
+namespace {
+  const unsigned int MEMO_ENTRIES = 128;  // Per site; a power of two.
+  const unsigned int MEMO_MAX_ARGS = 4;
+  const int MEMO_MAX_LEVEL = 5;
+
+  // Keys are 64 bits wide, so wider integers would share entries.
+  bool isMemoScalar(Type *type) {
+    return (type->isIntegerTy() && type->getIntegerBitWidth() <= 64) ||
+           type->isFloatTy() || type->isDoubleTy();
+  }
+}
+
+struct Memoization : public FunctionPass {
+  static char ID;
+  ACCEPTPass *transformPass;
+  ApproxInfo *AI;
+  Module *module;
+
+  Memoization();
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual const char *getPassName() const;
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+  virtual bool runOnFunction(llvm::Function &F);
+
+  std::map<Function*, bool> localPurity;
+  std::vector<Function*> purityOrder;  // Functions in localPurity, in order.
+  bool isLocallyPure(Function *F);
+  bool tryToMemoize(CallInst *call);
+  Value *quantize(IRBuilder<> &builder, Value *arg, int level);
+  void memoize(CallInst *call, int level);
+};
+
+void Memoization::getAnalysisUsage(AnalysisUsage &AU) const {
+  FunctionPass::getAnalysisUsage(AU);
+}
+
+Memoization::Memoization() : FunctionPass(ID) {
+  initializeMemoizationPass(*PassRegistry::getPassRegistry());
+  module = 0;
+}
+
+const char *Memoization::getPassName() const {
+  return "ACCEPT memoization";
+}
+
+bool Memoization::doInitialization(Module &M) {
+  module = &M;
+  transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
+  return false;
+}
+
+bool Memoization::doFinalization(Module &M) {
+  return false;
+}
+
+bool Memoization::runOnFunction(Function &F) {
+  AI = transformPass->AI;
+
+  // Skip optimizing functions that seem to be in standard libraries.
+  if (transformPass->shouldSkipFunc(F))
+    return false;
+
+  std::vector<CallInst*> calls;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      CallInst *call = dyn_cast<CallInst>(ii);
+      if (call && !isa<IntrinsicInst>(call) && call->getCalledFunction() &&
+          isApprox(call))
+        calls.push_back(call);
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<CallInst*>::iterator ci = calls.begin(); ci != calls.end();
+       ++ci)
+    modified |= tryToMemoize(*ci);
+  return modified;
+}
+
+// Whether a function's result depends only on its arguments: it reads and
+// writes only its own local variables and calls only functions like it.
+// Whitelisted library functions (sin, exp, ...) qualify.
+//
+// Recursive calls optimistically assume that the functions being checked
+// are pure. If one of them turns out not to be, every result cached since
+// its check began may depend on that assumption and is discarded.
+bool Memoization::isLocallyPure(Function *F) {
+  if (AI->isWhitelistedPure(F->getName()))
+    return true;
+  if (F->isDeclaration())
+    return F->isIntrinsic() && F->doesNotAccessMemory();
+  if (localPurity.count(F))
+    return localPurity[F];
+
+  size_t mark = purityOrder.size();
+  localPurity[F] = true;  // Optimistically, for recursion.
+  purityOrder.push_back(F);
+  bool pure = true;
+  for (Function::iterator bi = F->begin(); bi != F->end() && pure; ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      Instruction *inst = ii;
+      if (isa<DbgInfoIntrinsic>(inst)) {
+        continue;
+      } else if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        AllocaInst *base = localBase(load->getPointerOperand());
+        pure = !load->isVolatile() && base && base->getParent()->getParent() == F;
+      } else if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+        AllocaInst *base = localBase(store->getPointerOperand());
+        pure = !store->isVolatile() && base && base->getParent()->getParent() == F;
+      } else if (CallInst *call = dyn_cast<CallInst>(inst)) {
+        Function *callee = call->getCalledFunction();
+        pure = callee && isLocallyPure(callee);
+      } else {
+        pure = !inst->mayReadOrWriteMemory();
+      }
+      if (!pure)
+        break;
+    }
+  }
+  if (!pure) {
+    for (size_t i = mark; i < purityOrder.size(); ++i)
+      localPurity.erase(purityOrder[i]);
+    purityOrder.resize(mark);
+    localPurity[F] = false;
+    purityOrder.push_back(F);
+  }
+  return pure;
+}
+
+bool Memoization::tryToMemoize(CallInst *call) {
+  Function *callee = call->getCalledFunction();
+  std::string optName = transformPass->siteName("memo", call);
+  LogDescription *desc = AI->logAdd("Memoization", call);
+  ACCEPT_LOG << optName << "\n";
+  ACCEPT_LOG << "call to " << callee->getName().str() << "\n";
+
+  if (!isMemoScalar(call->getType())) {
+    ACCEPT_LOG << "result is not a scalar\n";
+    return false;
+  }
+  if (call->getNumArgOperands() == 0 ||
+      call->getNumArgOperands() > MEMO_MAX_ARGS) {
+    ACCEPT_LOG << "takes " << call->getNumArgOperands() << " arguments\n";
+    return false;
+  }
+  for (unsigned i = 0; i < call->getNumArgOperands(); ++i) {
+    if (!isMemoScalar(call->getArgOperand(i)->getType())) {
+      ACCEPT_LOG << "argument " << i << " is not a scalar\n";
+      return false;
+    }
+  }
+  if (!AI->isWhitelistedPure(callee->getName()) && !AI->isPrecisePure(callee)) {
+    ACCEPT_LOG << "callee is not precise-pure\n";
+    return false;
+  }
+  if (!isLocallyPure(callee)) {
+    ACCEPT_LOG << "callee accesses non-local memory\n";
+    return false;
+  }
+
+  if (transformPass->relax) {
+    int param = transformPass->relaxConfig.lookup(optName);
+    if (param) {
+      if (param > MEMO_MAX_LEVEL)
+        param = MEMO_MAX_LEVEL;
+      ACCEPT_LOG << "memoizing at level " << param << "\n";
+      memoize(call, param);
+      return true;
+    } else {
+      ACCEPT_LOG << "not memoizing\n";
+    }
+  } else {
+    ACCEPT_LOG << "can memoize\n";
+    transformPass->relaxConfig.insert(optName, 0);
+  }
+  return false;
+}
+
+// An argument's cache key: the value as a 64-bit integer with low mantissa
+// bits cleared.
+Value *Memoization::quantize(IRBuilder<> &builder, Value *arg, int level) {
+  Type *int64Ty = Type::getInt64Ty(module->getContext());
+  Type *type = arg->getType();
+  if (type->isIntegerTy())
+    return builder.CreateSExtOrBitCast(arg, int64Ty);
+
+  unsigned drop = 4 * level + 3;
+  Type *bitsTy = Type::getInt32Ty(module->getContext());
+  if (type->isDoubleTy()) {
+    drop += 52 - 23;
+    bitsTy = int64Ty;
+  }
+  Value *bits = builder.CreateBitCast(arg, bitsTy);
+  bits = builder.CreateAnd(bits, ConstantInt::get(bitsTy, ~0ULL << drop));
+  return builder.CreateZExtOrBitCast(bits, int64Ty);
+}
+
+void Memoization::memoize(CallInst *call, int level) {
+  LLVMContext &ctx = module->getContext();
+  Type *int64Ty = Type::getInt64Ty(ctx);
+  Type *int8Ty = Type::getInt8Ty(ctx);
+  unsigned nargs = call->getNumArgOperands();
+
+  // The site's table: entries of {keys..., result, valid}, one table per
+  // thread so no synchronization is needed.
+  std::vector<Type*> fields(nargs, int64Ty);
+  fields.push_back(call->getType());
+  fields.push_back(int8Ty);
+  StructType *entryTy = StructType::get(ctx, fields);
+  ArrayType *tableTy = ArrayType::get(entryTy, MEMO_ENTRIES);
+  GlobalVariable *table = new GlobalVariable(*module, tableTy, false,
+      GlobalValue::InternalLinkage, Constant::getNullValue(tableTy),
+      "accept_memo", NULL, GlobalVariable::GeneralDynamicTLSModel);
+
+  BasicBlock *head = call->getParent();
+  Function *F = head->getParent();
+  BasicBlock *tail = head->splitBasicBlock(call, "memo.done");
+  BasicBlock *hit = BasicBlock::Create(ctx, "memo.hit", F, tail);
+  BasicBlock *miss = BasicBlock::Create(ctx, "memo.miss", F, tail);
+  head->getTerminator()->eraseFromParent();
+
+  // Look up the entry for the quantized arguments.
+  IRBuilder<> builder(head);
+  std::vector<Value*> keys;
+  Value *hash = ConstantInt::get(int64Ty, 0);
+  for (unsigned i = 0; i < nargs; ++i) {
+    Value *key = quantize(builder, call->getArgOperand(i), level);
+    keys.push_back(key);
+    hash = builder.CreateXor(hash, key);
+    hash = builder.CreateMul(hash,
+        ConstantInt::get(int64Ty, 0x9e3779b97f4a7c15ULL));
+  }
+  Value *index = builder.CreateAnd(builder.CreateLShr(hash, 32),
+                                   ConstantInt::get(int64Ty, MEMO_ENTRIES - 1));
+  Value *idx[] = { ConstantInt::get(int64Ty, 0), index };
+  Value *entry = builder.CreateInBoundsGEP(table, idx, "memo.entry");
+
+  Value *match = builder.CreateICmpNE(
+      builder.CreateLoad(builder.CreateStructGEP(entry, nargs + 1)),
+      ConstantInt::get(int8Ty, 0));
+  for (unsigned i = 0; i < nargs; ++i) {
+    Value *stored = builder.CreateLoad(builder.CreateStructGEP(entry, i));
+    match = builder.CreateAnd(match, builder.CreateICmpEQ(stored, keys[i]));
+  }
+  builder.CreateCondBr(match, hit, miss);
+
+  // The cached result is as approximate as the call.
+  MDNode *quals = call->getMetadata("quals");
+  builder.SetInsertPoint(hit);
+  Value *cached = setQuals(builder.CreateLoad(
+      builder.CreateStructGEP(entry, nargs), "memo.value"), quals);
+  builder.CreateBr(tail);
+
+  // On a miss, make the call and fill the entry.
+  builder.SetInsertPoint(miss);
+  BranchInst *missBr = builder.CreateBr(tail);
+  call->moveBefore(missBr);
+  builder.SetInsertPoint(missBr);
+  for (unsigned i = 0; i < nargs; ++i)
+    builder.CreateStore(keys[i], builder.CreateStructGEP(entry, i));
+  setQuals(builder.CreateStore(call, builder.CreateStructGEP(entry, nargs)),
+           quals);
+  builder.CreateStore(ConstantInt::get(int8Ty, 1),
+                      builder.CreateStructGEP(entry, nargs + 1));
+
+  PHINode *result = PHINode::Create(call->getType(), 2, "memo",
+                                    tail->begin());
+  result->setMetadata("quals", quals);
+  call->replaceAllUsesWith(result);
+  result->addIncoming(cached, hit);
+  result->addIncoming(call, miss);
+}
+
+char Memoization::ID = 0;
+INITIALIZE_PASS(Memoization, "memo", "ACCEPT memoization", false, false)
+FunctionPass *llvm::createMemoizationPass() { return new Memoization(); }
@@ -3,6 +3,7 @@
 #include "llvm/Analysis/LoopPass.h"
 #include "llvm/IRBuilder.h"
 #include "llvm/Module.h"
+#include "llvm/Operator.h"
 #include "llvm/Function.h"
 #include "llvm/Argument.h"
 #include "llvm/IntrinsicInst.h"
@@ -14,6 +15,9 @@
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/Analysis/PostDominators.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Transforms/Utils/CodeExtractor.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+#include "llvm/Support/CFG.h"
 
 #include <sstream>
 #include <iostream>
@@ -39,6 +43,25 @@ namespace {
   cl::opt<int> optNPUBufferSize("accept-npu-bufsize",
       cl::desc("ACCEPT: NPU interface buffer size"));
 
+  cl::opt<bool> optNPUHost("accept-npu-host",
+      cl::desc("ACCEPT: target the software NPU in the host runtime "
+               "instead of the memory-mapped accelerator"));
+
+  cl::opt<bool> optNPUTrace("accept-npu-trace",
+      cl::desc("ACCEPT: record the inputs and outputs of NPU candidates "
+               "instead of transforming them"));
+
+  cl::opt<bool> optNPURegions("accept-npu-regions",
+      cl::desc("ACCEPT: also consider approximate code regions in loop "
+               "bodies, outlining them into NPU candidates"));
+
+  cl::opt<bool> optNPUPipeline("accept-npu-pipeline",
+      cl::desc("ACCEPT: overlap software NPU evaluation with the code "
+               "that consumes its outputs"));
+
+  // Capacity, in floats, of each memory-mapped accelerator buffer.
+  const int NPU_HW_BUFFER_FLOATS = 0x8000 / sizeof(float);
+
   struct LoopNPU: public LoopPass {
     static char ID;
     bool modified;
@@ -75,22 +98,6 @@ namespace {
       DT = &getAnalysis<DominatorTree>();
       bool retValue;
       retValue = tryToOptimizeLoop(loop);
-      /*
-      std::set< std::set<BasicBlock*> > regions;
-      //getRegions(loop, regions);
-
-      std::string type_str;
-      llvm::raw_string_ostream rso(type_str);
-      for (std::set<std::set<BasicBlock*> >::iterator ri = regions.begin(); ri != regions.end(); ++ri) {
-        rso << "------ region:\n";
-        for (std::set<BasicBlock*>::iterator bi = ri->begin(); bi != ri->end(); ++bi) {
-          for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end(); ++ii)
-            rso << *ii << "\n";
-          rso << "\n";
-        }
-      }
-      std::cerr << "\n" << rso.str() << std::endl;
-      */
 
 
       return retValue;
@@ -110,6 +117,7 @@ namespace {
 
     std::vector<Loop *> loops_to_npu;
     std::vector<Instruction *> calls_to_npu;
+    std::set<Instruction *> traced_calls;
     bool find_inst(Instruction *inst) {
       for (int i = 0; i < calls_to_npu.size(); ++i)
         if (calls_to_npu[i] == inst)
@@ -117,17 +125,36 @@ namespace {
       return false;
     }
 
-    void formRegionBetween(BasicBlock *entry, BasicBlock *exit, std::set<BasicBlock*> &region) {
+    // Code region discovery (-accept-npu-regions). Besides calls, a loop
+    // body can contain single-entry, single-exit regions of approximate
+    // straight-line computation. Such a region is outlined into a function
+    // and its call becomes an NPU candidate like any other.
+
+    // Limits on the regions considered: scalar live-ins and live-outs
+    // become NPU inputs and outputs, and tiny regions are not worth a
+    // network evaluation.
+    static const unsigned int region_max_inputs = 8;
+    static const unsigned int region_max_outputs = 4;
+    static const unsigned int region_min_insts = 8;
+
+    // Collect the blocks reachable from entry without going past exit.
+    // Fails if the walk leaves the loop or takes its back edge.
+    bool formRegionBetween(BasicBlock *entry, BasicBlock *exit, Loop *loop,
+                           std::set<BasicBlock*> &region) {
       if (region.count(entry))
-        return;
+        return true;
+      if (!loop->contains(entry) || entry == loop->getHeader())
+        return false;
       region.insert(entry);
       if (entry == exit)
-        return;
+        return true;
       TerminatorInst *term = entry->getTerminator();
       if (!term)
-        return;
+        return false;
       for (int i = 0; i < term->getNumSuccessors(); ++i)
-        formRegionBetween(term->getSuccessor(i), exit, region);
+        if (!formRegionBetween(term->getSuccessor(i), exit, loop, region))
+          return false;
+      return true;
     }
 
     void getPostDominated(BasicBlock *block, std::set<BasicBlock*> &post_dominated) {
@@ -137,19 +164,172 @@ namespace {
       }
     }
 
-    void getRegions(Loop *loop, std::set< std::set<BasicBlock*> > &regions) {
+    // Check that a region can be offloaded: it must be entered only
+    // through its entry block, leave through a single edge, stay inside
+    // the loop body proper, compute on scalars without touching memory,
+    // and let nothing precise escape. Returns the number of (non-
+    // terminator) instructions, or 0 if the region is unsuitable.
+    unsigned int checkRegion(Loop *loop, BasicBlock *entry, BasicBlock *exit,
+                             const std::set<BasicBlock*> &region) {
+      if (exit == loop->getLoopLatch() || exit->getTerminator()->getNumSuccessors() != 1)
+        return 0;
+
+      std::set<Value*> inputs;
+      std::set<Instruction*> outputs;
+      unsigned int size = 0;
+      for (std::set<BasicBlock*>::const_iterator bi = region.begin();
+           bi != region.end(); ++bi) {
+        BasicBlock *bb = *bi;
+        if (LI->getLoopFor(bb) != loop)
+          return 0;  // Part of an inner loop.
+        if (bb != entry) {
+          for (pred_iterator pi = pred_begin(bb); pi != pred_end(bb); ++pi)
+            if (!region.count(*pi))
+              return 0;  // Side entrance.
+        }
+
+        for (BasicBlock::iterator ii = bb->begin(); ii != bb->end(); ++ii) {
+          Instruction *inst = ii;
+          if (isa<TerminatorInst>(inst) || isa<DbgInfoIntrinsic>(inst))
+            continue;
+          if (CallInst *call = dyn_cast<CallInst>(inst)) {
+            Function *callee = call->getCalledFunction();
+            if (!callee || !AI->isWhitelistedPure(callee->getName()))
+              return 0;
+          } else if (inst->mayReadOrWriteMemory() || isa<AllocaInst>(inst)) {
+            return 0;
+          }
+          ++size;
+
+          for (User::op_iterator oi = inst->op_begin(); oi != inst->op_end(); ++oi) {
+            Value *op = *oi;
+            Instruction *op_inst = dyn_cast<Instruction>(op);
+            if ((op_inst && !region.count(op_inst->getParent())) ||
+                isa<Argument>(op)) {
+              if (!isMarshallableScalar(op->getType()))
+                return 0;
+              inputs.insert(op);
+            }
+          }
+          for (Value::use_iterator ui = inst->use_begin(); ui != inst->use_end(); ++ui) {
+            Instruction *user = dyn_cast<Instruction>(*ui);
+            if (user && !region.count(user->getParent())) {
+              if (!isMarshallableScalar(inst->getType()))
+                return 0;
+              outputs.insert(inst);
+            }
+          }
+        }
+      }
+
+      if (size < region_min_insts || outputs.empty() ||
+          inputs.size() > region_max_inputs ||
+          outputs.size() > region_max_outputs)
+        return 0;
+      if (!AI->preciseEscapeCheck(region).empty())
+        return 0;
+      return size;
+    }
+
+    // Find the largest suitable region in the loop body. The region's
+    // blocks are returned with the entry first (as CodeExtractor expects).
+    bool getRegion(Loop *loop, std::vector<BasicBlock*> &best) {
+      unsigned int best_size = 0;
       for (Loop::block_iterator bi = loop->block_begin(); bi != loop->block_end(); ++bi) {
-        std::set<BasicBlock*> post_dominated;
-        getPostDominated(*bi, post_dominated);
-        for (std::set<BasicBlock*>::iterator pdi = post_dominated.begin(); pdi != post_dominated.end(); ++pdi)
-          if (DT->properlyDominates(*pdi, *bi)) { // Avoid single BB entries
-            std::set<BasicBlock*> tmp_region;
-            formRegionBetween(*pdi, *bi, tmp_region);
-            std::set<Instruction*> blockers = AI->preciseEscapeCheck(tmp_region);
-            if (blockers.empty())
-              regions.insert(tmp_region);
+        BasicBlock *exit = *bi;
+        std::set<BasicBlock*> entries;
+        getPostDominated(exit, entries);
+        entries.insert(exit);
+        for (std::set<BasicBlock*>::iterator ei = entries.begin(); ei != entries.end(); ++ei) {
+          BasicBlock *entry = *ei;
+          if (!DT->dominates(entry, exit))
+            continue;
+          std::set<BasicBlock*> region;
+          if (!formRegionBetween(entry, exit, loop, region))
+            continue;
+          unsigned int size = checkRegion(loop, entry, exit, region);
+          if (size > best_size) {
+            best_size = size;
+            best.clear();
+            best.push_back(entry);
+            for (std::set<BasicBlock*>::iterator ri = region.begin(); ri != region.end(); ++ri)
+              if (*ri != entry)
+                best.push_back(*ri);
           }
+        }
       }
+      return best_size > 0;
+    }
+
+    // Outline a region and return the call that replaces it (or NULL).
+    // The loop's blocks change, so LoopInfo and the dominator trees are
+    // updated for the transformation that follows.
+    CallInst *outlineRegion(Loop *loop, const std::vector<BasicBlock*> &blocks) {
+      Function *F = loop->getHeader()->getParent();
+      std::set<BasicBlock*> old_blocks;
+      for (Function::iterator bi = F->begin(); bi != F->end(); ++bi)
+        old_blocks.insert(bi);
+
+      CodeExtractor extractor(blocks);
+      if (!extractor.isEligible())
+        return NULL;
+      Function *outlined = extractor.extractCodeRegion();
+      if (!outlined)
+        return NULL;
+
+      for (std::vector<BasicBlock*>::const_iterator bi = blocks.begin();
+           bi != blocks.end(); ++bi)
+        if ((*bi)->getParent() != F)
+          LI->removeBlock(*bi);
+      for (Function::iterator bi = F->begin(); bi != F->end(); ++bi)
+        if (!old_blocks.count(bi))
+          loop->addBasicBlockToLoop(bi, LI->getBase());
+      DT->runOnFunction(*F);
+      PDT->runOnFunction(*F);
+
+      for (Value::use_iterator ui = outlined->use_begin();
+           ui != outlined->use_end(); ++ui)
+        if (CallInst *call = dyn_cast<CallInst>(*ui))
+          return call;
+      return NULL;
+    }
+
+    // Look for a code region in a loop with no candidate calls. In the
+    // analysis run the region only registers the loop's parameter; it is
+    // outlined when the parameter is set (or when tracing, so a network
+    // can be trained for it).
+    bool tryRegion(Loop *loop, StringRef optName, LogDescription *desc) {
+      std::vector<BasicBlock*> blocks;
+      if (!getRegion(loop, blocks))
+        return false;
+      ACCEPT_LOG << "code region at "
+                 << srcPosDesc(*module, blocks[0]->begin()->getDebugLoc())
+                 << "\n";
+
+      if (!optNPUTrace) {
+        if (!transformPass->relax) {
+          ACCEPT_LOG << "can NPUify region\n";
+          transformPass->relaxConfig.insert(optName, 0);
+          if (optNPUHost)
+            transformPass->relaxConfig.insert("npu_precision" +
+                optName.substr(optName.find(' ')).str(), 0);
+          return false;
+        }
+        if (!transformPass->relaxConfig.lookup(optName)) {
+          ACCEPT_LOG << "could NPUify region\n";
+          return false;
+        }
+      }
+
+      CallInst *call = outlineRegion(loop, blocks);
+      if (!call) {
+        ACCEPT_LOG << "region cannot be outlined\n";
+        return false;
+      }
+      ACCEPT_LOG << "outlined as " << call->getCalledFunction()->getName().str() << "\n";
+      loops_to_npu.push_back(loop);
+      calls_to_npu.push_back(call);
+      return true;
     }
 
     // Not handling recursive or cyclic function calls.
@@ -248,13 +428,20 @@ namespace {
 
       } // for basic blocks
 
+      // Without candidate calls, look for a code region to outline.
+      if (optNPURegions && calls_to_npu.empty())
+        modified |= tryRegion(loop, optName, desc);
+
       ACCEPT_LOG << "calls: " << calls_to_npu.size() << "\n";
       for (int i = 0; i < calls_to_npu.size(); ++i) {
         // std::cerr << "Calls to npu size: " << calls_to_npu.size() << std::endl;
         // std::cerr << "++++ begin" << std::endl;
         CallInst *c = dyn_cast<CallInst>(calls_to_npu[i]);
         // std::cerr << "Function npu: " << (c->getCalledFunction()->getName()).str() << std::endl;
-        modified = tryToNPU(loops_to_npu[i], calls_to_npu[i], optName, desc);
+        if (optNPUTrace)
+          modified |= traceCall(calls_to_npu[i], desc);
+        else
+          modified |= tryToNPU(loops_to_npu[i], calls_to_npu[i], optName, desc);
         // std::cerr << "++++ middle" << std::endl;
         /*
         for (Loop::block_iterator bi = loop->block_begin(); bi != loop->block_end(); ++bi) {
@@ -531,34 +718,11 @@ namespace {
     return false;
   } // pre_pos_call_dependency_check
 
-  bool tryToNPU(Loop *loop, Instruction *inst, StringRef optName, LogDescription *desc) {
-    // We need a loop latch to jump to after reading oBuff
-    // and executing the instructions after the function call.
-    if (!loop->getLoopLatch() || !loop->getLoopPreheader() || !loop->getHeader()) {
-      ACCEPT_LOG << "malformed loop\n";
-      return false;
-    }
-
-    if (!inst->getType()->isIntegerTy() &&
-        !inst->getType()->isVoidTy() &&
-        !inst->getType()->isFloatTy()) {
-      ACCEPT_LOG << "call's return type is not int, void, or FP\n";
-      return false;
-    }
-
-    std::vector<Instruction*> before_insts_tobuff;
-    std::vector<Value*> st_value;
-    std::vector<Value*> st_addr;
-    std::vector<StoreInst*> st_inst;
-    if (pre_pos_call_dependency_check(inst, loop, before_insts_tobuff, st_value, st_addr, st_inst)) {
-      // std::cerr << "BOSTA" << std::endl;
-      ACCEPT_LOG << "dependency check failed\n";
-      return false;
-    }
-
-    const CallInst *c_inst = dyn_cast<CallInst>(inst);
-    Function *f = c_inst->getCalledFunction();
-
+  // Find the stores in the called function that escape it (approx or not).
+  // These are the region's outputs besides its return value. Returns false
+  // if the function cannot be a region.
+  bool getEscapedStores(Function *f, std::vector<StoreInst *> &escaped_stores,
+                        LogDescription *desc) {
     // Region is the entire called function. All of its instructions.
     // "Stores" is all the store instructions in the called function.
     std::set<Instruction *> region;
@@ -587,7 +751,6 @@ namespace {
 
     // Get a list of all the stores that escape the function
     // (approx or not).
-    std::vector<StoreInst *> escaped_stores;
     for (int i = 0; i < n_stores; ++i)
       if (AI->storeEscapes(stores[i], region, false))
         escaped_stores.push_back(stores[i]);
@@ -596,48 +759,19 @@ namespace {
     if (escaped_stores.size() > output_threshold)
       escaped_stores.clear();
 
-    // The list of parameters as in the function prototype.
-    // Both in string and Value formats.
-    // TODO: Not sure if the string version is needed. If not, remove it.
-    typedef iplist<Argument> ArgumentListType;
-    std::vector<std::string> callee_args_str;
-    std::vector<Value *> callee_args_value;
-    for (ArgumentListType::iterator ai = (f->getArgumentList()).begin();
-          ai != (f->getArgumentList()).end();
-          ++ai) {
-      std::string type_str;
-      llvm::raw_string_ostream rso(type_str);
-      rso << *ai;
-      callee_args_str.push_back(rso.str());
-      callee_args_value.push_back(ai);
-    }
-
-    /*
-    AliasSetTracker *st = new AliasSetTracker(*AA);
-    for (Function::iterator bi = f->begin(); bi != f->end(); ++bi)
-      st->add(*bi);
-    //if (st->getAliasSetForPointerIfExists(inst, AA->getDataLayout()->getTypeStoreSize(callee_args_value[i]->getType()), NULL))
-    std::cerr << "alias sets dump" << std::endl;
-    for (AliasSetTracker::iterator I = st->begin(); I != st->end(); ++I) {
-      AliasSet &AS = *I;
-      std::cerr << "=============== one more set" << std::endl;
-      AS.dump();
-    }
-    delete st;
-    */
-
-    // Number of inputs passed to the function call.
-    // It looks like the code of the function itself is the last element.
-    unsigned int n = inst->getNumOperands() - 1;
+    return true;
+  }
 
-    // For pointer arguments, determine first which ones will
-    // be passed as input to the NPU. Rules are:
-    // 1 - If it can be determined from the function signature
-    // how many elements the argument expects AND it's a small number.
-    // e.g void f(int a[5]);
-    // 2 - If it can be determined *exactly where the pointer points to*
-    // and it's a small declaration.
-    std::vector<int> op_size;
+  // For pointer arguments, determine first which ones will
+  // be passed as input to the NPU. Rules are:
+  // 1 - If it can be determined from the function signature
+  // how many elements the argument expects AND it's a small number.
+  // e.g void f(int a[5]);
+  // 2 - If it can be determined *exactly where the pointer points to*
+  // and it's a small declaration.
+  // This reads the sizes found for rule 1 by the frontend; -1 marks a
+  // candidate for rule 2.
+  void getArrayArgSizes(Function *f, unsigned int n, std::vector<int> &op_size) {
     const int input_size_threshold = 10;
     std::ifstream file("accept-npuArrayArgs-info.txt");
     if (file.is_open()) {
@@ -649,109 +783,427 @@ namespace {
       }
     }
     for (unsigned int i = 0; i < n; ++i) {
-      int n_array;
+      int n_array = 0;
       file >> n_array;
       op_size.push_back(n_array < input_size_threshold ? n_array : 0);
     }
     file.close();
+  }
 
-    std::vector<bool> is_matrix;
-    std::vector<int> mdim1(n, 0);
-    std::vector<int> mdim2(n, 0);
-    for (unsigned int i = 0; i < n; ++i) {
-      is_matrix.push_back(op_size[i] == -1 ? true : false);
+  // Determine which arguments are written by the escaping stores. Returns
+  // true if there is any such argument.
+  bool getOutputArgs(Function *f, const std::vector<StoreInst *> &escaped_stores,
+                     std::vector<bool> &is_output_arg) {
+    bool has_output_arg = false;
+    for (Function::arg_iterator ai = f->arg_begin(); ai != f->arg_end(); ++ai) {
+      is_output_arg.push_back(false);
+      for (int j = 0; j < escaped_stores.size(); ++j) {
+        if (ai->getName().str() == (escaped_stores[j])->getPointerOperand()->getName().str()) {
+          has_output_arg = true;
+          is_output_arg.back() = true;
+          break;
+        }
+      }
+    }
+    return has_output_arg;
+  }
 
-      if (op_size[i] != -1)
-        continue;
+  // Argument marshalling. Every value crossing the NPU interface is
+  // flattened to a sequence of floats: integer and double scalars are
+  // converted, and fixed-size aggregates (arrays, structs, and vectors of
+  // scalars, nested arbitrarily) contribute their scalars in memory order.
 
-      // std::cerr << "op_size " << op_size[i] << std::endl;
-      // std::cerr << "operands: " << inst->getNumOperands() << std::endl;
-      GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(inst->getOperandUse(i));
-      AllocaInst *ainst = dyn_cast<AllocaInst>(inst->getOperandUse(i));
-      GlobalValue *aval = dyn_cast<GlobalValue>(inst->getOperandUse(i));
-      GlobalVariable *avar = dyn_cast<GlobalVariable>(inst->getOperandUse(i));
-      Instruction *bainst = dyn_cast<Instruction>(inst->getOperandUse(i));
-      GlobalAlias *gal = dyn_cast<GlobalAlias>(inst->getOperandUse(i));
-      // std::cerr << "dump bla" << std::endl;
-      /*
-      for (int j = 0; j < 22; ++j) {
-        unsigned char u = j;
-        unsigned c = u;
-        std::cerr << j << "\t" << c << std::endl;
-      }
-      std::cerr << "end dump bla" << std::endl;
-      std::cerr << "special dump 1" << std::endl;
-      inst->getOperandUse(i)->getType()->dump();
-      std::cerr << "end special dump 1" << std::endl;
-            std::string type_str;
-            llvm::raw_string_ostream rso(type_str);
-            rso << *(inst->getOperandUse(i));
-            std::cerr << rso.str() << std::endl;
-            (inst->getOperandUse(i))->dump();
-      if (!ainst) std::cerr << "notalloca" << std::endl;
-      if (!aval) std::cerr << "notgv" << std::endl;
-      if (!avar) std::cerr << "notgvar" << std::endl;
-      if (!bainst) std::cerr << "notinst" << std::endl;
-      if (!bainst) std::cerr << "notgal" << std::endl;
-      std::cerr << "\n\n\n\n\n" <<std::endl;
-      std::cerr << inst->getValueID() << std::cerr;
-      std::cerr << "\n\n\n\n\n" <<std::endl;
-      std::cerr << inst->getOperandUse(i)->getValueID() << std::cerr;
-      std::cerr << "\n\n\n\n\n" <<std::endl;
-      */
+  // Pointed-to objects with more scalars than this are not passed.
+  static const int object_size_threshold = 64;
 
-      //====================================
+  // Integers are signed unless they are booleans (i1) or the call marks
+  // them zeroext, as the frontend does for unsigned char and short
+  // arguments and return values. IR does not record the signedness of
+  // wider integers.
+  bool isUnsignedInt(Type *type, bool zext) {
+    return type->isIntegerTy() && (zext || type->isIntegerTy(1));
+  }
 
+  Value *convertToFloat(IRBuilder<> &builder, Value *v, bool zext=false) {
+    Type *floatTy = Type::getFloatTy(module->getContext());
+    if (isUnsignedInt(v->getType(), zext))
+      return builder.CreateUIToFP(v, floatTy, "npu_conv");
+    else if (v->getType()->isIntegerTy())
+      return builder.CreateSIToFP(v, floatTy, "npu_conv");
+    else if (v->getType()->isDoubleTy())
+      return builder.CreateFPTrunc(v, floatTy, "npu_conv");
+    return v;
+  }
 
-      if (!GEP || !GEP->hasAllZeroIndices()) {
-        op_size[i] = 0;
-        continue;
+  Value *convertFromFloat(IRBuilder<> &builder, Value *v, Type *type,
+                          bool zext=false) {
+    if (isUnsignedInt(type, zext))
+      return builder.CreateFPToUI(v, type, "npu_conv");
+    else if (type->isIntegerTy())
+      return builder.CreateFPToSI(v, type, "npu_conv");
+    else if (type->isDoubleTy())
+      return builder.CreateFPExt(v, type, "npu_conv");
+    return v;
+  }
+
+  bool isMarshallableScalar(Type *type) {
+    return type->isIntegerTy() || type->isFloatTy() || type->isDoubleTy();
+  }
+
+  // The number of scalars in a value of the given type, or -1 if it
+  // contains anything that cannot be converted to float (e.g., pointers).
+  int scalarCount(Type *type) {
+    if (isMarshallableScalar(type))
+      return 1;
+    if (SequentialType *seq = dyn_cast<SequentialType>(type)) {
+      if (type->isPointerTy())
+        return -1;
+      int elems = type->isArrayTy() ? type->getArrayNumElements()
+                                    : type->getVectorNumElements();
+      int count = scalarCount(seq->getElementType());
+      return count < 0 ? -1 : elems * count;
+    }
+    if (StructType *st = dyn_cast<StructType>(type)) {
+      int total = 0;
+      for (unsigned int i = 0; i < st->getNumElements(); ++i) {
+        int count = scalarCount(st->getElementType(i));
+        if (count < 0)
+          return -1;
+        total += count;
       }
+      return total;
+    }
+    return -1;
+  }
+
+  // The fixed-size object a pointer argument refers to, or NULL if it is
+  // unknown. Pointers to local and global variables refer to the whole
+  // variable. A pointer to the first element of an array (as when an
+  // array, or a row of a multidimensional array, is passed to a function)
+  // refers to the whole array.
+  Type *pointedObject(Value *ptr) {
+    if (AllocaInst *alloca = dyn_cast<AllocaInst>(ptr)) {
+      if (alloca->isArrayAllocation())
+        return NULL;
+      return alloca->getAllocatedType();
+    }
+    if (GlobalVariable *global = dyn_cast<GlobalVariable>(ptr))
+      return global->getType()->getElementType();
+
+    GEPOperator *gep = dyn_cast<GEPOperator>(ptr);
+    if (!gep || !gep->hasAllConstantIndices())
+      return NULL;
+    Value *base = gep->getPointerOperand();
+    if (!isa<AllocaInst>(base) && !isa<GlobalVariable>(base))
+      return NULL;
+    if (isa<AllocaInst>(base) && cast<AllocaInst>(base)->isArrayAllocation())
+      return NULL;
+
+    unsigned int n_idx = gep->getNumIndices();
+    ConstantInt *last = dyn_cast<ConstantInt>(gep->getOperand(n_idx));
+    if (n_idx >= 2 && last && last->isZero()) {
+      std::vector<Value *> prefix(gep->idx_begin(), gep->idx_end() - 1);
+      Type *outer = GetElementPtrInst::getIndexedType(base->getType(), prefix);
+      if (outer && outer->isArrayTy())
+        return outer;
+    }
+    return cast<PointerType>(ptr->getType())->getElementType();
+  }
 
-      Value *ptr = GEP->getPointerOperand();
-      AllocaInst *allocai = dyn_cast<AllocaInst>(ptr);
-      if (!allocai) {
+  // Determine which objects the pointer arguments pass to the NPU. Arrays
+  // sized by the frontend (op_size > 0) are passed whole, and pointers the
+  // frontend could not size (-1) are passed if they refer to a small
+  // fixed-size object. Afterwards, op_size holds the number of scalars
+  // each pointer argument passes and obj_type the passed object's type.
+  void resolvePointerArgs(CallInst *call, std::vector<int> &op_size,
+                          std::vector<Type *> &obj_type) {
+    for (unsigned int i = 0; i < op_size.size(); ++i) {
+      obj_type.push_back(NULL);
+      Type *type = call->getArgOperand(i)->getType();
+      if (!type->isPointerTy()) {
         op_size[i] = 0;
         continue;
       }
 
-      Type *ty1 = allocai->getAllocatedType();
-      // std::cerr << "special dump 2" << std::endl;
-      ty1->dump();
-      // std::cerr << "end special dump 2" << std::endl;
-      if (!ty1->isArrayTy() || !ty1->getNumContainedTypes()) {
-        op_size[i] = 0;
+      Type *obj = NULL;
+      if (op_size[i] > 0)
+        obj = ArrayType::get(cast<PointerType>(type)->getElementType(),
+                             op_size[i]);
+      else if (op_size[i] == -1)
+        obj = pointedObject(call->getArgOperand(i));
+      op_size[i] = 0;
+      if (!obj)
         continue;
+
+      int count = scalarCount(obj);
+      if (count > 0 && count <= object_size_threshold) {
+        op_size[i] = count;
+        obj_type.back() = obj;
+      }
+    }
+  }
+
+  // Append the scalars of an aggregate value (or a scalar) to out. zext
+  // marks a scalar as unsigned (see isUnsignedInt).
+  void flattenValue(IRBuilder<> &builder, Value *v, std::vector<Value *> &out,
+                    bool zext=false) {
+    Type *type = v->getType();
+    if (isMarshallableScalar(type)) {
+      out.push_back(convertToFloat(builder, v, zext));
+    } else if (type->isVectorTy()) {
+      for (unsigned int i = 0; i < type->getVectorNumElements(); ++i)
+        out.push_back(convertToFloat(builder,
+            builder.CreateExtractElement(v, builder.getInt32(i))));
+    } else {
+      unsigned int elems = type->isArrayTy() ? type->getArrayNumElements()
+                           : cast<StructType>(type)->getNumElements();
+      for (unsigned int i = 0; i < elems; ++i)
+        flattenValue(builder, builder.CreateExtractValue(v, i), out);
+    }
+  }
+
+  // Append the scalars of the object of the given type at ptr to out.
+  void flattenObject(IRBuilder<> &builder, Value *ptr, Type *type,
+                     std::vector<Value *> &idx, std::vector<Value *> &out) {
+    if (type->isArrayTy() || type->isStructTy()) {
+      unsigned int elems = type->isArrayTy() ? type->getArrayNumElements()
+                           : cast<StructType>(type)->getNumElements();
+      for (unsigned int i = 0; i < elems; ++i) {
+        idx.push_back(builder.getInt32(i));
+        Type *elemTy = type->isArrayTy() ? type->getArrayElementType()
+                       : cast<StructType>(type)->getElementType(i);
+        flattenObject(builder, ptr, elemTy, idx, out);
+        idx.pop_back();
       }
+    } else {
+      Value *addr = builder.CreateInBoundsGEP(ptr, idx, "npu_marshal_gep");
+      flattenValue(builder, builder.CreateLoad(addr), out);
+    }
+  }
 
-      Type *ty2 = (ty1->getContainedType(0));
-      if (!ty2->isArrayTy() || !ty2->getNumContainedTypes() || !ty2->getContainedType(0)->isFloatTy()) {
-        op_size[i] = 0;
+  // Flatten the call's inputs: scalar and aggregate arguments by value and
+  // the objects selected by resolvePointerArgs, in argument order.
+  void flattenInputs(IRBuilder<> &builder, CallInst *call,
+                     const std::vector<Type *> &obj_type,
+                     std::vector<Value *> &out) {
+    for (unsigned int i = 0; i < call->getNumArgOperands(); ++i) {
+      Value *arg = call->getArgOperand(i);
+      if (!arg->getType()->isPointerTy()) {
+        flattenValue(builder, arg, out,
+                     call->paramHasAttr(i + 1, Attributes::ZExt));
+      } else if (obj_type[i]) {
+        std::vector<Value *> idx(1, builder.getInt32(0));
+        Value *obj = builder.CreateBitCast(arg, obj_type[i]->getPointerTo(),
+                                           "npu_marshal_obj");
+        flattenObject(builder, obj, obj_type[i], idx, out);
+      }
+    }
+  }
+
+  // Check that the call's arguments can be marshalled and count the
+  // scalars passed to the NPU and the output arguments written back.
+  bool countScalars(CallInst *call, const std::vector<int> &op_size,
+                    const std::vector<bool> &is_output_arg,
+                    int &n_inputs, int &n_ptr_outputs,
+                    LogDescription *desc) {
+    n_inputs = 0;
+    n_ptr_outputs = 0;
+    for (unsigned int i = 0; i < call->getNumArgOperands(); ++i) {
+      Type *type = call->getArgOperand(i)->getType();
+      if (!type->isPointerTy()) {
+        int count = scalarCount(type);
+        if (count < 0) {
+          ACCEPT_LOG << "cannot marshal argument " << i << "\n";
+          return false;
+        }
+        n_inputs += count;
         continue;
       }
 
-      op_size[i] = ty1->getArrayNumElements() * ty2->getArrayNumElements();
-      mdim1[i] = ty1->getArrayNumElements();
-      mdim2[i] = ty2->getArrayNumElements();
+      n_inputs += op_size[i];
+      if (i < is_output_arg.size() && is_output_arg[i]) {
+        if (!isMarshallableScalar(cast<PointerType>(type)->getElementType())) {
+          ACCEPT_LOG << "cannot marshal output argument " << i << "\n";
+          return false;
+        }
+        ++n_ptr_outputs;
+      }
     }
+    return true;
+  }
 
-    // Check the declaration (alloca) to see if it is a "normal" variable (i.e. not a pointer)
-    // TODO: Also check whether it's an array whose size we can determine (and also check
-    // whether p[] allow p to point to anywhere else...
+  // The number of values a region produces per invocation: the return
+  // value, if any, then one per output argument. Stores to anything else
+  // are not outputs of the network. Tracing and the NPU buffers both use
+  // this layout, so a trained topology matches the transformed region.
+  int countOutputs(CallInst *call, int n_ptr_outputs) {
+    return n_ptr_outputs + (call->getType()->isVoidTy() ? 0 : 1);
+  }
+
+  // Instrument a candidate call to record the values that would cross the
+  // NPU interface, for training the region's network offline. The values are
+  // flattened the same way as the NPU buffers: the inputs (see
+  // flattenInputs), then the return value and one value per output
+  // argument. The runtime streams these samples to
+  // accept_npu_trace.bin.
+  bool traceCall(Instruction *inst, LogDescription *desc) {
+    if (traced_calls.count(inst))
+      return false;
+    traced_calls.insert(inst);
+
+    CallInst *call = cast<CallInst>(inst);
+    Function *f = call->getCalledFunction();
+    if (!call->getType()->isVoidTy() &&
+        !isMarshallableScalar(call->getType())) {
+      ACCEPT_LOG << "cannot trace return type\n";
+      return false;
+    }
+
+    std::vector<StoreInst *> escaped_stores;
+    if (!getEscapedStores(f, escaped_stores, desc))
+      return false;
+    unsigned int n = call->getNumArgOperands();
+    std::vector<int> op_size;
+    getArrayArgSizes(f, n, op_size);
+    std::vector<Type *> obj_type;
+    resolvePointerArgs(call, op_size, obj_type);
+    std::vector<bool> is_output_arg;
+    getOutputArgs(f, escaped_stores, is_output_arg);
+
+    // Check that every value can be flattened before emitting anything.
+    int n_inputs, n_ptr_outputs;
+    if (!countScalars(call, op_size, is_output_arg, n_inputs, n_ptr_outputs,
+                      desc))
+      return false;
+    int n_outputs = countOutputs(call, n_ptr_outputs);
+    ACCEPT_LOG << "tracing " << n_inputs << " inputs and " << n_outputs
+               << " outputs\n";
+
+    LLVMContext &ctx = module->getContext();
+    Type *floatTy = Type::getFloatTy(ctx);
+    Type *handleTy = Type::getInt8PtrTy(ctx);
+    Type *intTy = Type::getInt32Ty(ctx);
+    Constant *openFunc = module->getOrInsertFunction("accept_npu_trace_open",
+        handleTy, handleTy, intTy, intTy, NULL);
+    Constant *traceFunc = module->getOrInsertFunction("accept_npu_trace",
+        Type::getVoidTy(ctx), handleTy, Type::getFloatPtrTy(ctx), NULL);
+
+    // Register the region and allocate the sample buffer on function entry.
+    Function *caller = call->getParent()->getParent();
+    BasicBlock &entry = caller->getEntryBlock();
+    IRBuilder<> builder(entry.getTerminator());
+    Value *name = builder.CreateGlobalStringPtr(f->getName(),
+                                                "npu_region_name");
+    Value *handle = builder.CreateCall3(openFunc, name,
+                                        ConstantInt::get(intTy, n_inputs),
+                                        ConstantInt::get(intTy, n_outputs),
+                                        "npu_trace_handle");
+    builder.SetInsertPoint(entry.begin());
+    Value *sample = builder.CreateAlloca(floatTy,
+        ConstantInt::get(intTy, n_inputs + n_outputs), "npu_trace_sample");
+
+    // Record the inputs before the call.
+    int pos = 0;
+    builder.SetInsertPoint(call);
+    std::vector<Value *> inputs;
+    flattenInputs(builder, call, obj_type, inputs);
+    for (unsigned int i = 0; i < inputs.size(); ++i)
+      builder.CreateStore(inputs[i],
+                          builder.CreateConstInBoundsGEP1_32(sample, pos++));
+
+    // Record the outputs after the call.
+    BasicBlock::iterator after = call;
+    ++after;
+    builder.SetInsertPoint(call->getParent(), after);
+    if (!call->getType()->isVoidTy()) {
+      builder.CreateStore(convertToFloat(builder, call,
+                              call->paramHasAttr(0, Attributes::ZExt)),
+                          builder.CreateConstInBoundsGEP1_32(sample, pos++));
+    }
     for (unsigned int i = 0; i < n; ++i) {
-      Type *type = inst->getOperandUse(i)->getType();
-      if (!type->isPointerTy())
+      if (i >= is_output_arg.size() || !is_output_arg[i])
         continue;
+      Value *out = builder.CreateLoad(call->getArgOperand(i));
+      builder.CreateStore(convertToFloat(builder, out),
+                          builder.CreateConstInBoundsGEP1_32(sample, pos++));
+    }
+    builder.CreateCall2(traceFunc, handle, sample);
 
-      if (!isa<AllocaInst>(*inst->getOperandUse(i)))
-        continue;
+    return true;
+  }
 
-      AllocaInst *allocai = dyn_cast<AllocaInst>(inst->getOperandUse(i));
-      Type *allocat = allocai->getAllocatedType();
-      if (type->isFloatingPointTy() || type->isIntegerTy())
-        op_size[i] = 1;
+  bool tryToNPU(Loop *loop, Instruction *inst, StringRef optName, LogDescription *desc) {
+    // We need a loop latch to jump to after reading oBuff
+    // and executing the instructions after the function call.
+    if (!loop->getLoopLatch() || !loop->getLoopPreheader() || !loop->getHeader()) {
+      ACCEPT_LOG << "malformed loop\n";
+      return false;
     }
 
+    if (!inst->getType()->isVoidTy() &&
+        !isMarshallableScalar(inst->getType())) {
+      ACCEPT_LOG << "call's return type is not int, void, or FP\n";
+      return false;
+    }
+
+    std::vector<Instruction*> before_insts_tobuff;
+    std::vector<Value*> st_value;
+    std::vector<Value*> st_addr;
+    std::vector<StoreInst*> st_inst;
+    if (pre_pos_call_dependency_check(inst, loop, before_insts_tobuff, st_value, st_addr, st_inst)) {
+      // std::cerr << "BOSTA" << std::endl;
+      ACCEPT_LOG << "dependency check failed\n";
+      return false;
+    }
+
+    const CallInst *c_inst = dyn_cast<CallInst>(inst);
+    Function *f = c_inst->getCalledFunction();
+
+    std::vector<StoreInst *> escaped_stores;
+    if (!getEscapedStores(f, escaped_stores, desc))
+      return false;
+
+    // The list of parameters as in the function prototype.
+    // Both in string and Value formats.
+    // TODO: Not sure if the string version is needed. If not, remove it.
+    typedef iplist<Argument> ArgumentListType;
+    std::vector<std::string> callee_args_str;
+    std::vector<Value *> callee_args_value;
+    for (ArgumentListType::iterator ai = (f->getArgumentList()).begin();
+          ai != (f->getArgumentList()).end();
+          ++ai) {
+      std::string type_str;
+      llvm::raw_string_ostream rso(type_str);
+      rso << *ai;
+      callee_args_str.push_back(rso.str());
+      callee_args_value.push_back(ai);
+    }
+
+    /*
+    AliasSetTracker *st = new AliasSetTracker(*AA);
+    for (Function::iterator bi = f->begin(); bi != f->end(); ++bi)
+      st->add(*bi);
+    //if (st->getAliasSetForPointerIfExists(inst, AA->getDataLayout()->getTypeStoreSize(callee_args_value[i]->getType()), NULL))
+    std::cerr << "alias sets dump" << std::endl;
+    for (AliasSetTracker::iterator I = st->begin(); I != st->end(); ++I) {
+      AliasSet &AS = *I;
+      std::cerr << "=============== one more set" << std::endl;
+      AS.dump();
+    }
+    delete st;
+    */
+
+    // Number of inputs passed to the function call.
+    // It looks like the code of the function itself is the last element.
+    unsigned int n = inst->getNumOperands() - 1;
+
+    // For pointer arguments, determine first which ones will
+    // be passed as input to the NPU (see getArrayArgSizes).
+    std::vector<int> op_size;
+    getArrayArgSizes(f, n, op_size);
+
+    std::vector<Type *> obj_type;
+    resolvePointerArgs(cast<CallInst>(inst), op_size, obj_type);
 
     // The list of arguments as in the instruction that calls
     // the function.
@@ -760,16 +1212,17 @@ namespace {
       caller_args.push_back(c_inst->getArgOperand(i));
 
     std::vector<bool> is_output_arg;
-    bool has_output_arg = false;
-    for (int i = 0; i < caller_args.size(); ++i) {
-      is_output_arg.push_back(false);
-      for (int j = 0; j < escaped_stores.size(); ++j) {
-        if ((callee_args_value[i])->getName().str() == (escaped_stores[j])->getPointerOperand()->getName().str()) {
-          has_output_arg = true;
-          is_output_arg[i] = true;
-          break;
-        }
-      }
+    bool has_output_arg = getOutputArgs(f, escaped_stores, is_output_arg);
+
+    int n_inputs, n_ptr_outputs;
+    if (!countScalars(cast<CallInst>(inst), op_size, is_output_arg,
+                      n_inputs, n_ptr_outputs, desc))
+      return false;
+    std::vector<Type *> output_arg_types;
+    for (unsigned int i = 0; i < n; ++i) {
+      if (is_output_arg[i])
+        output_arg_types.push_back(cast<PointerType>(
+            inst->getOperandUse(i)->getType())->getElementType());
     }
 
     int first_output_arg, last_output_arg = -1;
@@ -790,9 +1243,18 @@ namespace {
       if (is_output_arg[i])
         ++n_ptr_args;
 
-    // Success. Ready to transform.
+    // Success. Ready to transform. The software NPU also has a precision
+    // knob per region: 0 evaluates in float, 1 in int16, 2 in int8. It is
+    // only read when the region itself is enabled (the driver enables the
+    // region along with its precision site).
+    std::string precName = "npu_precision" +
+                           optName.substr(optName.find(' ')).str();
+    int param = 0;
+    int precision = 0;
     if (transformPass->relax) {
-      int param = transformPass->relaxConfig[optName];
+      param = transformPass->relaxConfig.lookup(optName);
+      if (param && optNPUHost)
+        precision = transformPass->relaxConfig.lookup(precName);
       if (param) {
         ACCEPT_LOG << "NPUifying region\n";
       } else {
@@ -801,18 +1263,34 @@ namespace {
       }
     } else {
       ACCEPT_LOG << "can NPUify region\n";
-      transformPass->relaxConfig[optName] = 0;
+      transformPass->relaxConfig.insert(optName, 0);
+      if (optNPUHost)
+        transformPass->relaxConfig.insert(precName, 0);
       return false;
     }
 
-    // Assume a constant buffer size for now.
-    int buffer_size = optNPUBufferSize;
-    ACCEPT_LOG << "with buffer size: " << optNPUBufferSize << "\n";
+    // The parameter scales the region's buffer: each step doubles the
+    // number of invocations batched per NPU call. The accelerator's
+    // buffers have a fixed capacity.
+    int buffer_size = optNPUBufferSize << (param - 1);
+    if (!optNPUHost && buffer_size > NPU_HW_BUFFER_FLOATS)
+      buffer_size = NPU_HW_BUFFER_FLOATS;
+    // Each invocation buffers all of its inputs, so the buffer holds a
+    // whole number of invocations.
+    if (n_inputs) {
+      buffer_size -= buffer_size % n_inputs;
+      if (buffer_size < n_inputs)
+        buffer_size = n_inputs;
+    }
+    ACCEPT_LOG << "with buffer size: " << buffer_size << "\n";
     unsigned int ibuff_addr = 0xFFFF0000;
     unsigned int obuff_addr = 0xFFFF8000;
     IntegerType *nativeInt = getNativeIntegerType();
     IRBuilder<> builder(module->getContext());
 
+    // The number of values exchanged with the NPU per invocation.
+    int n_outputs = countOutputs(cast<CallInst>(inst), n_ptr_outputs);
+
     // First insert all the needed allocas in the beginning of
     // the function (which is where they MUST be).
     builder.SetInsertPoint(loop->getHeader()->getParent()->getEntryBlock().begin());
@@ -885,13 +1363,70 @@ namespace {
                                                                   0,
                                                                   "npu_depsStoreInt_counter_alloca");
 
+    // The scalar slots above hold buffer cursors and counters. They are
+    // promoted to SSA values once the transformation is complete.
+    std::vector<AllocaInst*> slots;
+    slots.push_back(counterAlloca);
+    slots.push_back(iBuffAlloca);
+    slots.push_back(oBuffAlloca);
+    slots.push_back(outLoopCounterAlloca);
+    slots.push_back(iAddrCounterAlloca);
+    slots.push_back(oAddrCounterAlloca);
+    slots.push_back(depsFloatCounterAlloca);
+    slots.push_back(depsIntCounterAlloca);
+    slots.push_back(depsStoreFloatCounterAlloca);
+    slots.push_back(depsStoreIntCounterAlloca);
+
 
     // Initialize oBuff, iBuff and iBuff counter
     builder.SetInsertPoint(loop->getLoopPreheader()->getTerminator());
-    Constant *constInt = ConstantInt::get(nativeInt, ibuff_addr, false);
-    Value *constPtr = ConstantExpr::getIntToPtr(constInt,
-                                                Type::getFloatPtrTy(module->getContext()));
-    builder.CreateStore(constPtr, iBuffAlloca, true);
+    Value *iBuffBase;
+    Value *oBuffBase;
+    Value *npuHandle = NULL;
+    if (optNPUHost) {
+      // The software NPU's buffers are allocated by the runtime, one set
+      // per site since each site picks its own buffer size. The network
+      // is looked up by the name of the function it replaces.
+      LLVMContext &ctx = module->getContext();
+      Type *handleTy = Type::getInt8PtrTy(ctx);
+      Type *intTy = Type::getInt32Ty(ctx);
+      Type *floatPtrTy = Type::getFloatPtrTy(ctx);
+      Constant *openFunc = module->getOrInsertFunction("accept_npu_open",
+          handleTy, handleTy, handleTy, intTy, intTy, intTy, NULL);
+      Constant *ibuffFunc = module->getOrInsertFunction("accept_npu_ibuff",
+          floatPtrTy, handleTy, NULL);
+      Constant *obuffFunc = module->getOrInsertFunction("accept_npu_obuff",
+          floatPtrTy, handleTy, NULL);
+      Value *siteName = builder.CreateGlobalStringPtr(optName,
+                                                      "npu_site_name");
+      Value *regionName = builder.CreateGlobalStringPtr(f->getName(),
+                                                        "npu_region_name");
+      npuHandle = builder.CreateCall5(openFunc, siteName, regionName,
+                                      ConstantInt::get(intTy, n_inputs),
+                                      ConstantInt::get(intTy, n_outputs),
+                                      ConstantInt::get(intTy, buffer_size),
+                                      "npu_handle");
+      iBuffBase = builder.CreateCall(ibuffFunc, npuHandle, "npu_ibuff_base");
+      oBuffBase = builder.CreateCall(obuffFunc, npuHandle, "npu_obuff_base");
+
+      if (precision) {
+        ACCEPT_LOG << "with precision: "
+                   << (precision == 1 ? "int16" : "int8") << "\n";
+        Constant *precFunc = module->getOrInsertFunction(
+            "accept_npu_set_precision", Type::getVoidTy(ctx), handleTy,
+            intTy, NULL);
+        builder.CreateCall2(precFunc, npuHandle,
+                            ConstantInt::get(intTy, precision));
+      }
+    } else {
+      iBuffBase = ConstantExpr::getIntToPtr(
+          ConstantInt::get(nativeInt, ibuff_addr, false),
+          Type::getFloatPtrTy(module->getContext()));
+      oBuffBase = ConstantExpr::getIntToPtr(
+          ConstantInt::get(nativeInt, obuff_addr, false),
+          Type::getFloatPtrTy(module->getContext()));
+    }
+    builder.CreateStore(iBuffBase, iBuffAlloca);
     builder.CreateStore(ConstantInt::get(nativeInt, 0, false), counterAlloca);
     builder.CreateStore(ConstantInt::get(nativeInt, 0, false), depsFloatCounterAlloca);
     builder.CreateStore(ConstantInt::get(nativeInt, 0, false), depsIntCounterAlloca);
@@ -910,146 +1445,67 @@ namespace {
     Value *iAddrChainCounter;
     Value *iAddrChainPosition;
 
-    int first_input_arg, last_input_arg = -1;
-    for (int i = 0; i < op_size.size(); ++i) {
-      Type *type = inst->getOperandUse(i)->getType();
-      if (!type->isPointerTy() || op_size[i]) {
-        first_input_arg = i;
-        break;
-      }
-    }
-    for (int i = (op_size.size() - 1); i >= 0; --i) {
-      Type *type = inst->getOperandUse(i)->getType();
-      if (!type->isPointerTy() || op_size[i]) {
-        last_input_arg = i;
-        break;
-      }
-    }
-
-    // The input buffer is always an array of floats. So, any input that is not a float
-    // must be converted.
-    int total_buffered = 0;
+    // Remember the addresses of the output arguments so the outputs can be
+    // written back after the NPU is invoked.
+    Type *floatPtrTy = Type::getFloatPtrTy(module->getContext());
     for (unsigned int i = 0; i < n; ++i) {
-      std::vector<Value*> mloads;
-      std::string s = makestr("npu_conv_", i);
-      Type *type = inst->getOperandUse(i)->getType();
-
-      // Get the next argument and convert it if it's not float.
-      v = inst->getOperandUse(i);
-            std::string type_str;
-            llvm::raw_string_ostream rso(type_str);
-            Instruction *bla = (Instruction*)v;
-            rso << "onev: " << *bla << "\n";
-      if (type->isIntegerTy()) {
-        IntegerType *it = static_cast<IntegerType *>(type);
-        if (it->getSignBit())
-          v = builder.CreateSIToFP(v, Type::getFloatTy(module->getContext()), s.c_str());
-        else
-          v = builder.CreateUIToFP(v, Type::getFloatTy(module->getContext()), s.c_str());
-      } else if (type->isDoubleTy()) {
-        v = builder.CreateFPTrunc(v, Type::getFloatTy(module->getContext()), s.c_str());
-      } else if (type->isPointerTy()) {
-        // TODO: Didn't find a way to discover the type of the pointer.
-        // If this is possible, convert the value loaded below.
-        if (!is_matrix[i]) {
-          v = builder.CreateLoad(v);
-        } else {
-          for (int k = 0; k < mdim1[i]; ++k) {
-            Value *GEP1 = builder.CreateInBoundsGEP(v,
-                                                   ConstantInt::get(nativeInt, k, true),
-                                                    "geprow");
-            rso << "geprow: " << *GEP1 << "\n";
-            for (int p = 0; p < mdim2[i]; ++p) {
-              Value *tmp[2];
-              tmp[0] = ConstantInt::get(nativeInt, 0, true);
-              tmp[1] = ConstantInt::get(nativeInt, p, true);
-              ArrayRef<Value*> ar(tmp, 2);
-              Value *GEP2 = builder.CreateInBoundsGEP(GEP1,
-                                                      ar,
-                                                      "gepcol");
-            rso << "gepcol: " << *GEP2 << "\n";
-              mloads.push_back(builder.CreateLoad(GEP2));
-            rso << "ld: " << *mloads.back() << "\n";
-            }
-          }
-        }
-        /*
-            Instruction *bla2 = (Instruction*)v;
-            rso << "twov: " << *bla2 << "\n";
-            std::cerr << rso.str() << std::endl;
-            v->getType()->dump();
-            */
-      }
-
-      // Only once (when i == 0) load iBuffAlloca
-      // TODO: maybe this can be optimized. We already know the initial address
-      // of iBuff and oBuff so we can just use a constant as the initial value
-      // and go from there. At this point register allocation hasn't been
-      // performed yet, so we have to load/store everything though.
-      if (i == first_input_arg)
-        load = builder.CreateLoad(iBuffAlloca, true, "npu_load_ibuff");
+      if (!is_output_arg[i])
+        continue;
       if (i == first_output_arg)
         iAddrChainCounter = builder.CreateLoad(iAddrCounterAlloca, false, "npu_load_iAddrC");
 
-      if (is_output_arg[i]) {
-        s = makestr("npu_iAddrGEP_", i);
-        iAddrChainPosition = builder.CreateInBoundsGEP(addrBuffAlloca,
-                                                      iAddrChainCounter,
-                                                      s.c_str());
-        builder.CreateStore(inst->getOperandUse(i), iAddrChainPosition);
-        s = makestr("npu_iAddrCounter_add_", i);
-        iAddrChainCounter = builder.CreateAdd(iAddrChainCounter,
-                                              ConstantInt::get(nativeInt, 1, false),
-                                              s.c_str());
-      }
-
-      Value *GEP;
-      if (!type->isPointerTy() || op_size[i]) {
-        int n_to_buff = (type->isPointerTy()) ? op_size[i] : 1;
-
-        for (int j = 0; j < n_to_buff; ++j) {
-          // Now that the input has been converted and iBuff has been loaded, get
-          // the address of the next iBuff element.
-          s = makestr("npu_iBuffGEP_", i);
-          // is the 1 signed? (the true parameter)
-          GEP = builder.CreateInBoundsGEP(load,
-                                          ConstantInt::get(nativeInt, 1, true),
-                                          s.c_str());
-
-          // Store the (converted) input in the current iBuff position.
-          if (!is_matrix[i])
-            builder.CreateStore(v, load); //is this store volatile?
-          else
-            builder.CreateStore(mloads[j], load);
-
-          // The next iBuff element to be written is the result of the
-          // GEP instruction above.
-          load = GEP;
-
-          if (!is_matrix[i] && (j != n_to_buff - 1)) {
-            s = makestr("npu_auxGEP_", j+1);
-            Value *auxGEP = builder.CreateInBoundsGEP(inst->getOperandUse(i),
-                                                      ConstantInt::get(nativeInt, j+1),
-                                                      s.c_str());
-            v = builder.CreateLoad(auxGEP);
-          }
-        }
-
-
-        total_buffered += n_to_buff;
-      }
-
-      if (!total_buffered) {
-          errs() << "NOTHING WAS BUFFERED!\n";
-      }
-
-      // After storing the last input, store the final address of iBuff.
-      if (i == last_input_arg)
-        builder.CreateStore(GEP, iBuffAlloca, true);
+      std::string name = makestr("npu_iAddrGEP_", i);
+      iAddrChainPosition = builder.CreateInBoundsGEP(addrBuffAlloca,
+                                                     iAddrChainCounter,
+                                                     name.c_str());
+      builder.CreateStore(builder.CreateBitCast(inst->getOperandUse(i),
+                                                floatPtrTy),
+                          iAddrChainPosition);
+      name = makestr("npu_iAddrCounter_add_", i);
+      iAddrChainCounter = builder.CreateAdd(iAddrChainCounter,
+                                            ConstantInt::get(nativeInt, 1, false),
+                                            name.c_str());
       if (i == last_output_arg)
         builder.CreateStore(iAddrChainCounter, iAddrCounterAlloca);
     }
 
+    // The input buffer is always an array of floats, so the inputs are
+    // flattened and converted (see flattenInputs).
+    std::vector<Value *> inputs;
+    flattenInputs(builder, cast<CallInst>(inst), obj_type, inputs);
+    int total_buffered = inputs.size();
+    if (!total_buffered)
+      errs() << "NOTHING WAS BUFFERED!\n";
+
+    load = builder.CreateLoad(iBuffAlloca, "npu_load_ibuff");
+    unsigned int k = 0;
+    if (optNPUHost) {
+      // The software NPU's buffer is ordinary memory, so it is filled four
+      // floats at a time.
+      Type *floatTy = Type::getFloatTy(module->getContext());
+      VectorType *vecTy = VectorType::get(floatTy, 4);
+      for (; k + 4 <= inputs.size(); k += 4) {
+        Value *vec = UndefValue::get(vecTy);
+        for (unsigned int l = 0; l < 4; ++l)
+          vec = builder.CreateInsertElement(vec, inputs[k + l],
+                                            builder.getInt32(l));
+        Value *addr = builder.CreateConstInBoundsGEP1_32(load, k,
+                                                         "npu_iBuffGEP");
+        addr = builder.CreateBitCast(addr, vecTy->getPointerTo());
+        builder.CreateAlignedStore(vec, addr, 4);
+      }
+    }
+    for (; k < inputs.size(); ++k) {
+      Value *addr = builder.CreateConstInBoundsGEP1_32(load, k,
+                                                       "npu_iBuffGEP");
+      builder.CreateStore(inputs[k], addr, !optNPUHost);
+    }
+
+    // Store the next free address of iBuff.
+    builder.CreateStore(
+        builder.CreateConstInBoundsGEP1_32(load, total_buffered, "npu_iBuffGEP"),
+        iBuffAlloca);
+
     // Buffer loop dependencies
 #if BUFFER_LOOP_DEPS == 1
     int dsize = before_insts_tobuff.size();
@@ -1158,9 +1614,8 @@ namespace {
     BasicBlock *after_callBB_tmp = *((AI->successorsOf(inst->getParent())).begin());
 
     // If we buffered any input (n != 0) we have to check whether
-    // the buffer is not full yet.
-    // TODO: for now we're assuming the buffer size is a multiple of
-    // the number of inputs.
+    // the buffer is not full yet. The buffer size is a multiple of the
+    // number of inputs, but the check does not rely on it.
     // Since we have to check the iBuff counter at the end, we have to
     // split the current basic block. It's always safe to do so because
     // we have already buffered something (so there're instructions
@@ -1203,13 +1658,13 @@ namespace {
       builder.CreateStore(v, counterAlloca);
 
       // Compare the new value of the induction variable to the buffer size.
-      v = builder.CreateICmpEQ(v,
+      v = builder.CreateICmpUGE(v,
                                 ConstantInt::get(nativeInt,
                                                   buffer_size,
                                                   false),
                                 "npu_icmp_iBuffSize");
 
-      // If they're the same, the buffer is full and we jump to
+      // If it has been reached, the buffer is full and we jump to
       // the call block. Otherwise, jump to the loop latch to buffer
       // more inputs.
       builder.CreateCondBr(v, callBB, loop->getLoopLatch());
@@ -1274,10 +1729,7 @@ namespace {
     // execute remaining code.
     builder.SetInsertPoint(callBB->getTerminator());
 
-    Constant *constInt2 = ConstantInt::get(nativeInt, obuff_addr, false);
-    Value *constPtr2 = ConstantExpr::getIntToPtr(constInt2,
-                                             Type::getFloatPtrTy(module->getContext()));
-    builder.CreateStore(constPtr2, oBuffAlloca, true);
+    builder.CreateStore(oBuffBase, oBuffAlloca);
 
     // Initialize "oBuff read" loop induction variable
     builder.CreateStore(
@@ -1320,6 +1772,17 @@ namespace {
     ibuff_used = builder.CreateUDiv(ibuff_used,
         ConstantInt::get(nativeInt, total_buffered, false));
 
+    // The software NPU evaluates the whole batch of buffered invocations
+    // at once, filling oBuff before it is read below. When pipelined, the
+    // call only starts the evaluation and each output is waited for
+    // before it is read.
+    if (optNPUHost) {
+      Constant *invokeFunc = module->getOrInsertFunction(
+          optNPUPipeline ? "accept_npu_invoke_async" : "accept_npu_invoke",
+          Type::getVoidTy(module->getContext()), npuHandle->getType(),
+          nativeInt, NULL);
+      builder.CreateCall2(invokeFunc, npuHandle, ibuff_used);
+    }
 
     // Reset "iBuff read counter" for the next time.
     // Also reset iBuff itself.
@@ -1327,10 +1790,7 @@ namespace {
         ConstantInt::get(nativeInt, 0, false),
         counterAlloca
     );
-    constInt = ConstantInt::get(nativeInt, ibuff_addr, false);
-    constPtr = ConstantExpr::getIntToPtr(constInt,
-                                         Type::getFloatPtrTy(module->getContext()));
-    builder.CreateStore(constPtr, iBuffAlloca, true);
+    builder.CreateStore(iBuffBase, iBuffAlloca);
 
     // Now we move to the block after the call BB (probably split
     // from it) to start reading the oBuff.
@@ -1343,11 +1803,20 @@ namespace {
     else
       builder.SetInsertPoint(after_callBB->begin());
 
+    if (optNPUHost && optNPUPipeline) {
+      Constant *waitFunc = module->getOrInsertFunction("accept_npu_wait",
+          Type::getVoidTy(module->getContext()), npuHandle->getType(),
+          nativeInt, NULL);
+      Value *outIndex = builder.CreateLoad(outLoopCounterAlloca,
+                                           "npu_out_index");
+      builder.CreateCall2(waitFunc, npuHandle, outIndex);
+    }
+
     Value *oAddrChainCounter;
     Value *oAddrChainPosition;
     int ptr_args_i = 0;
     // Now we read all the output values generated by *one* call
-    // For each output (escaped_stores) we:
+    // For each output (output argument) we:
     //
     // Alternatively, we can see whether anyone depends on inst
 
@@ -1393,27 +1862,27 @@ namespace {
     Value *retVal;
     if (f->getReturnType()->isIntegerTy() || f->getReturnType()->isFloatingPointTy()) {
       gotRetVal = true;
-      load = builder.CreateLoad(oBuffAlloca, true, "npu_load_obuff");
+      load = builder.CreateLoad(oBuffAlloca, "npu_load_obuff");
       Value *GEP;
       std::string s1 = "npu_gepRetVal_oBuff";
       std::string s2 = "npu_loadRetVal_oBuffResult";
       GEP = builder.CreateInBoundsGEP(load,
                                       ConstantInt::get(nativeInt, 1, true),
                                       s1.c_str());
-      retVal = builder.CreateLoad(load, s2.c_str());
-      if (!escaped_stores.size())
-        builder.CreateStore(GEP, oBuffAlloca, true);
+      retVal = builder.CreateLoad(load, !optNPUHost, s2.c_str());
+      if (!n_ptr_args)
+        builder.CreateStore(GEP, oBuffAlloca);
 
       load = GEP;
     }
-    // std::cerr << "brah " << gotRetVal << "\t" << escaped_stores.size() << std::endl;
-    for (int i = 0; i < escaped_stores.size(); ++i) {
+    // Then one output per output argument (see countOutputs).
+    for (int i = 0; i < n_ptr_args; ++i) {
       // First we store the function arguments.
       // For now we only consider escaped stores to function arguments.
       // TODO: remove this restriction.
       if (i == 0 && !gotRetVal)
         // Load the oBuff pointer.
-        load = builder.CreateLoad(oBuffAlloca, true, "npu_load_obuff");
+        load = builder.CreateLoad(oBuffAlloca, "npu_load_obuff");
       if (i == 0 && n_ptr_args)
         oAddrChainCounter = builder.CreateLoad(oAddrCounterAlloca, false, "npu_load_oAddrC");
 
@@ -1426,15 +1895,19 @@ namespace {
                                       s1.c_str());
 
       // Then, read the oBuff value
-      Value *v = builder.CreateLoad(load, s2.c_str());
+      Value *v = builder.CreateLoad(load, !optNPUHost, s2.c_str());
 
       if (ptr_args_i < n_ptr_args) {
         std::string s3 = makestr("npu_oAddrGEP_", ptr_args_i);
         oAddrChainPosition = builder.CreateInBoundsGEP(addrBuffAlloca,
                                                         oAddrChainCounter,
                                                         s3.c_str());
+        Type *outTy = output_arg_types[ptr_args_i];
         Value *addr_buffer_value = builder.CreateLoad(oAddrChainPosition);
-        builder.CreateStore(v, addr_buffer_value, false);
+        addr_buffer_value = builder.CreateBitCast(addr_buffer_value,
+                                                  outTy->getPointerTo());
+        builder.CreateStore(convertFromFloat(builder, v, outTy),
+                            addr_buffer_value, false);
         s3 = makestr("npu_oAddrCounter_add_", ptr_args_i);
         oAddrChainCounter = builder.CreateAdd(oAddrChainCounter,
                                               ConstantInt::get(nativeInt, 1, false),
@@ -1442,8 +1915,8 @@ namespace {
         ++ptr_args_i;
       }
 
-      if (i == (escaped_stores.size() - 1)) {
-        builder.CreateStore(GEP, oBuffAlloca, true);
+      if (i == (n_ptr_args - 1)) {
+        builder.CreateStore(GEP, oBuffAlloca);
         if (n_ptr_args)
           builder.CreateStore(oAddrChainCounter, oAddrCounterAlloca);
       }
@@ -1455,13 +1928,8 @@ namespace {
 
     // Replace all the uses of inst (the call) by retVal
     if (gotRetVal) {
-      if (inst->getType()->isIntegerTy()) {
-        IntegerType *it = static_cast<IntegerType *>(inst->getType());
-        if (it->getSignBit())
-          retVal = builder.CreateFPToSI(retVal, nativeInt, "npu_conv_retval");
-        else
-          retVal = builder.CreateFPToUI(retVal, nativeInt, "npu_conv_retval");
-      }
+      retVal = convertFromFloat(builder, retVal, inst->getType(),
+          cast<CallInst>(inst)->paramHasAttr(0, Attributes::ZExt));
       inst->replaceAllUsesWith(retVal);
     }
 
@@ -1657,6 +2125,13 @@ namespace {
 
     loop->addBasicBlockToLoop(checkBB, LI->getBase());
 
+    if (optNPUHost) {
+      // The runtime call was already inserted after the buffer fill check.
+      inst->eraseFromParent();
+      promoteSlots(loop->getHeader()->getParent(), slots);
+      return true;
+    }
+
     builder.SetInsertPoint(inst);
 
     InlineAsm *asm1 = InlineAsm::get(FunctionType::get(builder.getVoidTy(), false),
@@ -1681,9 +2156,27 @@ namespace {
     builder.CreateCall(asm4);
 
     inst->eraseFromParent();
+    promoteSlots(loop->getHeader()->getParent(), slots);
     return true;
   }
 
+  // Rewrite the NPU interface's bookkeeping slots as SSA values. The
+  // transformation split and created blocks, so the dominator trees are
+  // recomputed first (they are also used for later candidates).
+  void promoteSlots(Function *F, const std::vector<AllocaInst*> &slots) {
+    DT->runOnFunction(*F);
+    PDT->runOnFunction(*F);
+
+    std::vector<AllocaInst*> promotable;
+    for (std::vector<AllocaInst*>::const_iterator i = slots.begin();
+         i != slots.end(); ++i) {
+      if (isAllocaPromotable(*i))
+        promotable.push_back(*i);
+    }
+    if (!promotable.empty())
+      PromoteMemToReg(promotable, *DT);
+  }
+
 };
 }
 /*
@@ -0,0 +1,677 @@
+#include "llvm/Function.h"
+#include "llvm/Module.h"
+#include "llvm/Constants.h"
+#include "llvm/DerivedTypes.h"
+#include "llvm/InlineAsm.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Support/CFG.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// Loop parallelization. A counted loop whose body affects only approximate
+// data (the same condition as for perforation) is run across a pool of
+// threads: any dependence between iterations flows through approximate
+// memory, so reordering the iterations or letting them race only affects
+// approximate results. The body is outlined into a function taking the
+// iteration number and an environment of the values it uses from the
+// enclosing function, and the loop is replaced by a call to the runtime's
+// accept_parallel_for. Local variables used only in the body, and written
+// before they are read in each iteration, are private to each iteration.
+// The site parameter p runs the loop on p + 1 threads.
+//
+// The loop must be in the shape Clang produces for a "for" statement:
+// the header compares a local induction variable with a loop-invariant
+// bound, the latch increments the variable by one, and the body leaves
+// only through the latch.
+
+namespace {
+  const int PARALLEL_MAX_LEVEL = 7;
+
+  // A loop that has been checked for parallelization.
+  struct ParallelLoop {
+    BasicBlock *bodyEntry;
+    BasicBlock *exit;
+    std::set<BasicBlock*> body;
+    AllocaInst *iv;
+    Value *ivOperand;  // The comparison operand computed from iv.
+    Value *bound;      // The other operand.
+    bool isSigned;
+    bool inclusive;
+    std::vector<AllocaInst*> privates;
+    std::vector<Value*> shared;
+
+    ParallelLoop() : bodyEntry(NULL), exit(NULL), iv(NULL), ivOperand(NULL),
+                     bound(NULL), isSigned(true), inclusive(false) {}
+  };
+
+  // Strip the integer casts Clang puts around a loaded induction variable.
+  Value *stripIntCasts(Value *v) {
+    while (CastInst *cast = dyn_cast<CastInst>(v)) {
+      if (!cast->isIntegerCast())
+        break;
+      v = cast->getOperand(0);
+    }
+    return v;
+  }
+
+  // Whether every iteration stores to a local variable before reading it:
+  // the first access to it in the body's entry block stores to the whole
+  // variable. Otherwise a value may flow from one iteration to the next.
+  bool storedBeforeLoaded(AllocaInst *alloca, BasicBlock *entry) {
+    for (BasicBlock::iterator ii = entry->begin(); ii != entry->end(); ++ii) {
+      StoreInst *store = dyn_cast<StoreInst>(ii);
+      if (store && store->getPointerOperand() == alloca)
+        return store->getValueOperand() != alloca;
+      for (User::op_iterator oi = ii->op_begin(); oi != ii->op_end(); ++oi)
+        if (*oi == alloca)
+          return false;
+    }
+    return false;
+  }
+
+  // Whether a pointer is a local or global variable itself (not derived
+  // from one).
+  bool isVariable(Value *ptr) {
+    return isa<AllocaInst>(ptr) || isa<GlobalVariable>(ptr);
+  }
+}
+
+struct LoopParallel : public FunctionPass {
+  static char ID;
+  ACCEPTPass *transformPass;
+  ApproxInfo *AI;
+  Module *module;
+  LoopInfo *LI;
+
+  LoopParallel();
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual const char *getPassName() const;
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+  virtual bool runOnFunction(llvm::Function &F);
+
+  bool visitLoop(Loop *loop);
+  bool tryToParallelize(Loop *loop);
+  bool checkLoop(Loop *loop, ParallelLoop &pl, LogDescription *desc);
+  bool checkCondition(Loop *loop, ParallelLoop &pl, LogDescription *desc);
+  bool checkLatch(Loop *loop, ParallelLoop &pl, LogDescription *desc);
+  bool isInvariant(Loop *loop, Value *v);
+  Value *recompute(IRBuilder<> &builder, Loop *loop, Value *v);
+  Function *outlineBody(Loop *loop, ParallelLoop &pl, StructType *envTy);
+  void parallelize(Loop *loop, ParallelLoop &pl, int threads);
+};
+
+void LoopParallel::getAnalysisUsage(AnalysisUsage &AU) const {
+  FunctionPass::getAnalysisUsage(AU);
+  AU.addRequired<LoopInfo>();
+}
+
+LoopParallel::LoopParallel() : FunctionPass(ID) {
+  initializeLoopParallelPass(*PassRegistry::getPassRegistry());
+  module = 0;
+}
+
+const char *LoopParallel::getPassName() const {
+  return "ACCEPT loop parallelization";
+}
+
+bool LoopParallel::doInitialization(Module &M) {
+  module = &M;
+  transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
+  return false;
+}
+
+bool LoopParallel::doFinalization(Module &M) {
+  return false;
+}
+
+bool LoopParallel::runOnFunction(Function &F) {
+  AI = transformPass->AI;
+  LI = &getAnalysis<LoopInfo>();
+
+  // Skip optimizing functions that seem to be in standard libraries.
+  if (transformPass->shouldSkipFunc(F))
+    return false;
+
+  std::vector<Loop*> loops(LI->begin(), LI->end());
+  bool modified = false;
+  for (std::vector<Loop*>::iterator li = loops.begin(); li != loops.end();
+       ++li)
+    modified |= visitLoop(*li);
+  return modified;
+}
+
+// Try a loop and, unless it is parallelized, the loops nested in it.
+bool LoopParallel::visitLoop(Loop *loop) {
+  if (tryToParallelize(loop))
+    return true;
+  std::vector<Loop*> subLoops(loop->begin(), loop->end());
+  bool modified = false;
+  for (std::vector<Loop*>::iterator li = subLoops.begin();
+       li != subLoops.end(); ++li)
+    modified |= visitLoop(*li);
+  return modified;
+}
+
+bool LoopParallel::tryToParallelize(Loop *loop) {
+  Instruction *loopStart = loop->getHeader()->begin();
+  std::string optName = transformPass->siteName("parallel loop", loopStart);
+  LogDescription *desc = AI->logAdd("Parallel loop", loopStart);
+  ACCEPT_LOG << optName << "\n";
+
+  ParallelLoop pl;
+  if (!checkLoop(loop, pl, desc)) {
+    ACCEPT_LOG << "cannot parallelize loop\n";
+    return false;
+  }
+
+  if (transformPass->relax) {
+    int param = transformPass->relaxConfig.lookup(optName);
+    if (param) {
+      if (param > PARALLEL_MAX_LEVEL)
+        param = PARALLEL_MAX_LEVEL;
+      ACCEPT_LOG << "parallelizing on " << (param + 1) << " threads\n";
+      parallelize(loop, pl, param + 1);
+      return true;
+    } else {
+      ACCEPT_LOG << "not parallelizing\n";
+    }
+  } else {
+    ACCEPT_LOG << "can parallelize loop\n";
+    transformPass->relaxConfig.insert(optName, 0);
+  }
+  return false;
+}
+
+// Check the loop's shape and collect what the transformation needs.
+bool LoopParallel::checkLoop(Loop *loop, ParallelLoop &pl,
+                             LogDescription *desc) {
+  BasicBlock *header = loop->getHeader();
+  BasicBlock *latch = loop->getLoopLatch();
+
+  if (AI->instMarker(header->begin()) == markerForbid) {
+    ACCEPT_LOG << "optimization forbidden\n";
+    return false;
+  }
+  if (!latch || !loop->getLoopPreheader() || !loop->getExitBlock() ||
+      loop->getExitingBlock() != header || latch == header) {
+    ACCEPT_LOG << "loop not in canonical form\n";
+    return false;
+  }
+  if (header->getName().startswith("arrayctor.loop")) {
+    ACCEPT_LOG << "array constructor\n";
+    return false;
+  }
+  pl.exit = loop->getExitBlock();
+  if (isa<PHINode>(pl.exit->begin())) {
+    ACCEPT_LOG << "loop exit has phis\n";
+    return false;
+  }
+
+  if (!checkCondition(loop, pl, desc) || !checkLatch(loop, pl, desc))
+    return false;
+
+  // The body: everything but the header and latch. It may leave only
+  // through the latch.
+  for (Loop::block_iterator bi = loop->block_begin();
+       bi != loop->block_end(); ++bi) {
+    if (*bi != header && *bi != latch)
+      pl.body.insert(*bi);
+  }
+  if (pl.body.empty() || pl.bodyEntry == latch) {
+    ACCEPT_LOG << "empty body\n";
+    return false;
+  }
+  if (isa<PHINode>(pl.bodyEntry->begin())) {
+    ACCEPT_LOG << "loop body has phis\n";
+    return false;
+  }
+  for (std::set<BasicBlock*>::iterator bi = pl.body.begin();
+       bi != pl.body.end(); ++bi) {
+    TerminatorInst *term = (*bi)->getTerminator();
+    for (unsigned i = 0; i < term->getNumSuccessors(); ++i) {
+      BasicBlock *succ = term->getSuccessor(i);
+      if (succ != latch && !pl.body.count(succ)) {
+        ACCEPT_LOG << "contains loop exit\n";
+        return false;
+      }
+    }
+  }
+
+  // Values computed in the loop may not be used after it (the loop is
+  // deleted).
+  for (Loop::block_iterator bi = loop->block_begin();
+       bi != loop->block_end(); ++bi) {
+    for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end(); ++ii) {
+      for (Value::use_iterator ui = ii->use_begin(); ui != ii->use_end();
+           ++ui) {
+        Instruction *user = dyn_cast<Instruction>(*ui);
+        if (user && !loop->contains(user->getParent())) {
+          ACCEPT_LOG << "value used after loop\n";
+          return false;
+        }
+      }
+    }
+  }
+
+  // Each iteration reads the induction variable but may not change it.
+  for (Value::use_iterator ui = pl.iv->use_begin(); ui != pl.iv->use_end();
+       ++ui) {
+    Instruction *user = dyn_cast<Instruction>(*ui);
+    if (user && pl.body.count(user->getParent()) && !(isa<LoadInst>(user) &&
+        !cast<LoadInst>(user)->isVolatile())) {
+      ACCEPT_LOG << "induction variable modified in body\n";
+      return false;
+    }
+  }
+
+  // The body may only affect approximate data.
+  std::set<Instruction*> blockers = AI->preciseEscapeCheck(pl.body);
+  for (std::set<Instruction*>::iterator i = blockers.begin();
+       i != blockers.end(); ++i) {
+    ACCEPT_LOG << *i;
+  }
+  if (!blockers.empty())
+    return false;
+
+  // Sort the values the body uses from outside into private variables and
+  // shared values passed in the environment.
+  std::set<Value*> seen;
+  for (Function::iterator bi = header->getParent()->begin();
+       bi != header->getParent()->end(); ++bi) {
+    BasicBlock *block = bi;
+    if (!pl.body.count(block))
+      continue;
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      if (isa<DbgInfoIntrinsic>(ii))
+        continue;
+      for (User::op_iterator oi = ii->op_begin(); oi != ii->op_end(); ++oi) {
+        Value *op = *oi;
+        if (isa<Constant>(op) || isa<BasicBlock>(op) || isa<InlineAsm>(op) ||
+            isa<MDNode>(op) || op == pl.iv || seen.count(op))
+          continue;
+        Instruction *opInst = dyn_cast<Instruction>(op);
+        if (opInst && pl.body.count(opInst->getParent()))
+          continue;
+        seen.insert(op);
+
+        if (opInst && loop->contains(opInst->getParent())) {
+          ACCEPT_LOG << "body uses a value from the loop header\n";
+          return false;
+        }
+
+        // A local variable used only in the body, and written by each
+        // iteration before it is read, is private to each iteration.
+        AllocaInst *alloca = dyn_cast<AllocaInst>(op);
+        bool priv = alloca && isa<Constant>(alloca->getArraySize()) &&
+                    storedBeforeLoaded(alloca, pl.bodyEntry);
+        if (priv) {
+          for (Value::use_iterator ui = alloca->use_begin();
+               ui != alloca->use_end(); ++ui) {
+            Instruction *user = dyn_cast<Instruction>(*ui);
+            if (!user || !pl.body.count(user->getParent())) {
+              priv = false;
+              break;
+            }
+          }
+        }
+        if (priv)
+          pl.privates.push_back(alloca);
+        else
+          pl.shared.push_back(op);
+      }
+    }
+  }
+
+  ACCEPT_LOG << pl.privates.size() << " private and " << pl.shared.size()
+             << " shared values\n";
+  return true;
+}
+
+// The header must only test the induction variable against an invariant
+// bound.
+bool LoopParallel::checkCondition(Loop *loop, ParallelLoop &pl,
+                                  LogDescription *desc) {
+  BasicBlock *header = loop->getHeader();
+  BranchInst *br = dyn_cast<BranchInst>(header->getTerminator());
+  ICmpInst *cmp = br && br->isConditional() ?
+      dyn_cast<ICmpInst>(br->getCondition()) : NULL;
+  if (!cmp || cmp->getParent() != header) {
+    ACCEPT_LOG << "loop condition is not a comparison\n";
+    return false;
+  }
+  if (br->getSuccessor(0) == pl.exit)
+    pl.bodyEntry = br->getSuccessor(1);
+  else if (br->getSuccessor(1) == pl.exit)
+    pl.bodyEntry = br->getSuccessor(0);
+  if (!pl.bodyEntry || pl.bodyEntry == pl.exit) {
+    ACCEPT_LOG << "loop condition does not exit\n";
+    return false;
+  }
+
+  // Find the induction variable: a local integer loaded in the header.
+  CmpInst::Predicate pred = cmp->getPredicate();
+  for (unsigned i = 0; i < 2 && !pl.iv; ++i) {
+    LoadInst *load = dyn_cast<LoadInst>(stripIntCasts(cmp->getOperand(i)));
+    if (load && load->getParent() == header && !load->isVolatile() &&
+        isa<AllocaInst>(load->getPointerOperand()) &&
+        load->getType()->isIntegerTy()) {
+      pl.iv = cast<AllocaInst>(load->getPointerOperand());
+      pl.ivOperand = cmp->getOperand(i);
+      pl.bound = cmp->getOperand(1 - i);
+      if (i == 1)
+        pred = CmpInst::getSwappedPredicate(pred);
+    }
+  }
+  if (!pl.iv || !isInvariant(loop, pl.bound)) {
+    ACCEPT_LOG << "no induction variable with an invariant bound\n";
+    return false;
+  }
+  if (br->getSuccessor(0) == pl.exit)
+    pred = CmpInst::getInversePredicate(pred);
+  switch (pred) {
+  case CmpInst::ICMP_SLT: case CmpInst::ICMP_NE:
+    break;
+  case CmpInst::ICMP_ULT:
+    pl.isSigned = false;
+    break;
+  case CmpInst::ICMP_SLE:
+    pl.inclusive = true;
+    break;
+  case CmpInst::ICMP_ULE:
+    pl.isSigned = false;
+    pl.inclusive = true;
+    break;
+  default:
+    ACCEPT_LOG << "unsupported loop condition\n";
+    return false;
+  }
+  unsigned width = cmp->getOperand(0)->getType()->getIntegerBitWidth();
+  if (width > 64) {
+    ACCEPT_LOG << "induction variable too wide\n";
+    return false;
+  }
+
+  // The runtime counts in signed 64-bit integers, which narrower values
+  // (and an inclusive bound plus one) fit in after extension. At 64 bits,
+  // unsigned values may not fit, and an inclusive bound must be a constant
+  // that can be incremented.
+  if (width == 64 && !pl.isSigned) {
+    ACCEPT_LOG << "unsigned 64-bit induction variable\n";
+    return false;
+  }
+  if (width == 64 && pl.inclusive) {
+    ConstantInt *c = dyn_cast<ConstantInt>(pl.bound);
+    if (!c || c->isMaxValue(true)) {
+      ACCEPT_LOG << "inclusive bound may overflow\n";
+      return false;
+    }
+  }
+
+  // Nothing else may happen in the header.
+  std::set<Value*> condValues;
+  condValues.insert(br);
+  condValues.insert(cmp);
+  for (Value *v = pl.ivOperand; ; v = cast<Instruction>(v)->getOperand(0)) {
+    condValues.insert(v);
+    if (isa<LoadInst>(v))
+      break;
+  }
+  for (Value *v = pl.bound; isa<Instruction>(v) &&
+       loop->contains(cast<Instruction>(v)->getParent());
+       v = cast<Instruction>(v)->getOperand(0)) {
+    condValues.insert(v);
+    if (isa<LoadInst>(v))
+      break;
+  }
+  for (BasicBlock::iterator ii = header->begin(); ii != header->end(); ++ii) {
+    if (!condValues.count(ii) && !isa<DbgInfoIntrinsic>(ii)) {
+      ACCEPT_LOG << "loop header does more than test the condition\n";
+      return false;
+    }
+  }
+  return true;
+}
+
+// The latch must only increment the induction variable.
+bool LoopParallel::checkLatch(Loop *loop, ParallelLoop &pl,
+                              LogDescription *desc) {
+  BasicBlock *latch = loop->getLoopLatch();
+  LoadInst *load = NULL;
+  BinaryOperator *inc = NULL;
+  StoreInst *store = NULL;
+  bool simple = true;
+  for (BasicBlock::iterator ii = latch->begin(); ii != latch->end() && simple;
+       ++ii) {
+    if (isa<DbgInfoIntrinsic>(ii) || isa<BranchInst>(ii)) {
+      continue;
+    } else if (!load && isa<LoadInst>(ii)) {
+      load = cast<LoadInst>(ii);
+      simple = load->getPointerOperand() == pl.iv;
+    } else if (!inc && load && isa<BinaryOperator>(ii)) {
+      inc = cast<BinaryOperator>(ii);
+      ConstantInt *one = dyn_cast<ConstantInt>(inc->getOperand(1));
+      simple = inc->getOpcode() == Instruction::Add &&
+               inc->getOperand(0) == load && one && one->isOne();
+    } else if (!store && inc && isa<StoreInst>(ii)) {
+      store = cast<StoreInst>(ii);
+      simple = store->getPointerOperand() == pl.iv &&
+               store->getValueOperand() == inc;
+    } else {
+      simple = false;
+    }
+  }
+  if (!simple || !store) {
+    ACCEPT_LOG << "loop latch is not a simple increment\n";
+    return false;
+  }
+  return true;
+}
+
+// Whether a value computed in the loop header has the same value on every
+// iteration: integer casts of loads from variables the loop does not write.
+bool LoopParallel::isInvariant(Loop *loop, Value *v) {
+  Instruction *inst = dyn_cast<Instruction>(v);
+  if (!inst || !loop->contains(inst->getParent()))
+    return true;
+  if (inst->getParent() != loop->getHeader())
+    return false;
+  if (CastInst *cast = dyn_cast<CastInst>(inst))
+    return cast->isIntegerCast() && isInvariant(loop, cast->getOperand(0));
+
+  LoadInst *load = dyn_cast<LoadInst>(inst);
+  if (!load || load->isVolatile() || !isVariable(load->getPointerOperand()))
+    return false;
+  Value *ptr = load->getPointerOperand();
+  for (Value::use_iterator ui = ptr->use_begin(); ui != ptr->use_end(); ++ui) {
+    Instruction *user = dyn_cast<Instruction>(*ui);
+    if (user && loop->contains(user->getParent()) && !isa<LoadInst>(user))
+      return false;
+  }
+  return true;
+}
+
+// Recompute a header value (a chain of casts of a load) before the loop.
+Value *LoopParallel::recompute(IRBuilder<> &builder, Loop *loop, Value *v) {
+  Instruction *inst = dyn_cast<Instruction>(v);
+  if (!inst || !loop->contains(inst->getParent()))
+    return v;
+  if (LoadInst *load = dyn_cast<LoadInst>(inst))
+    return builder.CreateLoad(load->getPointerOperand());
+  CastInst *cast = cast<CastInst>(inst);
+  return builder.CreateCast(cast->getOpcode(),
+                            recompute(builder, loop, cast->getOperand(0)),
+                            cast->getDestTy());
+}
+
+// Clone the loop body into a function of the iteration number and the
+// environment.
+Function *LoopParallel::outlineBody(Loop *loop, ParallelLoop &pl,
+                                    StructType *envTy) {
+  LLVMContext &ctx = module->getContext();
+  Function *F = loop->getHeader()->getParent();
+  Type *int64Ty = Type::getInt64Ty(ctx);
+  Type *ptrTy = Type::getInt8PtrTy(ctx);
+  Type *params[] = { int64Ty, ptrTy };
+  FunctionType *bodyTy = FunctionType::get(Type::getVoidTy(ctx), params,
+                                           false);
+  Function *bodyFunc = Function::Create(bodyTy, GlobalValue::InternalLinkage,
+      Twine("accept_parallel_") + F->getName(), module);
+  Function::arg_iterator ai = bodyFunc->arg_begin();
+  Value *index = ai++;
+  Value *env = ai;
+
+  BasicBlock *entry = BasicBlock::Create(ctx, "entry", bodyFunc);
+  IRBuilder<> builder(entry);
+  ValueToValueMapTy VMap;
+
+  // Private copies of the induction variable and body-only locals.
+  for (std::vector<AllocaInst*>::iterator pi = pl.privates.begin();
+       pi != pl.privates.end(); ++pi) {
+    AllocaInst *priv = builder.CreateAlloca((*pi)->getAllocatedType(),
+        (*pi)->getArraySize(), (*pi)->getName());
+    priv->setAlignment((*pi)->getAlignment());
+    VMap[*pi] = priv;
+  }
+  Type *ivTy = pl.iv->getAllocatedType();
+  AllocaInst *iv = builder.CreateAlloca(ivTy, 0, pl.iv->getName());
+  iv->setAlignment(pl.iv->getAlignment());
+  builder.CreateStore(builder.CreateTrunc(index, ivTy), iv);
+  VMap[pl.iv] = iv;
+
+  // Shared values come from the environment.
+  if (!pl.shared.empty()) {
+    Value *envPtr = builder.CreateBitCast(env, PointerType::getUnqual(envTy));
+    for (unsigned i = 0; i < pl.shared.size(); ++i)
+      VMap[pl.shared[i]] = builder.CreateLoad(
+          builder.CreateStructGEP(envPtr, i), pl.shared[i]->getName());
+  }
+
+  // Clone the body; reaching the latch ends the iteration.
+  std::vector<BasicBlock*> clones;
+  for (Function::iterator bi = F->begin(); bi != F->end(); ++bi) {
+    BasicBlock *block = bi;
+    if (pl.body.count(block)) {
+      BasicBlock *clone = CloneBasicBlock(block, VMap, ".par", bodyFunc);
+      VMap[block] = clone;
+      clones.push_back(clone);
+    }
+  }
+  BasicBlock *next = BasicBlock::Create(ctx, "par.next", bodyFunc);
+  ReturnInst::Create(ctx, next);
+  VMap[loop->getLoopLatch()] = next;
+  builder.CreateBr(cast<BasicBlock>(VMap[pl.bodyEntry]));
+
+  std::vector<Instruction*> dbgInsts;
+  for (std::vector<BasicBlock*>::iterator bi = clones.begin();
+       bi != clones.end(); ++bi) {
+    for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end(); ++ii) {
+      if (isa<DbgInfoIntrinsic>(ii))
+        dbgInsts.push_back(ii);
+      else
+        RemapInstruction(ii, VMap, RF_IgnoreMissingEntries);
+    }
+  }
+  for (std::vector<Instruction*>::iterator ii = dbgInsts.begin();
+       ii != dbgInsts.end(); ++ii)
+    (*ii)->eraseFromParent();
+
+  return bodyFunc;
+}
+
+// Replace the loop with a call to the parallel runtime.
+void LoopParallel::parallelize(Loop *loop, ParallelLoop &pl, int threads) {
+  LLVMContext &ctx = module->getContext();
+  Function *F = loop->getHeader()->getParent();
+  Type *int64Ty = Type::getInt64Ty(ctx);
+  Type *ptrTy = Type::getInt8PtrTy(ctx);
+
+  std::vector<Type*> envFields;
+  for (std::vector<Value*>::iterator vi = pl.shared.begin();
+       vi != pl.shared.end(); ++vi)
+    envFields.push_back((*vi)->getType());
+  StructType *envTy = StructType::get(ctx, envFields);
+  Function *bodyFunc = outlineBody(loop, pl, envTy);
+
+  // Fill in the environment.
+  BasicBlock *preheader = loop->getLoopPreheader();
+  IRBuilder<> builder(preheader->getTerminator());
+  Value *env = ConstantPointerNull::get(cast<PointerType>(ptrTy));
+  if (!pl.shared.empty()) {
+    IRBuilder<> entryBuilder(F->getEntryBlock().begin());
+    Value *envAlloca = entryBuilder.CreateAlloca(envTy, 0, "accept_env");
+    for (unsigned i = 0; i < pl.shared.size(); ++i)
+      builder.CreateStore(pl.shared[i],
+                          builder.CreateStructGEP(envAlloca, i));
+    env = builder.CreateBitCast(envAlloca, ptrTy);
+  }
+
+  // Run the iterations [begin, end).
+  Value *begin = builder.CreateIntCast(
+      recompute(builder, loop, pl.ivOperand), int64Ty, pl.isSigned);
+  Value *end = builder.CreateIntCast(
+      recompute(builder, loop, pl.bound), int64Ty, pl.isSigned);
+  if (pl.inclusive)
+    end = builder.CreateAdd(end, ConstantInt::get(int64Ty, 1));
+  Constant *parallelFor = module->getOrInsertFunction("accept_parallel_for",
+      Type::getVoidTy(ctx), bodyFunc->getType(), ptrTy, int64Ty, int64Ty,
+      Type::getInt32Ty(ctx), NULL);
+  builder.CreateCall5(parallelFor, bodyFunc, env, begin, end,
+      ConstantInt::get(Type::getInt32Ty(ctx), threads));
+
+  // Leave the induction variable as the loop would.
+  Value *ran = pl.isSigned ? builder.CreateICmpSLT(begin, end) :
+                             builder.CreateICmpULT(begin, end);
+  Value *last = builder.CreateSelect(ran, end, begin);
+  builder.CreateStore(
+      builder.CreateTrunc(last, pl.iv->getAllocatedType()), pl.iv);
+
+  // Skip the loop and delete it, removing it (and the loops nested in it)
+  // from LoopInfo first.
+  preheader->getTerminator()->setSuccessor(0, pl.exit);
+  std::vector<BasicBlock*> blocks(loop->block_begin(), loop->block_end());
+  for (std::vector<BasicBlock*>::iterator bi = blocks.begin();
+       bi != blocks.end(); ++bi)
+    LI->removeBlock(*bi);
+  if (Loop *parent = loop->getParentLoop()) {
+    for (Loop::iterator li = parent->begin(); li != parent->end(); ++li) {
+      if (*li == loop) {
+        parent->removeChildLoop(li);
+        break;
+      }
+    }
+  } else {
+    for (LoopInfo::iterator li = LI->begin(); li != LI->end(); ++li) {
+      if (*li == loop) {
+        LI->removeLoop(li);
+        break;
+      }
+    }
+  }
+  delete loop;
+
+  for (std::vector<BasicBlock*>::iterator bi = blocks.begin();
+       bi != blocks.end(); ++bi)
+    (*bi)->dropAllReferences();
+  for (std::vector<BasicBlock*>::iterator bi = blocks.begin();
+       bi != blocks.end(); ++bi)
+    (*bi)->eraseFromParent();
+}
+
+char LoopParallel::ID = 0;
+INITIALIZE_PASS_BEGIN(LoopParallel, "accept-parallel",
+                      "ACCEPT loop parallelization", false, false)
+INITIALIZE_PASS_DEPENDENCY(LoopInfo)
+INITIALIZE_PASS_END(LoopParallel, "accept-parallel",
+                    "ACCEPT loop parallelization", false, false)
+FunctionPass *llvm::createLoopParallelPass() { return new LoopParallel(); }
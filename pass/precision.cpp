@@ -0,0 +1,432 @@
+#include "llvm/Function.h"
+#include "llvm/Module.h"
+#include "llvm/Constants.h"
+#include "llvm/Intrinsics.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/ADT/EquivalenceClasses.h"
+#include "llvm/ADT/PostOrderIterator.h"
+#include "llvm/Support/CFG.h"
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// Precision reduction. Approximate floating-point computation is grouped into
+// chains: connected components of approximate FP arithmetic, comparisons,
+// selects and phis, together with the scalar local variables they load and
+// store. Each chain is a relaxation site whose parameter selects how much
+// precision it keeps:
+//   1: arithmetic on doubles is performed in single precision;
+//   2: in addition, the chain's local variables are stored as IEEE halves;
+//   3: the local variables are stored as bfloat16 instead.
+// Conversions are only inserted where values cross into or out of a chain.
+
+namespace {
+  enum {
+    LEVEL_FLOAT = 1,
+    LEVEL_HALF = 2,
+    LEVEL_BFLOAT = 3
+  };
+
+  bool isScalarFP(Type *type) {
+    return type->isFloatTy() || type->isDoubleTy();
+  }
+
+  // A local FP variable qualifies if it is only loaded and stored by
+  // approximate instructions (so its address never escapes).
+  bool isApproxLocal(AllocaInst *alloca) {
+    if (!isScalarFP(alloca->getAllocatedType()) || alloca->isArrayAllocation())
+      return false;
+    for (Value::use_iterator ui = alloca->use_begin();
+         ui != alloca->use_end(); ++ui) {
+      Instruction *user = cast<Instruction>(*ui);
+      if (isa<LoadInst>(user)) {
+        if (!isApprox(user))
+          return false;
+      } else if (StoreInst *store = dyn_cast<StoreInst>(user)) {
+        if (store->getPointerOperand() != alloca || !isApprox(store))
+          return false;
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+}
+
+struct PrecisionReduction : public FunctionPass {
+  static char ID;
+  ACCEPTPass *transformPass;
+  ApproxInfo *AI;
+  Module *module;
+
+  PrecisionReduction();
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual const char *getPassName() const;
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+  virtual bool runOnFunction(llvm::Function &F);
+
+  bool isMember(Instruction *inst);
+  bool reduceChain(const std::vector<Instruction*> &chain);
+  bool rewriteChain(const std::vector<Instruction*> &chain, int level);
+
+  // State for rewriting one chain.
+  std::set<Value*> members;
+  std::map<Value*, Value*> narrow;    // Member -> its reduced replacement.
+  std::map<Value*, Value*> boundary;  // Outside double -> float conversion.
+  Value *operand(Value *v, Instruction *at);
+  Instruction *insertionPointAfter(Value *v);
+};
+
+void PrecisionReduction::getAnalysisUsage(AnalysisUsage &AU) const {
+  FunctionPass::getAnalysisUsage(AU);
+}
+
+PrecisionReduction::PrecisionReduction() : FunctionPass(ID) {
+  initializePrecisionReductionPass(*PassRegistry::getPassRegistry());
+  module = 0;
+}
+
+const char *PrecisionReduction::getPassName() const {
+  return "ACCEPT precision reduction";
+}
+
+bool PrecisionReduction::doInitialization(Module &M) {
+  module = &M;
+  transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
+  return false;
+}
+
+bool PrecisionReduction::doFinalization(Module &M) {
+  return false;
+}
+
+bool PrecisionReduction::isMember(Instruction *inst) {
+  if (AllocaInst *alloca = dyn_cast<AllocaInst>(inst))
+    return isApproxLocal(alloca);
+  if (!isApprox(inst))
+    return false;
+
+  if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+    AllocaInst *alloca = dyn_cast<AllocaInst>(load->getPointerOperand());
+    return alloca && isApproxLocal(alloca);
+  } else if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+    AllocaInst *alloca = dyn_cast<AllocaInst>(store->getPointerOperand());
+    return alloca && isApproxLocal(alloca);
+  } else if (isa<BinaryOperator>(inst) || isa<PHINode>(inst) ||
+             isa<SelectInst>(inst)) {
+    return isScalarFP(inst->getType());
+  } else if (FCmpInst *cmp = dyn_cast<FCmpInst>(inst)) {
+    return isScalarFP(cmp->getOperand(0)->getType());
+  }
+  return false;
+}
+
+bool PrecisionReduction::runOnFunction(Function &F) {
+  AI = transformPass->AI;
+
+  // Skip optimizing functions that seem to be in standard libraries.
+  if (transformPass->shouldSkipFunc(F))
+    return false;
+
+  // Group the members into chains along def-use edges. Only reachable code
+  // is considered.
+  std::vector<Instruction*> order;
+  std::set<Instruction*> candidates;
+  ReversePostOrderTraversal<Function*> rpot(&F);
+  for (ReversePostOrderTraversal<Function*>::rpo_iterator bi = rpot.begin();
+       bi != rpot.end(); ++bi) {
+    for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end(); ++ii) {
+      if (isMember(ii)) {
+        order.push_back(ii);
+        candidates.insert(ii);
+      }
+    }
+  }
+
+  EquivalenceClasses<Instruction*> chains;
+  for (std::vector<Instruction*>::iterator i = order.begin();
+       i != order.end(); ++i) {
+    Instruction *inst = *i;
+    chains.insert(inst);
+    for (User::op_iterator oi = inst->op_begin(); oi != inst->op_end(); ++oi) {
+      Instruction *op = dyn_cast<Instruction>(*oi);
+      if (op && candidates.count(op))
+        chains.unionSets(inst, op);
+    }
+  }
+
+  // Collect each chain's instructions in reverse post-order.
+  std::map<Instruction*, std::vector<Instruction*> > byLeader;
+  std::vector<Instruction*> leaders;
+  for (std::vector<Instruction*>::iterator i = order.begin();
+       i != order.end(); ++i) {
+    Instruction *leader = chains.getLeaderValue(*i);
+    if (!byLeader.count(leader))
+      leaders.push_back(leader);
+    byLeader[leader].push_back(*i);
+  }
+
+  bool modified = false;
+  for (std::vector<Instruction*>::iterator i = leaders.begin();
+       i != leaders.end(); ++i)
+    modified |= reduceChain(byLeader[*i]);
+  return modified;
+}
+
+bool PrecisionReduction::reduceChain(const std::vector<Instruction*> &chain) {
+  // A chain is only worth a site if it computes on doubles or has local
+  // variables whose storage can shrink.
+  unsigned int ops = 0, locals = 0;
+  bool hasDouble = false;
+  Instruction *where = NULL;
+  for (std::vector<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    Instruction *inst = *i;
+    if (isa<AllocaInst>(inst)) {
+      ++locals;
+      continue;
+    }
+    if (!where && !inst->getDebugLoc().isUnknown())
+      where = inst;
+    if (isa<BinaryOperator>(inst)) {
+      ++ops;
+      hasDouble |= inst->getType()->isDoubleTy();
+    }
+  }
+  if (!where || (!hasDouble && !locals))
+    return false;
+
+  std::string optName = transformPass->siteName("precision", where);
+  LogDescription *desc = AI->logAdd("Precision", where);
+  ACCEPT_LOG << optName << "\n";
+  ACCEPT_LOG << ops << " operations, " << locals << " local variables\n";
+
+  if (transformPass->relax) {
+    int param = transformPass->relaxConfig.lookup(optName);
+    if (param) {
+      if (param > LEVEL_BFLOAT)
+        param = LEVEL_BFLOAT;
+      ACCEPT_LOG << "reducing precision to level " << param << "\n";
+      return rewriteChain(chain, param);
+    } else {
+      ACCEPT_LOG << "not reducing precision\n";
+    }
+  } else {
+    ACCEPT_LOG << "can reduce precision\n";
+    transformPass->relaxConfig.insert(optName, 0);
+  }
+  return false;
+}
+
+// Where to put a conversion of a value defined outside the chain, or NULL if
+// there is no single point after the definition (an invoke's result).
+Instruction *PrecisionReduction::insertionPointAfter(Value *v) {
+  if (Argument *arg = dyn_cast<Argument>(v))
+    return arg->getParent()->getEntryBlock().getFirstInsertionPt();
+  Instruction *def = cast<Instruction>(v);
+  if (isa<PHINode>(def))
+    return def->getParent()->getFirstInsertionPt();
+  if (isa<InvokeInst>(def))
+    return NULL;
+  BasicBlock::iterator next = def;
+  return ++next;
+}
+
+// The reduced version of an operand. Values from outside the chain are
+// converted once, right after their definition (or at `at` if that is not
+// possible).
+Value *PrecisionReduction::operand(Value *v, Instruction *at) {
+  if (members.count(v))
+    return narrow[v];
+  if (!v->getType()->isDoubleTy())
+    return v;
+
+  Type *floatTy = Type::getFloatTy(module->getContext());
+  if (Constant *c = dyn_cast<Constant>(v))
+    return ConstantExpr::getFPTrunc(c, floatTy);
+  if (boundary.count(v))
+    return boundary[v];
+
+  Instruction *pos = insertionPointAfter(v);
+  IRBuilder<> builder(pos ? pos : at);
+  Value *conv = setQuals(builder.CreateFPTrunc(v, floatTy, "prec_in"),
+                         at->getMetadata("quals"));
+  if (pos)
+    boundary[v] = conv;
+  return conv;
+}
+
+// Conversions between float and the 16-bit storage formats. Halves use the
+// fp16 conversion intrinsics; bfloat16 keeps the upper half of the float's
+// bits, rounded to nearest even.
+Value *llvm::packFloat16(IRBuilder<> &builder, Value *v, bool bfloat,
+                         MDNode *quals) {
+  Module *module = builder.GetInsertBlock()->getParent()->getParent();
+  if (!bfloat) {
+    Function *conv = Intrinsic::getDeclaration(module,
+        Intrinsic::convert_to_fp16);
+    return setQuals(builder.CreateCall(conv, v, "half"), quals);
+  }
+
+  Type *int32Ty = Type::getInt32Ty(module->getContext());
+  Value *bits = setQuals(builder.CreateBitCast(v, int32Ty), quals);
+  Value *lsb = setQuals(builder.CreateAnd(
+      setQuals(builder.CreateLShr(bits, 16), quals),
+      ConstantInt::get(int32Ty, 1)), quals);
+  Value *rounded = setQuals(builder.CreateAdd(bits,
+      setQuals(builder.CreateAdd(lsb, ConstantInt::get(int32Ty, 0x7fff)),
+               quals)), quals);
+  return setQuals(builder.CreateTrunc(
+      setQuals(builder.CreateLShr(rounded, 16), quals),
+      Type::getInt16Ty(module->getContext()), "bfloat"), quals);
+}
+
+Value *llvm::unpackFloat16(IRBuilder<> &builder, Value *v, bool bfloat,
+                           MDNode *quals) {
+  Module *module = builder.GetInsertBlock()->getParent()->getParent();
+  if (!bfloat) {
+    Function *conv = Intrinsic::getDeclaration(module,
+        Intrinsic::convert_from_fp16);
+    return setQuals(builder.CreateCall(conv, v, "unpacked"), quals);
+  }
+
+  Type *int32Ty = Type::getInt32Ty(module->getContext());
+  Value *bits = setQuals(builder.CreateShl(
+      setQuals(builder.CreateZExt(v, int32Ty), quals), 16), quals);
+  return setQuals(builder.CreateBitCast(bits,
+      Type::getFloatTy(module->getContext()), "unpacked"), quals);
+}
+
+bool PrecisionReduction::rewriteChain(const std::vector<Instruction*> &chain,
+                                      int level) {
+  LLVMContext &ctx = module->getContext();
+  Type *floatTy = Type::getFloatTy(ctx);
+  Type *storageTy = level == LEVEL_FLOAT ? floatTy : Type::getInt16Ty(ctx);
+
+  members.clear();
+  narrow.clear();
+  boundary.clear();
+  members.insert(chain.begin(), chain.end());
+  Function *F = chain[0]->getParent()->getParent();
+
+  // Phis and local variables first, so that every other member can find
+  // its operands when the blocks are visited in reverse post-order. Each
+  // replacement keeps the qualifiers of the member it replaces.
+  for (std::vector<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    IRBuilder<> builder(*i);
+    MDNode *quals = (*i)->getMetadata("quals");
+    if (PHINode *phi = dyn_cast<PHINode>(*i)) {
+      narrow[phi] = setQuals(builder.CreatePHI(floatTy,
+          phi->getNumIncomingValues(), phi->getName()), quals);
+    } else if (AllocaInst *alloca = dyn_cast<AllocaInst>(*i)) {
+      narrow[alloca] = setQuals(builder.CreateAlloca(storageTy, 0,
+                                                     alloca->getName()),
+                                quals);
+    }
+  }
+
+  ReversePostOrderTraversal<Function*> rpot(F);
+  for (ReversePostOrderTraversal<Function*>::rpo_iterator bi = rpot.begin();
+       bi != rpot.end(); ++bi) {
+    for (BasicBlock::iterator ii = (*bi)->begin(); ii != (*bi)->end(); ++ii) {
+      Instruction *inst = ii;
+      if (!members.count(inst) || isa<PHINode>(inst) || isa<AllocaInst>(inst))
+        continue;
+      IRBuilder<> builder(inst);
+      MDNode *quals = inst->getMetadata("quals");
+
+      if (BinaryOperator *op = dyn_cast<BinaryOperator>(inst)) {
+        narrow[op] = setQuals(builder.CreateBinOp(op->getOpcode(),
+            operand(op->getOperand(0), inst),
+            operand(op->getOperand(1), inst), op->getName()), quals);
+      } else if (FCmpInst *cmp = dyn_cast<FCmpInst>(inst)) {
+        narrow[cmp] = setQuals(builder.CreateFCmp(cmp->getPredicate(),
+            operand(cmp->getOperand(0), inst),
+            operand(cmp->getOperand(1), inst), cmp->getName()), quals);
+      } else if (SelectInst *sel = dyn_cast<SelectInst>(inst)) {
+        narrow[sel] = setQuals(builder.CreateSelect(
+            operand(sel->getCondition(), inst),
+            operand(sel->getTrueValue(), inst),
+            operand(sel->getFalseValue(), inst), sel->getName()), quals);
+      } else if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+        Value *v = setQuals(builder.CreateLoad(
+            narrow[load->getPointerOperand()], load->getName()), quals);
+        if (level != LEVEL_FLOAT)
+          v = unpackFloat16(builder, v, level == LEVEL_BFLOAT, quals);
+        narrow[load] = v;
+      } else if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+        Value *v = operand(store->getValueOperand(), inst);
+        if (level != LEVEL_FLOAT)
+          v = packFloat16(builder, v, level == LEVEL_BFLOAT, quals);
+        setQuals(builder.CreateStore(v, narrow[store->getPointerOperand()]),
+                 quals);
+      }
+    }
+  }
+
+  // Now that every member has a replacement, fill in the phis.
+  for (std::vector<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    PHINode *phi = dyn_cast<PHINode>(*i);
+    if (!phi)
+      continue;
+    PHINode *newPhi = cast<PHINode>(narrow[phi]);
+    for (unsigned j = 0; j < phi->getNumIncomingValues(); ++j) {
+      BasicBlock *pred = phi->getIncomingBlock(j);
+      newPhi->addIncoming(operand(phi->getIncomingValue(j),
+                                  pred->getTerminator()), pred);
+    }
+  }
+
+  // Code outside the chain sees the original types again.
+  for (std::vector<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    Instruction *inst = *i;
+    if (isa<StoreInst>(inst) || isa<AllocaInst>(inst))
+      continue;
+
+    std::vector<Use*> outside;
+    for (Value::use_iterator ui = inst->use_begin(); ui != inst->use_end();
+         ++ui) {
+      if (!members.count(*ui))
+        outside.push_back(&ui.getUse());
+    }
+    if (outside.empty())
+      continue;
+
+    Value *v = narrow[inst];
+    if (v->getType() != inst->getType()) {
+      IRBuilder<> builder(insertionPointAfter(v));
+      v = setQuals(builder.CreateFPExt(v, inst->getType(), "prec_out"),
+                   inst->getMetadata("quals"));
+    }
+    for (std::vector<Use*>::iterator ui = outside.begin();
+         ui != outside.end(); ++ui)
+      (*ui)->set(v);
+  }
+
+  // The original chain is now dead (except for uses in unreachable code).
+  for (std::vector<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i)
+    (*i)->dropAllReferences();
+  for (std::vector<Instruction*>::const_iterator i = chain.begin();
+       i != chain.end(); ++i) {
+    (*i)->replaceAllUsesWith(UndefValue::get((*i)->getType()));
+    (*i)->eraseFromParent();
+  }
+
+  return true;
+}
+
+char PrecisionReduction::ID = 0;
+INITIALIZE_PASS(PrecisionReduction, "precision", "ACCEPT precision reduction", false, false)
+FunctionPass *llvm::createPrecisionReductionPass() { return new PrecisionReduction(); }
@@ -45,6 +45,14 @@ namespace {
     if (acceptEnableInjection)
       PM.add(createErrorInjectionPass());
     PM.add(createLoopPerfPass());
+    PM.add(createStoreElisionPass());
+    PM.add(createLoadPredictionPass());
+    PM.add(createPrecisionReductionPass());
+    PM.add(createStorageCompactionPass());
+    PM.add(createMemoizationPass());
+    PM.add(createFastMathPass());
+    PM.add(createBranchRelaxPass());
+    PM.add(createLoopParallelPass());
     if (acceptEnableNPU)
       PM.add(createLoopNPUPass());
   }
@@ -52,14 +60,13 @@ namespace {
       RegisterACCEPT(PassManagerBuilder::EP_EarlyAsPossible,
                      registerACCEPT);
 
-  // Alias analysis.
-  /*
+  // Alias analysis. This extension point adds to the module pass manager
+  // ahead of LICM, GVN, and the vectorizers, after the standard alias
+  // analyses (which AcceptAA consults first).
   static void registerAA(const PassManagerBuilder &, PassManagerBase &PM) {
     PM.add(createAcceptAAPass());
   }
-  // This extension point adds to the module pass manager.
   static RegisterStandardPasses
       RM(PassManagerBuilder::EP_ModuleOptimizerEarly,
          registerAA);
-  */
 }
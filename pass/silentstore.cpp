@@ -0,0 +1,174 @@
+#include "llvm/Function.h"
+#include "llvm/Module.h"
+#include "llvm/Constants.h"
+#include "llvm/IntrinsicInst.h"
+#include "llvm/IRBuilder.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// Silent store elision. An approximate floating-point store to memory whose
+// current value is already close to the new one is skipped, so cache lines
+// that barely change are not dirtied. The store is preceded by a load of
+// the old value and a comparison: at level p, the store is skipped when the
+// values differ by at most 2^(p - 10) of the old value. Stores to local
+// variables are left alone (they stay in registers or in the cache anyway).
+
+namespace {
+  const int STORE_MAX_LEVEL = 6;
+}
+
+struct StoreElision : public FunctionPass {
+  static char ID;
+  ACCEPTPass *transformPass;
+  ApproxInfo *AI;
+  Module *module;
+
+  StoreElision();
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual const char *getPassName() const;
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+  virtual bool runOnFunction(llvm::Function &F);
+
+  bool tryToElide(StoreInst *store);
+  void elide(StoreInst *store, int level);
+};
+
+void StoreElision::getAnalysisUsage(AnalysisUsage &AU) const {
+  FunctionPass::getAnalysisUsage(AU);
+}
+
+StoreElision::StoreElision() : FunctionPass(ID) {
+  initializeStoreElisionPass(*PassRegistry::getPassRegistry());
+  module = 0;
+}
+
+const char *StoreElision::getPassName() const {
+  return "ACCEPT silent store elision";
+}
+
+bool StoreElision::doInitialization(Module &M) {
+  module = &M;
+  transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
+  return false;
+}
+
+bool StoreElision::doFinalization(Module &M) {
+  return false;
+}
+
+bool StoreElision::runOnFunction(Function &F) {
+  AI = transformPass->AI;
+
+  // Skip optimizing functions that seem to be in standard libraries.
+  if (transformPass->shouldSkipFunc(F))
+    return false;
+
+  std::vector<StoreInst*> stores;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      StoreInst *store = dyn_cast<StoreInst>(ii);
+      if (store && isApprox(store) &&
+          store->getValueOperand()->getType()->isFloatingPointTy() &&
+          !isLocalPtr(store->getPointerOperand()))
+        stores.push_back(store);
+    }
+  }
+
+  bool modified = false;
+  for (std::vector<StoreInst*>::iterator si = stores.begin();
+       si != stores.end(); ++si)
+    modified |= tryToElide(*si);
+  return modified;
+}
+
+bool StoreElision::tryToElide(StoreInst *store) {
+  std::string optName = transformPass->siteName("store", store);
+  LogDescription *desc = AI->logAdd("Store", store);
+  ACCEPT_LOG << optName << "\n";
+
+  if (!store->isSimple()) {
+    ACCEPT_LOG << "volatile or atomic store\n";
+    return false;
+  }
+  Type *type = store->getValueOperand()->getType();
+  if (!type->isFloatTy() && !type->isDoubleTy()) {
+    ACCEPT_LOG << "unsupported type\n";
+    return false;
+  }
+
+  if (transformPass->relax) {
+    int param = transformPass->relaxConfig.lookup(optName);
+    if (param) {
+      if (param > STORE_MAX_LEVEL)
+        param = STORE_MAX_LEVEL;
+      ACCEPT_LOG << "eliding with tolerance 2^" << (param - 10) << "\n";
+      elide(store, param);
+      return true;
+    } else {
+      ACCEPT_LOG << "not eliding\n";
+    }
+  } else {
+    ACCEPT_LOG << "can elide store\n";
+    transformPass->relaxConfig.insert(optName, 0);
+  }
+  return false;
+}
+
+// Guard the store with a comparison against the value in memory.
+void StoreElision::elide(StoreInst *store, int level) {
+  LLVMContext &ctx = module->getContext();
+  Value *value = store->getValueOperand();
+
+  BasicBlock *head = store->getParent();
+  BasicBlock *tail = head->splitBasicBlock(store, "store.done");
+  BasicBlock *doStore = BasicBlock::Create(ctx, "store.write",
+                                           head->getParent(), tail);
+  head->getTerminator()->eraseFromParent();
+
+  // Skip the store when |new - old| <= tolerance * |old|. The comparisons
+  // fail for NaNs, so those are always stored.
+  IRBuilder<> builder(head);
+  LoadInst *old = builder.CreateLoad(store->getPointerOperand(), "store.old");
+  old->setAlignment(store->getAlignment());
+  Value *close = createWithinTolerance(builder, value, old,
+                                       ldexp(1.0, level - 10), "store.close");
+  builder.CreateCondBr(close, tail, doStore);
+
+  // The check computes on approximate data. The load itself is left
+  // untagged so that it is not offered as a load prediction site.
+  MDNode *quals = store->getMetadata("quals");
+  BasicBlock::iterator ii = old;
+  for (++ii; !isa<TerminatorInst>(ii); ++ii)
+    ii->setMetadata("quals", quals);
+
+  builder.SetInsertPoint(doStore);
+  BranchInst *br = builder.CreateBr(tail);
+  store->moveBefore(br);
+}
+
+char StoreElision::ID = 0;
+INITIALIZE_PASS(StoreElision, "store-elision",
+                "ACCEPT silent store elision", false, false)
+FunctionPass *llvm::createStoreElisionPass() { return new StoreElision(); }
+
+Value *llvm::createWithinTolerance(IRBuilder<> &builder, Value *value,
+                                   Value *old, double tolerance,
+                                   const Twine &name) {
+  Type *type = old->getType();
+  Value *zero = ConstantFP::get(type, 0.0);
+  Value *magnitude = builder.CreateSelect(
+      builder.CreateFCmpOLT(old, zero), builder.CreateFSub(zero, old), old);
+  Value *limit = builder.CreateFMul(magnitude,
+                                    ConstantFP::get(type, tolerance));
+  Value *diff = builder.CreateFSub(value, old);
+  return builder.CreateAnd(
+      builder.CreateFCmpOLE(diff, limit),
+      builder.CreateFCmpOGE(diff, builder.CreateFSub(zero, limit)), name);
+}
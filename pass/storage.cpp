@@ -0,0 +1,710 @@
+#include "llvm/Function.h"
+#include "llvm/Module.h"
+#include "llvm/Constants.h"
+#include "llvm/GlobalVariable.h"
+#include "llvm/Operator.h"
+#include "llvm/IRBuilder.h"
+#include "llvm/ADT/APFloat.h"
+#include "llvm/Analysis/Dominators.h"
+#include "llvm/Transforms/Utils/PromoteMemToReg.h"
+
+#include <cmath>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "accept.h"
+
+using namespace llvm;
+
+// Storage compaction. Approximate arrays of floats or doubles are stored in a
+// narrower element type, and every load and store is rewritten to widen or
+// narrow the element. The site parameter selects the format:
+//   1: bfloat16 (the float's mantissa truncated to 8 bits);
+//   2: IEEE half precision;
+//   3: 8-bit fixed point with a per-array, power-of-two scale that the
+//      runtime raises when a stored value does not fit.
+// Candidates are the approximate globals listed in accept-globals-info.txt
+// and approximate malloc'd buffers that never leave the allocating function.
+// The arrays must only be indexed, loaded, and stored (and, for heap
+// buffers, compared and freed); any other use of their address blocks the
+// transformation. Heap buffers are limited to the 16-bit formats since they
+// have nowhere to keep a scale.
+
+namespace {
+  enum {
+    LEVEL_BFLOAT = 1,
+    LEVEL_HALF = 2,
+    LEVEL_FIXED = 3
+  };
+
+  // The scalar element of an array type (of any dimension) of floats or
+  // doubles, or NULL for any other type.
+  Type *elementOf(Type *type) {
+    while (ArrayType *at = dyn_cast<ArrayType>(type))
+      type = at->getElementType();
+    if (type->isFloatTy() || type->isDoubleTy())
+      return type;
+    return NULL;
+  }
+
+  uint64_t scalarsIn(Type *type) {
+    uint64_t n = 1;
+    while (ArrayType *at = dyn_cast<ArrayType>(type)) {
+      n *= at->getNumElements();
+      type = at->getElementType();
+    }
+    return n;
+  }
+
+  bool isMalloc(Instruction *inst) {
+    return isCallOf(inst, "malloc");
+  }
+  bool isFree(Instruction *inst) {
+    return isCallOf(inst, "free");
+  }
+}
+
+struct StorageCompaction : public FunctionPass {
+  static char ID;
+  ACCEPTPass *transformPass;
+  ApproxInfo *AI;
+  Module *module;
+  bool globalsDone;
+
+  StorageCompaction();
+  virtual void getAnalysisUsage(AnalysisUsage &AU) const;
+  virtual const char *getPassName() const;
+  virtual bool doInitialization(llvm::Module &M);
+  virtual bool doFinalization(llvm::Module &M);
+  virtual bool runOnFunction(llvm::Function &F);
+
+  bool compactGlobals();
+  bool compactHeap(Function &F);
+  int siteParam(const std::string &optName, Instruction *where,
+                LogDescription *&desc);
+
+  // State for compacting one array.
+  Type *elemTy;
+  Type *storageTy;
+  int level;
+  GlobalVariable *scaleState;  // {scale, 1/scale} for fixed point.
+  uint64_t nscalars;
+  std::set<Value*> derived;    // Pointers into the array.
+  std::vector<Instruction*> terminals;  // Loads, stores, frees, compares.
+  std::set<Instruction*> terminalSet;
+  std::map<Value*, Value*> mapped;
+  User *blocker;
+
+  void reset(Type *elem);
+  bool isElemPointer(Type *type);
+  void addTerminal(Instruction *inst);
+  bool collectUses(Value *ptr, bool heap);
+  bool checkMerges();
+  Type *mapType(Type *type);
+  Value *mapPtr(Value *v);
+  Constant *compactConstant(Constant *c, float inv);
+  Value *widen(IRBuilder<> &builder, Value *v, MDNode *quals);
+  void rewriteStore(StoreInst *store, Value *base);
+  void rewrite(Value *base);
+};
+
+void StorageCompaction::getAnalysisUsage(AnalysisUsage &AU) const {
+  FunctionPass::getAnalysisUsage(AU);
+  AU.addRequired<DominatorTree>();
+}
+
+StorageCompaction::StorageCompaction() : FunctionPass(ID) {
+  initializeStorageCompactionPass(*PassRegistry::getPassRegistry());
+  module = 0;
+  globalsDone = false;
+}
+
+const char *StorageCompaction::getPassName() const {
+  return "ACCEPT storage compaction";
+}
+
+bool StorageCompaction::doInitialization(Module &M) {
+  module = &M;
+  transformPass = (ACCEPTPass*)sharedAcceptTransformPass;
+  return false;
+}
+
+bool StorageCompaction::doFinalization(Module &M) {
+  return false;
+}
+
+bool StorageCompaction::runOnFunction(Function &F) {
+  AI = transformPass->AI;
+
+  // Globals are compacted once, when the analyses first become available.
+  bool modified = false;
+  if (!globalsDone) {
+    globalsDone = true;
+    modified |= compactGlobals();
+  }
+
+  // Skip optimizing functions that seem to be in standard libraries.
+  if (transformPass->shouldSkipFunc(F))
+    return modified;
+
+  modified |= compactHeap(F);
+  return modified;
+}
+
+// Log a site and look up its parameter (0 in the analysis run).
+int StorageCompaction::siteParam(const std::string &optName,
+                                 Instruction *where, LogDescription *&desc) {
+  desc = where ? AI->logAdd("Storage", where) : NULL;
+  ACCEPT_LOG << optName << "\n";
+  if (blocker) {
+    ACCEPT_LOG << "cannot compact: address used by ";
+    if (Instruction *inst = dyn_cast<Instruction>(blocker))
+      ACCEPT_LOG << instDesc(*module, inst) << "\n";
+    else
+      ACCEPT_LOG << "a constant\n";
+    return 0;
+  }
+
+  if (transformPass->relax) {
+    int param = transformPass->relaxConfig.lookup(optName);
+    if (param)
+      ACCEPT_LOG << "compacting at level " << param << "\n";
+    else
+      ACCEPT_LOG << "not compacting\n";
+    return param;
+  } else {
+    ACCEPT_LOG << "can compact\n";
+    transformPass->relaxConfig.insert(optName, 0);
+    return 0;
+  }
+}
+
+bool StorageCompaction::compactGlobals() {
+  std::vector<GlobalVariable*> globals;
+  for (Module::global_iterator gi = module->global_begin();
+       gi != module->global_end(); ++gi) {
+    if (!gi->isDeclaration() && !gi->isConstant() &&
+        elementOf(gi->getType()->getElementType()) && isApproxPtr(gi))
+      globals.push_back(gi);
+  }
+
+  bool modified = false;
+  for (std::vector<GlobalVariable*>::iterator gi = globals.begin();
+       gi != globals.end(); ++gi) {
+    GlobalVariable *gv = *gi;
+    Type *arrayTy = gv->getType()->getElementType();
+    reset(elementOf(arrayTy));
+    bool ok = collectUses(gv, false) && checkMerges();
+
+    Instruction *where = NULL;
+    for (std::vector<Instruction*>::iterator ti = terminals.begin();
+         ti != terminals.end() && !where; ++ti)
+      if (!(*ti)->getDebugLoc().isUnknown())
+        where = *ti;
+    if (ok && terminals.empty())
+      continue;
+
+    LogDescription *desc;
+    std::string optName = "storage of " + gv->getName().str();
+    level = siteParam(optName, where, desc);
+    if (!level)
+      continue;
+    if (level > LEVEL_FIXED)
+      level = LEVEL_FIXED;
+
+    LLVMContext &ctx = module->getContext();
+    storageTy = level == LEVEL_FIXED ? Type::getInt8Ty(ctx) :
+                                       Type::getInt16Ty(ctx);
+    nscalars = scalarsIn(arrayTy);
+
+    // The fixed-point scale starts out covering the initializer's range
+    // (or tiny, for zero-initialized arrays).
+    float inv = 0.0f;
+    if (level == LEVEL_FIXED) {
+      float scale = ldexpf(1.0f, -24);
+      float maxval = 0.0f;
+      std::vector<Constant*> work(1, gv->getInitializer());
+      while (!work.empty()) {
+        Constant *c = work.back();
+        work.pop_back();
+        if (ConstantFP *fp = dyn_cast<ConstantFP>(c)) {
+          APFloat value = fp->getValueAPF();
+          bool lost;
+          value.convert(APFloat::IEEEsingle, APFloat::rmNearestTiesToEven,
+                        &lost);
+          float v = fabsf(value.convertToFloat());
+          if (v > maxval)
+            maxval = v;
+        } else if (ArrayType *at = dyn_cast<ArrayType>(c->getType())) {
+          for (unsigned i = 0; i < at->getNumElements(); ++i)
+            work.push_back(c->getAggregateElement(i));
+        }
+      }
+      while (maxval > 127.0f * scale)
+        scale *= 2.0f;
+      inv = 1.0f / scale;
+
+      Type *floatTy = Type::getFloatTy(ctx);
+      Constant *init[] = { ConstantFP::get(floatTy, scale),
+                           ConstantFP::get(floatTy, inv) };
+      ArrayType *stateTy = ArrayType::get(floatTy, 2);
+      scaleState = new GlobalVariable(*module, stateTy, false,
+          GlobalValue::InternalLinkage, ConstantArray::get(stateTy, init),
+          gv->getName() + ".scale");
+    }
+
+    GlobalVariable *compact = new GlobalVariable(*module, mapType(arrayTy),
+        false, gv->getLinkage(), compactConstant(gv->getInitializer(), inv),
+        gv->getName() + ".compact", gv, gv->getThreadLocalMode());
+    mapped[gv] = compact;
+    rewrite(compact);
+
+    gv->removeDeadConstantUsers();
+    if (gv->use_empty()) {
+      compact->takeName(gv);
+      gv->eraseFromParent();
+    }
+    modified = true;
+  }
+  return modified;
+}
+
+bool StorageCompaction::compactHeap(Function &F) {
+  std::vector<Instruction*> mallocs;
+  for (Function::iterator bi = F.begin(); bi != F.end(); ++bi) {
+    for (BasicBlock::iterator ii = bi->begin(); ii != bi->end(); ++ii) {
+      if (!isMalloc(ii))
+        continue;
+      bool approx = isApproxPtr(ii);
+      for (Value::use_iterator ui = ii->use_begin(); ui != ii->use_end(); ++ui)
+        if (isa<BitCastInst>(*ui) && isApproxPtr(*ui))
+          approx = true;
+      if (approx)
+        mallocs.push_back(ii);
+    }
+  }
+  if (mallocs.empty())
+    return false;
+
+  // In the relaxed build, leave the function untouched unless one of its
+  // buffers is to be compacted.
+  if (transformPass->relax) {
+    bool enabled = false;
+    for (std::vector<Instruction*>::iterator mi = mallocs.begin();
+         mi != mallocs.end() && !enabled; ++mi)
+      enabled = transformPass->relaxConfig.lookup(
+          transformPass->siteName("storage", *mi));
+    if (!enabled)
+      return false;
+  }
+
+  // At this point the buffer's address usually lives in a local variable.
+  // Promote pointer variables to registers so its uses can be followed.
+  bool modified = false;
+  std::vector<AllocaInst*> slots;
+  BasicBlock &entry = F.getEntryBlock();
+  for (BasicBlock::iterator ii = entry.begin(); ii != entry.end(); ++ii) {
+    AllocaInst *alloca = dyn_cast<AllocaInst>(ii);
+    if (alloca && alloca->getAllocatedType()->isPointerTy() &&
+        isAllocaPromotable(alloca))
+      slots.push_back(alloca);
+  }
+  if (!slots.empty()) {
+    PromoteMemToReg(slots, getAnalysis<DominatorTree>());
+    modified = true;
+  }
+
+  for (std::vector<Instruction*>::iterator mi = mallocs.begin();
+       mi != mallocs.end(); ++mi) {
+    CallInst *call = cast<CallInst>(*mi);
+
+    // The element type comes from the casts of the result.
+    Type *elem = NULL;
+    for (Value::use_iterator ui = call->use_begin(); ui != call->use_end();
+         ++ui) {
+      if (BitCastInst *cast = dyn_cast<BitCastInst>(*ui))
+        if (Type *e = elementOf(cast->getType()->getPointerElementType()))
+          elem = e;
+    }
+    if (!elem)
+      continue;
+    reset(elem);
+    if (collectUses(call, true))
+      checkMerges();
+
+    LogDescription *desc;
+    level = siteParam(transformPass->siteName("storage", call), call, desc);
+    if (!level)
+      continue;
+    if (level > LEVEL_HALF) {
+      ACCEPT_LOG << "using 16-bit storage for heap buffer\n";
+      level = LEVEL_HALF;
+    }
+    storageTy = Type::getInt16Ty(module->getContext());
+
+    // Shrink the allocation.
+    IRBuilder<> builder(call);
+    Value *size = call->getArgOperand(0);
+    uint64_t ratio = elem->getPrimitiveSizeInBits() / 16;
+    size = builder.CreateAdd(size, ConstantInt::get(size->getType(),
+                                                    ratio - 1));
+    size = builder.CreateUDiv(size, ConstantInt::get(size->getType(), ratio));
+    call->setArgOperand(0, size);
+
+    mapped[call] = call;
+    rewrite(call);
+    modified = true;
+  }
+  return modified;
+}
+
+void StorageCompaction::reset(Type *elem) {
+  elemTy = elem;
+  storageTy = NULL;
+  scaleState = NULL;
+  nscalars = 0;
+  derived.clear();
+  terminals.clear();
+  terminalSet.clear();
+  mapped.clear();
+  blocker = NULL;
+}
+
+bool StorageCompaction::isElemPointer(Type *type) {
+  PointerType *pt = dyn_cast<PointerType>(type);
+  return pt && elementOf(pt->getElementType()) == elemTy;
+}
+
+void StorageCompaction::addTerminal(Instruction *inst) {
+  if (terminalSet.insert(inst).second)
+    terminals.push_back(inst);
+}
+
+// Find everything derived from the array's address. Returns false (and sets
+// the blocker) on any use that cannot be rewritten.
+bool StorageCompaction::collectUses(Value *ptr, bool heap) {
+  if (derived.count(ptr))
+    return true;
+  derived.insert(ptr);
+
+  for (Value::use_iterator ui = ptr->use_begin(); ui != ptr->use_end(); ++ui) {
+    User *user = *ui;
+    Instruction *inst = dyn_cast<Instruction>(user);
+    bool ok = false;
+
+    if (LoadInst *load = dyn_cast<LoadInst>(user)) {
+      ok = !load->isVolatile() && load->getType() == elemTy;
+      addTerminal(load);
+    } else if (StoreInst *store = dyn_cast<StoreInst>(user)) {
+      ok = !store->isVolatile() && store->getPointerOperand() == ptr &&
+           store->getValueOperand()->getType() == elemTy;
+      addTerminal(store);
+    } else if (isa<GetElementPtrInst>(user) ||
+               (isa<ConstantExpr>(user) &&
+                cast<ConstantExpr>(user)->getOpcode() ==
+                    Instruction::GetElementPtr)) {
+      ok = isElemPointer(ptr->getType()) && isElemPointer(user->getType()) &&
+           collectUses(user, heap);
+    } else if (isa<BitCastInst>(user) ||
+               (isa<ConstantExpr>(user) &&
+                cast<ConstantExpr>(user)->getOpcode() == Instruction::BitCast)) {
+      // Casts between shapes of the array, and to i8* for freeing.
+      ok = (isElemPointer(user->getType()) ||
+            user->getType() == Type::getInt8PtrTy(module->getContext())) &&
+           collectUses(user, heap);
+    } else if (isa<PHINode>(user) || isa<SelectInst>(user)) {
+      ok = (!isa<SelectInst>(user) || user->getOperand(0) != ptr) &&
+           collectUses(user, heap);
+    } else if (isa<ICmpInst>(user)) {
+      ok = heap;
+      addTerminal(inst);
+    } else if (inst && isFree(inst)) {
+      ok = heap;
+      addTerminal(inst);
+    }
+
+    if (!ok) {
+      if (!blocker)
+        blocker = user;
+      return false;
+    }
+  }
+  return true;
+}
+
+// Merges of pointers (and pointer comparisons) must only involve this array.
+bool StorageCompaction::checkMerges() {
+  for (std::set<Value*>::iterator di = derived.begin(); di != derived.end();
+       ++di) {
+    if (PHINode *phi = dyn_cast<PHINode>(*di)) {
+      for (unsigned i = 0; i < phi->getNumIncomingValues(); ++i) {
+        if (!derived.count(phi->getIncomingValue(i))) {
+          blocker = phi;
+          return false;
+        }
+      }
+    } else if (SelectInst *sel = dyn_cast<SelectInst>(*di)) {
+      if (!derived.count(sel->getTrueValue()) ||
+          !derived.count(sel->getFalseValue())) {
+        blocker = sel;
+        return false;
+      }
+    }
+  }
+  for (std::vector<Instruction*>::iterator ti = terminals.begin();
+       ti != terminals.end(); ++ti) {
+    if (ICmpInst *cmp = dyn_cast<ICmpInst>(*ti)) {
+      for (unsigned i = 0; i < 2; ++i) {
+        Value *op = cmp->getOperand(i);
+        if (!derived.count(op) && !isa<ConstantPointerNull>(op)) {
+          blocker = cmp;
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+// The type of a pointer or array with the element replaced by the storage
+// type.
+Type *StorageCompaction::mapType(Type *type) {
+  if (type == elemTy)
+    return storageTy;
+  if (ArrayType *at = dyn_cast<ArrayType>(type))
+    return ArrayType::get(mapType(at->getElementType()), at->getNumElements());
+  if (PointerType *pt = dyn_cast<PointerType>(type))
+    return PointerType::get(mapType(pt->getElementType()),
+                            pt->getAddressSpace());
+  return type;
+}
+
+// The compacted counterpart of a pointer derived from the array. New
+// instructions go right before the ones they replace.
+Value *StorageCompaction::mapPtr(Value *v) {
+  if (mapped.count(v))
+    return mapped[v];
+
+  Value *out;
+  if (ConstantExpr *ce = dyn_cast<ConstantExpr>(v)) {
+    Constant *base = cast<Constant>(mapPtr(ce->getOperand(0)));
+    if (ce->getOpcode() == Instruction::GetElementPtr) {
+      std::vector<Constant*> indices;
+      for (User::op_iterator oi = ce->op_begin() + 1; oi != ce->op_end(); ++oi)
+        indices.push_back(cast<Constant>(*oi));
+      out = ConstantExpr::getGetElementPtr(base, indices,
+          cast<GEPOperator>(ce)->isInBounds());
+    } else {
+      out = ConstantExpr::getBitCast(base, mapType(ce->getType()));
+    }
+  } else if (GetElementPtrInst *gep = dyn_cast<GetElementPtrInst>(v)) {
+    IRBuilder<> builder(gep);
+    std::vector<Value*> indices(gep->idx_begin(), gep->idx_end());
+    Value *base = mapPtr(gep->getPointerOperand());
+    if (gep->isInBounds())
+      out = builder.CreateInBoundsGEP(base, indices, gep->getName());
+    else
+      out = builder.CreateGEP(base, indices, gep->getName());
+  } else if (BitCastInst *cast = dyn_cast<BitCastInst>(v)) {
+    IRBuilder<> builder(cast);
+    out = builder.CreateBitCast(mapPtr(cast->getOperand(0)),
+                                mapType(cast->getType()), cast->getName());
+  } else {
+    SelectInst *sel = llvm::cast<SelectInst>(v);
+    IRBuilder<> builder(sel);
+    out = builder.CreateSelect(sel->getCondition(),
+                               mapPtr(sel->getTrueValue()),
+                               mapPtr(sel->getFalseValue()), sel->getName());
+  }
+  mapped[v] = out;
+  return out;
+}
+
+// Convert an initializer to the storage format.
+Constant *StorageCompaction::compactConstant(Constant *c, float inv) {
+  if (c->isNullValue())
+    return Constant::getNullValue(mapType(c->getType()));
+
+  if (ArrayType *at = dyn_cast<ArrayType>(c->getType())) {
+    std::vector<Constant*> elements;
+    for (unsigned i = 0; i < at->getNumElements(); ++i)
+      elements.push_back(compactConstant(c->getAggregateElement(i), inv));
+    return ConstantArray::get(cast<ArrayType>(mapType(at)), elements);
+  }
+
+  APFloat value = cast<ConstantFP>(c)->getValueAPF();
+  bool lost;
+  value.convert(APFloat::IEEEsingle, APFloat::rmNearestTiesToEven, &lost);
+  uint64_t bits;
+  if (level == LEVEL_FIXED) {
+    float q = value.convertToFloat() * inv;
+    bits = (uint64_t)(int64_t)(q < 0 ? q - 0.5f : q + 0.5f);
+  } else if (level == LEVEL_HALF) {
+    value.convert(APFloat::IEEEhalf, APFloat::rmNearestTiesToEven, &lost);
+    bits = value.bitcastToAPInt().getZExtValue();
+  } else {
+    uint32_t fbits = value.bitcastToAPInt().getZExtValue();
+    bits = (fbits + 0x7fff + ((fbits >> 16) & 1)) >> 16;
+  }
+  return ConstantInt::get(storageTy, bits);
+}
+
+// Widen a loaded element back to the original type. The conversion is
+// tagged with the load's qualifiers (the scale is runtime state and is not).
+Value *StorageCompaction::widen(IRBuilder<> &builder, Value *v,
+                                MDNode *quals) {
+  Type *floatTy = Type::getFloatTy(module->getContext());
+  if (level == LEVEL_FIXED) {
+    Value *scale = builder.CreateLoad(
+        builder.CreateConstInBoundsGEP2_32(scaleState, 0, 0));
+    v = setQuals(builder.CreateFMul(
+        setQuals(builder.CreateSIToFP(v, floatTy), quals), scale), quals);
+  } else {
+    v = unpackFloat16(builder, v, level == LEVEL_BFLOAT, quals);
+  }
+  if (elemTy->isDoubleTy())
+    v = setQuals(builder.CreateFPExt(v, elemTy), quals);
+  return v;
+}
+
+void StorageCompaction::rewriteStore(StoreInst *store, Value *base) {
+  Type *floatTy = Type::getFloatTy(module->getContext());
+  Value *v = store->getValueOperand();
+  Value *ptr = mapPtr(store->getPointerOperand());
+  MDNode *quals = store->getMetadata("quals");
+
+  if (level != LEVEL_FIXED) {
+    IRBuilder<> builder(store);
+    if (elemTy->isDoubleTy())
+      v = setQuals(builder.CreateFPTrunc(v, floatTy), quals);
+    setQuals(builder.CreateStore(
+        packFloat16(builder, v, level == LEVEL_BFLOAT, quals), ptr), quals);
+    return;
+  }
+
+  // Fixed point: if the value is out of range, have the runtime raise the
+  // array's scale first (rescaling the elements already stored). The range
+  // check decides whether the rescale runs, so it stays untagged; only the
+  // conversion of the value itself is approximate.
+  BasicBlock *head = store->getParent();
+  BasicBlock *tail = head->splitBasicBlock(store, "compact.store");
+  BasicBlock *slow = BasicBlock::Create(module->getContext(),
+      "compact.rescale", head->getParent(), tail);
+  head->getTerminator()->eraseFromParent();
+
+  IRBuilder<> builder(head);
+  if (elemTy->isDoubleTy())
+    v = setQuals(builder.CreateFPTrunc(v, floatTy), quals);
+  Value *invPtr = builder.CreateConstInBoundsGEP2_32(scaleState, 0, 1);
+  Value *limit = ConstantFP::get(floatTy, 127.0);
+  Value *negLimit = ConstantFP::get(floatTy, -127.0);
+  Value *x = builder.CreateFMul(v, builder.CreateLoad(invPtr));
+  Value *fits = builder.CreateAnd(builder.CreateFCmpOLE(x, limit),
+                                  builder.CreateFCmpOGE(x, negLimit));
+  builder.CreateCondBr(fits, tail, slow);
+
+  builder.SetInsertPoint(slow);
+  Type *int8PtrTy = Type::getInt8PtrTy(module->getContext());
+  Type *int64Ty = Type::getInt64Ty(module->getContext());
+  Constant *rescale = module->getOrInsertFunction("accept_compact_rescale",
+      Type::getVoidTy(module->getContext()), int8PtrTy, int64Ty,
+      PointerType::getUnqual(floatTy), floatTy, NULL);
+  builder.CreateCall4(rescale, builder.CreateBitCast(base, int8PtrTy),
+                      ConstantInt::get(int64Ty, nscalars),
+                      builder.CreateConstInBoundsGEP2_32(scaleState, 0, 0),
+                      v);
+  builder.CreateBr(tail);
+
+  // Round and clamp (the clamp also catches NaNs and infinities).
+  builder.SetInsertPoint(store);
+  x = setQuals(builder.CreateFMul(v, builder.CreateLoad(invPtr)), quals);
+  x = setQuals(builder.CreateSelect(
+      setQuals(builder.CreateFCmpOGE(x, negLimit), quals), x, negLimit),
+      quals);
+  x = setQuals(builder.CreateSelect(
+      setQuals(builder.CreateFCmpOLE(x, limit), quals), x, limit), quals);
+  Value *half = setQuals(builder.CreateSelect(
+      setQuals(builder.CreateFCmpOLT(x, ConstantFP::get(floatTy, 0.0)),
+               quals),
+      ConstantFP::get(floatTy, -0.5), ConstantFP::get(floatTy, 0.5)), quals);
+  x = setQuals(builder.CreateFPToSI(
+      setQuals(builder.CreateFAdd(x, half), quals), storageTy), quals);
+  setQuals(builder.CreateStore(x, ptr), quals);
+}
+
+void StorageCompaction::rewrite(Value *base) {
+  // Merging pointers may form cycles, so their replacements are created
+  // before any other and filled in last.
+  std::vector<PHINode*> phis;
+  for (std::set<Value*>::iterator di = derived.begin(); di != derived.end();
+       ++di) {
+    if (PHINode *phi = dyn_cast<PHINode>(*di)) {
+      phis.push_back(phi);
+      mapped[phi] = PHINode::Create(mapType(phi->getType()),
+          phi->getNumIncomingValues(), phi->getName(), phi);
+    }
+  }
+
+  for (std::vector<Instruction*>::iterator ti = terminals.begin();
+       ti != terminals.end(); ++ti) {
+    Instruction *inst = *ti;
+    if (LoadInst *load = dyn_cast<LoadInst>(inst)) {
+      IRBuilder<> builder(load);
+      MDNode *quals = load->getMetadata("quals");
+      Value *v = setQuals(builder.CreateLoad(
+          mapPtr(load->getPointerOperand()), load->getName()), quals);
+      load->replaceAllUsesWith(widen(builder, v, quals));
+    } else if (StoreInst *store = dyn_cast<StoreInst>(inst)) {
+      rewriteStore(store, base);
+    } else if (ICmpInst *cmp = dyn_cast<ICmpInst>(inst)) {
+      for (unsigned i = 0; i < 2; ++i) {
+        Value *op = cmp->getOperand(i);
+        if (derived.count(op))
+          cmp->setOperand(i, mapPtr(op));
+        else
+          cmp->setOperand(i, ConstantPointerNull::get(
+              cast<PointerType>(mapType(op->getType()))));
+      }
+    } else {
+      CallInst *call = cast<CallInst>(inst);
+      call->setArgOperand(0, mapPtr(call->getArgOperand(0)));
+    }
+  }
+
+  for (std::vector<PHINode*>::iterator pi = phis.begin(); pi != phis.end();
+       ++pi) {
+    PHINode *newPhi = cast<PHINode>(mapped[*pi]);
+    for (unsigned i = 0; i < (*pi)->getNumIncomingValues(); ++i)
+      newPhi->addIncoming(mapPtr((*pi)->getIncomingValue(i)),
+                          (*pi)->getIncomingBlock(i));
+  }
+
+  // Remove the old accesses and address computations.
+  std::vector<Instruction*> dead;
+  for (std::vector<Instruction*>::iterator ti = terminals.begin();
+       ti != terminals.end(); ++ti)
+    if (isa<LoadInst>(*ti) || isa<StoreInst>(*ti))
+      dead.push_back(*ti);
+  for (std::set<Value*>::iterator di = derived.begin(); di != derived.end();
+       ++di) {
+    Instruction *inst = dyn_cast<Instruction>(*di);
+    if (inst && inst != base)
+      dead.push_back(inst);
+  }
+  for (std::vector<Instruction*>::iterator i = dead.begin(); i != dead.end();
+       ++i)
+    (*i)->dropAllReferences();
+  for (std::vector<Instruction*>::iterator i = dead.begin(); i != dead.end();
+       ++i) {
+    (*i)->replaceAllUsesWith(UndefValue::get((*i)->getType()));
+    (*i)->eraseFromParent();
+  }
+}
+
+char StorageCompaction::ID = 0;
+INITIALIZE_PASS_BEGIN(StorageCompaction, "storage", "ACCEPT storage compaction", false, false)
+INITIALIZE_PASS_DEPENDENCY(DominatorTree)
+INITIALIZE_PASS_END(StorageCompaction, "storage", "ACCEPT storage compaction", false, false)
+FunctionPass *llvm::createStorageCompactionPass() { return new StorageCompaction(); }
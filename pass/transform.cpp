@@ -20,6 +20,7 @@
 #include <fstream>
 #include <iostream>
 #include <string>
+#include <sys/stat.h>
 
 #include "accept.h"
 
@@ -81,6 +82,8 @@ bool ACCEPTPass::runOnFunction(Function &F) {
   if (shouldSkipFunc(F))
     return false;
 
+  noteAliasSite(F);
+
   bool modified = false;
   modified = modified || optimizeSync(F);
   return modified;
@@ -152,34 +155,34 @@ const char *ACCEPTPass::getPassName() const {
 /**** RELAXATION CONFIGURATION ***/
 
 void ACCEPTPass::dumpRelaxConfig() {
-  std::ofstream configFile("accept_config.txt", std::ios_base::out);
-  for (std::map<std::string, int>::iterator i = relaxConfig.begin();
-        i != relaxConfig.end(); ++i) {
-    configFile << i->second << " "
-               << i->first << "\n";
-  }
-  configFile.close();
+  relaxConfig.dumpText("accept_config.txt");
 }
 
+// Whether a was modified strictly after b, to the nanosecond where the
+// platform records it.
+static bool modifiedAfter(const struct stat &a, const struct stat &b) {
+#if defined(__APPLE__)
+  const struct timespec &ta = a.st_mtimespec, &tb = b.st_mtimespec;
+#else
+  const struct timespec &ta = a.st_mtim, &tb = b.st_mtim;
+#endif
+  if (ta.tv_sec != tb.tv_sec)
+    return ta.tv_sec > tb.tv_sec;
+  return ta.tv_nsec > tb.tv_nsec;
+}
+
+// The driver writes both formats, text first; the binary one is used only
+// when it is strictly newer, so a hand edit to the text file always wins.
 void ACCEPTPass::loadRelaxConfig() {
-  std::ifstream configFile("accept_config.txt");;
-  if (!configFile.good()) {
-    errs() << "no config file; no optimizations will occur\n";
+  struct stat binStat, textStat;
+  bool haveBin = stat("accept_config.bin", &binStat) == 0;
+  bool haveText = stat("accept_config.txt", &textStat) == 0;
+  if (haveBin && (!haveText || modifiedAfter(binStat, textStat)) &&
+      relaxConfig.loadBinary("accept_config.bin"))
     return;
-  }
-
-  while (configFile.good()) {
-    std::string ident;
-    int param;
-    configFile >> param;
-    if (!configFile.good())
-      break;
-    configFile.ignore(); // Skip space.
-    getline(configFile, ident);
-    relaxConfig[ident] = param;
-  }
 
-  configFile.close();
+  if (!relaxConfig.loadText("accept_config.txt"))
+    errs() << "no config file; no optimizations will occur\n";
 }
 
 char ACCEPTPass::ID = 0;
@@ -0,0 +1,218 @@
+// Reduced-accuracy math routines for "fastmath" sites.
+//
+// The compiler replaces approximate calls to libm functions with these.
+// Each function comes in three tiers, named accept_fast_<name>_<tier>:
+//
+//   tier 1: relative error below about 1e-8 (close to float accuracy),
+//   tier 2: relative error below about 1e-4,
+//   tier 3: relative error below about 1e-2.
+//
+// The routines reduce the argument and evaluate a short polynomial. They
+// use no tables and the tier is a constant after inlining, so each call
+// site becomes a short straight-line sequence. Arguments outside the ranges the reductions handle
+// (huge angles, non-positive logarithms, negative bases) fall back to libm.
+// This file is compiled to bitcode with optimizations and linked into the
+// program so the routines can be inlined at their call sites.
+
+#include <math.h>
+#include <stdint.h>
+
+// Always inlined, but (with GNU inline semantics, in any C dialect) also
+// emitted as external definitions for the calls the compiler substitutes.
+#define ACCEPT_MATH inline __attribute__((always_inline, gnu_inline))
+
+static const double LN2 = 0.69314718055994530942;
+static const double INV_LN2 = 1.44269504088896340736;
+static const double INV_LN10 = 0.43429448190325182765;
+static const double TWO_OVER_PI = 0.63661977236758134308;
+// pi/2 split so that k * PIO2_HI is exact for moderate k.
+static const double PIO2_HI = 1.57079632673412561417;
+static const double PIO2_LO = 6.07710050650619224932e-11;
+static const double TRIG_LIMIT = 1e5;
+
+union bits {
+    double d;
+    uint64_t u;
+};
+
+// Round to nearest integer (as a double) without a libm call.
+static inline double round_fast(double x) {
+    const double magic = 6755399441055744.0;  // 1.5 * 2^52
+    return (x + magic) - magic;
+}
+
+// e^r for |r| <= ln(2)/2.
+static inline double exp_poly(double r, int tier) {
+    if (tier == 1)
+        return 1.0 + r * (1.0 + r * (1.0 / 2 + r * (1.0 / 6 + r * (1.0 / 24 +
+               r * (1.0 / 120 + r * (1.0 / 720 + r * (1.0 / 5040 +
+               r * (1.0 / 40320))))))));
+    else if (tier == 2)
+        return 1.0 + r * (1.0 + r * (0.5 + r * (1.0 / 6 + r * (1.0 / 24))));
+    else
+        return 1.0 + r * (1.0 + r * (0.5 + r * (1.0 / 6)));
+}
+
+static inline double exp_tier(double x, int tier) {
+    union bits scale;
+    double n, r;
+
+    // Outside the range where 2^n is a normal double, overflow to infinity
+    // or underflow to zero. NaNs propagate.
+    if (x != x)
+        return x;
+    if (x > 709.0)
+        return HUGE_VAL;
+    if (x < -708.0)
+        return 0.0;
+
+    n = round_fast(x * INV_LN2);
+    r = x - n * LN2;
+    scale.u = (uint64_t)((int64_t)n + 1023) << 52;
+    return exp_poly(r, tier) * scale.d;
+}
+
+// log(m) for m in [sqrt(1/2), sqrt(2)), via log(m) = 2 atanh(s).
+static inline double log_poly(double m, int tier) {
+    double s = (m - 1.0) / (m + 1.0);
+    double s2 = s * s;
+    if (tier == 1)
+        return 2.0 * s * (1.0 + s2 * (1.0 / 3 + s2 * (1.0 / 5 +
+               s2 * (1.0 / 7 + s2 * (1.0 / 9)))));
+    else if (tier == 2)
+        return 2.0 * s * (1.0 + s2 * (1.0 / 3 + s2 * (1.0 / 5)));
+    else
+        return 2.0 * s * (1.0 + s2 * (1.0 / 3));
+}
+
+static inline double log_tier(double x, int tier) {
+    union bits in;
+    int64_t e;
+
+    if (!(x > 0.0) || x > 1.7e308)
+        return log(x);  // Zero, negative, NaN, infinity.
+    if (x < 2.3e-308)
+        return log(x);  // Subnormal.
+
+    // x = m * 2^e with m in [sqrt(1/2), sqrt(2)).
+    in.d = x;
+    e = (int64_t)(in.u >> 52) - 1023;
+    in.u = (in.u & 0x000fffffffffffffULL) | 0x3ff0000000000000ULL;
+    if (in.d > 1.41421356237309504880) {
+        in.d *= 0.5;
+        ++e;
+    }
+    return log_poly(in.d, tier) + (double)e * LN2;
+}
+
+// sin(r) and cos(r) for |r| <= pi/4.
+static inline double sin_poly(double r, int tier) {
+    double r2 = r * r;
+    if (tier == 1)
+        return r * (1.0 - r2 * (1.0 / 6 - r2 * (1.0 / 120 -
+               r2 * (1.0 / 5040 - r2 * (1.0 / 362880 -
+               r2 * (1.0 / 39916800))))));
+    else if (tier == 2)
+        return r * (1.0 - r2 * (1.0 / 6 - r2 * (1.0 / 120 -
+               r2 * (1.0 / 5040))));
+    else
+        return r * (1.0 - r2 * (1.0 / 6));
+}
+
+static inline double cos_poly(double r, int tier) {
+    double r2 = r * r;
+    if (tier == 1)
+        return 1.0 - r2 * (0.5 - r2 * (1.0 / 24 - r2 * (1.0 / 720 -
+               r2 * (1.0 / 40320 - r2 * (1.0 / 3628800 -
+               r2 * (1.0 / 479001600))))));
+    else if (tier == 2)
+        return 1.0 - r2 * (0.5 - r2 * (1.0 / 24 - r2 * (1.0 / 720)));
+    else
+        return 1.0 - r2 * (0.5 - r2 * (1.0 / 24));
+}
+
+// Reduce x to r in [-pi/4, pi/4] and the quadrant k (mod 4).
+static inline double trig_reduce(double x, int *k) {
+    double n = round_fast(x * TWO_OVER_PI);
+    *k = (int)(int64_t)n & 3;
+    return (x - n * PIO2_HI) - n * PIO2_LO;
+}
+
+static inline double sin_tier(double x, int tier) {
+    int k;
+    double r, s, c;
+    if (!(fabs(x) < TRIG_LIMIT))
+        return sin(x);
+    r = trig_reduce(x, &k);
+    s = sin_poly(r, tier);
+    c = cos_poly(r, tier);
+    switch (k) {
+    case 0: return s;
+    case 1: return c;
+    case 2: return -s;
+    default: return -c;
+    }
+}
+
+static inline double cos_tier(double x, int tier) {
+    int k;
+    double r, s, c;
+    if (!(fabs(x) < TRIG_LIMIT))
+        return cos(x);
+    r = trig_reduce(x, &k);
+    s = sin_poly(r, tier);
+    c = cos_poly(r, tier);
+    switch (k) {
+    case 0: return c;
+    case 1: return -s;
+    case 2: return -c;
+    default: return s;
+    }
+}
+
+static inline double tan_tier(double x, int tier) {
+    int k;
+    double r, s, c;
+    if (!(fabs(x) < TRIG_LIMIT))
+        return tan(x);
+    r = trig_reduce(x, &k);
+    s = sin_poly(r, tier);
+    c = cos_poly(r, tier);
+    return (k & 1) ? -c / s : s / c;
+}
+
+static inline double pow_tier(double x, double y, int tier) {
+    if (!(x > 0.0))
+        return pow(x, y);  // Zero, negative bases, NaN.
+    return exp_tier(y * log_tier(x, tier), tier);
+}
+
+// The entry points, one per function and tier.
+#define ACCEPT_FAST_UNARY(name) \
+    ACCEPT_MATH double accept_fast_##name##_1(double x) { \
+        return name##_tier(x, 1); } \
+    ACCEPT_MATH double accept_fast_##name##_2(double x) { \
+        return name##_tier(x, 2); } \
+    ACCEPT_MATH double accept_fast_##name##_3(double x) { \
+        return name##_tier(x, 3); }
+
+ACCEPT_FAST_UNARY(exp)
+ACCEPT_FAST_UNARY(log)
+ACCEPT_FAST_UNARY(sin)
+ACCEPT_FAST_UNARY(cos)
+ACCEPT_FAST_UNARY(tan)
+
+static inline double log10_tier(double x, int tier) {
+    return log_tier(x, tier) * INV_LN10;
+}
+ACCEPT_FAST_UNARY(log10)
+
+ACCEPT_MATH double accept_fast_pow_1(double x, double y) {
+    return pow_tier(x, y, 1);
+}
+ACCEPT_MATH double accept_fast_pow_2(double x, double y) {
+    return pow_tier(x, y, 2);
+}
+ACCEPT_MATH double accept_fast_pow_3(double x, double y) {
+    return pow_tier(x, y, 3);
+}
@@ -0,0 +1,1119 @@
+// Software NPU: evaluates the multilayer perceptrons that stand in for NPU
+// regions when a program is compiled with -accept-npu -accept-npu-host.
+//
+// The generated code fills iBuff with the (flattened) inputs of several
+// invocations of a region and then calls accept_npu_invoke, which runs the
+// whole batch through the region's network and leaves the outputs in oBuff.
+// Activations are kept feature-major (one row per neuron, one column per
+// invocation) so each layer is a small GEMM whose inner loop is a broadcast
+// weight times a vector of invocations.
+//
+// With -accept-npu-pipeline, the generated code calls accept_npu_invoke_async
+// instead. A per-region worker thread evaluates the batch in chunks and
+// publishes how many outputs are ready, and the generated code calls
+// accept_npu_wait before consuming each invocation's outputs. The code that
+// consumes the first chunk thus runs while later chunks are evaluated.
+//
+// accept_npu_set_precision switches a region to quantized evaluation (see
+// "Quantized evaluation" below): int16 or int8 weights and activations with
+// per-layer scales, integer dot-product kernels, and a sigmoid lookup table.
+//
+// Networks are read from accept_npu_weights.txt, which contains one record
+// per region:
+//
+//   region <name>
+//   topology <n0> <n1> ... <nk>
+//   input_offset <n0 values>     (optional; default 0)
+//   input_scale <n0 values>      (optional; default 1)
+//   output_offset <nk values>    (optional; default 0)
+//   output_scale <nk values>     (optional; default 1)
+//   weights
+//   <for each layer: n_out x n_in weights (row-major), then n_out biases>
+//   end
+//
+// Inputs are normalized as (x - offset) * scale, hidden layers use the
+// logistic sigmoid, the output layer is linear, and outputs are mapped back
+// as y * scale + offset.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NPU_X86 1
+#endif
+
+#define NPU_WEIGHTS_FILE "accept_npu_weights.txt"
+#define NPU_MAX_LAYERS 8
+#define NPU_MAX_NAME 256
+#define NPU_ALIGN 64
+#define NPU_LANES 16  // Activation rows are padded to this many floats.
+#define NPU_CHUNK 64  // Invocations per chunk in pipelined evaluation.
+#define NPU_SPINS 256  // Polls before yielding while waiting for outputs.
+
+struct npu_layer {
+    int nin;
+    int nout;
+    float *w;  // nout x nin, row-major.
+    float *b;  // nout.
+};
+
+struct npu_net {
+    char name[NPU_MAX_NAME];
+    int nlayers;
+    struct npu_layer layers[NPU_MAX_LAYERS];
+    float *in_offset, *in_scale, *out_offset, *out_scale;
+    struct npu_net *next;
+};
+
+struct npu_qlayer;
+
+struct npu_region {
+    char site[NPU_MAX_NAME];  // The region's site; buffers are per site.
+    char name[NPU_MAX_NAME];  // The replaced function; names the network.
+    int nin;
+    int nout;
+    int width;     // Widest layer.
+    int capacity;  // Invocations per batch.
+    int stride;    // Row length of the activation buffers.
+    struct npu_net *net;
+    float *ibuff;
+    float *obuff;
+    float *act[2];
+
+    // Quantized evaluation state (NPU_PREC_FLOAT if unused).
+    int precision;
+    struct npu_qlayer *qlayers;
+    uint8_t *qact[2];  // Quantized activations; see npu_qeval.
+    int32_t *qacc;     // Accumulators, one row of `stride` per neuron.
+
+    // Pipelined evaluation state.
+    int worker_started;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;  // Signaled when a batch is submitted.
+    pthread_cond_t idle;  // Signaled when the worker finishes a batch.
+    long pending;         // Invocations in the submitted batch; 0 if idle.
+    long ready;           // Invocations whose outputs are in oBuff.
+
+    struct npu_region *next;
+};
+
+typedef void (*npu_layer_fn)(const struct npu_layer *, const float *, float *,
+                             int, int, int);
+
+static struct npu_net *npu_nets = NULL;
+static struct npu_region *npu_regions = NULL;
+static int npu_loaded = 0;
+static npu_layer_fn npu_layer_impl = NULL;
+
+static void *npu_alloc(size_t n) {
+    void *p = NULL;
+    if (posix_memalign(&p, NPU_ALIGN, n ? n : NPU_ALIGN))
+        return NULL;
+    memset(p, 0, n);
+    return p;
+}
+
+static float *npu_fill(int n, float v) {
+    float *a = malloc(sizeof(float) * n);
+    int i;
+    for (i = 0; i < n; ++i)
+        a[i] = v;
+    return a;
+}
+
+static int npu_read_floats(FILE *f, float *a, int n) {
+    int i;
+    for (i = 0; i < n; ++i) {
+        if (fscanf(f, "%f", &a[i]) != 1)
+            return 0;
+    }
+    return 1;
+}
+
+
+// Weights file parsing.
+
+static struct npu_net *npu_parse_net(FILE *f) {
+    struct npu_net *net = calloc(1, sizeof(struct npu_net));
+    int sizes[NPU_MAX_LAYERS + 1];
+    int nsizes = 0;
+    char tok[NPU_MAX_NAME];
+    int l;
+
+    if (fscanf(f, "%255s", net->name) != 1)
+        goto fail;
+
+    while (fscanf(f, "%255s", tok) == 1) {
+        if (!strcmp(tok, "topology")) {
+            int c;
+            // Sizes run to the end of the line.
+            while (nsizes <= NPU_MAX_LAYERS &&
+                   fscanf(f, "%d", &sizes[nsizes]) == 1) {
+                ++nsizes;
+                while ((c = fgetc(f)) == ' ' || c == '\t') {}
+                if (c == '\n' || c == EOF)
+                    break;
+                ungetc(c, f);
+            }
+            if (nsizes < 2)
+                goto fail;
+            net->nlayers = nsizes - 1;
+            net->in_offset = npu_fill(sizes[0], 0.0f);
+            net->in_scale = npu_fill(sizes[0], 1.0f);
+            net->out_offset = npu_fill(sizes[nsizes - 1], 0.0f);
+            net->out_scale = npu_fill(sizes[nsizes - 1], 1.0f);
+        } else if (!nsizes) {
+            goto fail;
+        } else if (!strcmp(tok, "input_offset")) {
+            if (!npu_read_floats(f, net->in_offset, sizes[0]))
+                goto fail;
+        } else if (!strcmp(tok, "input_scale")) {
+            if (!npu_read_floats(f, net->in_scale, sizes[0]))
+                goto fail;
+        } else if (!strcmp(tok, "output_offset")) {
+            if (!npu_read_floats(f, net->out_offset, sizes[nsizes - 1]))
+                goto fail;
+        } else if (!strcmp(tok, "output_scale")) {
+            if (!npu_read_floats(f, net->out_scale, sizes[nsizes - 1]))
+                goto fail;
+        } else if (!strcmp(tok, "weights")) {
+            for (l = 0; l < net->nlayers; ++l) {
+                struct npu_layer *layer = &net->layers[l];
+                layer->nin = sizes[l];
+                layer->nout = sizes[l + 1];
+                layer->w = malloc(sizeof(float) * layer->nin * layer->nout);
+                layer->b = malloc(sizeof(float) * layer->nout);
+                if (!npu_read_floats(f, layer->w, layer->nin * layer->nout) ||
+                    !npu_read_floats(f, layer->b, layer->nout))
+                    goto fail;
+            }
+        } else if (!strcmp(tok, "end")) {
+            if (!net->layers[0].w)
+                goto fail;
+            return net;
+        } else {
+            goto fail;
+        }
+    }
+
+fail:
+    fprintf(stderr, "ACCEPT: malformed network in %s\n", NPU_WEIGHTS_FILE);
+    free(net);
+    return NULL;
+}
+
+static void npu_load() {
+    FILE *f;
+    char tok[NPU_MAX_NAME];
+
+    npu_loaded = 1;
+    f = fopen(NPU_WEIGHTS_FILE, "r");
+    if (!f)
+        return;
+    while (fscanf(f, "%255s", tok) == 1) {
+        struct npu_net *net;
+        if (strcmp(tok, "region"))
+            continue;
+        net = npu_parse_net(f);
+        if (!net)
+            break;
+        net->next = npu_nets;
+        npu_nets = net;
+    }
+    fclose(f);
+}
+
+
+// Layer kernels. Each computes out[j][b] = act(sum_i w[j][i] * in[i][b] +
+// bias[j]) for b < n, where rows are `stride` floats long and n has been
+// rounded up to a multiple of NPU_LANES.
+
+static float npu_sigmoid(float x) {
+    return 1.0f / (1.0f + expf(-x));
+}
+
+static void npu_layer_scalar(const struct npu_layer *l, const float *in,
+                             float *out, int n, int stride, int sigmoid) {
+    int i, j, b;
+    for (j = 0; j < l->nout; ++j) {
+        float *o = out + j * stride;
+        for (b = 0; b < n; ++b)
+            o[b] = l->b[j];
+        for (i = 0; i < l->nin; ++i) {
+            float w = l->w[j * l->nin + i];
+            const float *x = in + i * stride;
+            for (b = 0; b < n; ++b)
+                o[b] += w * x[b];
+        }
+        if (sigmoid) {
+            for (b = 0; b < n; ++b)
+                o[b] = npu_sigmoid(o[b]);
+        }
+    }
+}
+
+#ifdef NPU_X86
+
+// exp(x) for 8 floats (Cephes-style range reduction and polynomial).
+__attribute__((target("avx2,fma")))
+static __m256 npu_exp256(__m256 x) {
+    __m256 fx, y, z;
+    __m256i e;
+    x = _mm256_min_ps(x, _mm256_set1_ps(88.3762626647949f));
+    x = _mm256_max_ps(x, _mm256_set1_ps(-88.3762626647949f));
+    fx = _mm256_fmadd_ps(x, _mm256_set1_ps(1.44269504088896341f),
+                         _mm256_set1_ps(0.5f));
+    fx = _mm256_floor_ps(fx);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(0.693359375f), x);
+    x = _mm256_fnmadd_ps(fx, _mm256_set1_ps(-2.12194440e-4f), x);
+    z = _mm256_mul_ps(x, x);
+    y = _mm256_set1_ps(1.9875691500E-4f);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.3981999507E-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(8.3334519073E-3f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(4.1665795894E-2f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(1.6666665459E-1f));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(5.0000001201E-1f));
+    y = _mm256_fmadd_ps(y, z, _mm256_add_ps(x, _mm256_set1_ps(1.0f)));
+    e = _mm256_cvttps_epi32(fx);
+    e = _mm256_slli_epi32(_mm256_add_epi32(e, _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(e));
+}
+
+__attribute__((target("avx2,fma")))
+static void npu_layer_avx2(const struct npu_layer *l, const float *in,
+                           float *out, int n, int stride, int sigmoid) {
+    const __m256 one = _mm256_set1_ps(1.0f);
+    int i, j, b;
+    for (j = 0; j < l->nout; ++j) {
+        const float *w = l->w + j * l->nin;
+        float *o = out + j * stride;
+        for (b = 0; b < n; b += 8) {
+            __m256 acc = _mm256_set1_ps(l->b[j]);
+            for (i = 0; i < l->nin; ++i)
+                acc = _mm256_fmadd_ps(_mm256_set1_ps(w[i]),
+                                      _mm256_load_ps(in + i * stride + b),
+                                      acc);
+            if (sigmoid) {
+                __m256 ex = npu_exp256(_mm256_sub_ps(_mm256_setzero_ps(), acc));
+                acc = _mm256_div_ps(one, _mm256_add_ps(one, ex));
+            }
+            _mm256_store_ps(o + b, acc);
+        }
+    }
+}
+
+#ifndef ACCEPT_NPU_NO_AVX512
+
+__attribute__((target("avx512f")))
+static __m512 npu_exp512(__m512 x) {
+    __m512 fx, y, z;
+    __m512i e;
+    x = _mm512_min_ps(x, _mm512_set1_ps(88.3762626647949f));
+    x = _mm512_max_ps(x, _mm512_set1_ps(-88.3762626647949f));
+    fx = _mm512_fmadd_ps(x, _mm512_set1_ps(1.44269504088896341f),
+                         _mm512_set1_ps(0.5f));
+    fx = _mm512_roundscale_ps(fx, _MM_FROUND_TO_NEG_INF | _MM_FROUND_NO_EXC);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(0.693359375f), x);
+    x = _mm512_fnmadd_ps(fx, _mm512_set1_ps(-2.12194440e-4f), x);
+    z = _mm512_mul_ps(x, x);
+    y = _mm512_set1_ps(1.9875691500E-4f);
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.3981999507E-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(8.3334519073E-3f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(4.1665795894E-2f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(1.6666665459E-1f));
+    y = _mm512_fmadd_ps(y, x, _mm512_set1_ps(5.0000001201E-1f));
+    y = _mm512_fmadd_ps(y, z, _mm512_add_ps(x, _mm512_set1_ps(1.0f)));
+    e = _mm512_cvttps_epi32(fx);
+    e = _mm512_slli_epi32(_mm512_add_epi32(e, _mm512_set1_epi32(127)), 23);
+    return _mm512_mul_ps(y, _mm512_castsi512_ps(e));
+}
+
+__attribute__((target("avx512f")))
+static void npu_layer_avx512(const struct npu_layer *l, const float *in,
+                             float *out, int n, int stride, int sigmoid) {
+    const __m512 one = _mm512_set1_ps(1.0f);
+    int i, j, b;
+    for (j = 0; j < l->nout; ++j) {
+        const float *w = l->w + j * l->nin;
+        float *o = out + j * stride;
+        for (b = 0; b < n; b += 16) {
+            __m512 acc = _mm512_set1_ps(l->b[j]);
+            for (i = 0; i < l->nin; ++i)
+                acc = _mm512_fmadd_ps(_mm512_set1_ps(w[i]),
+                                      _mm512_load_ps(in + i * stride + b),
+                                      acc);
+            if (sigmoid) {
+                __m512 ex = npu_exp512(_mm512_sub_ps(_mm512_setzero_ps(), acc));
+                acc = _mm512_div_ps(one, _mm512_add_ps(one, ex));
+            }
+            _mm512_store_ps(o + b, acc);
+        }
+    }
+}
+
+#endif  // ACCEPT_NPU_NO_AVX512
+#endif  // NPU_X86
+
+static npu_layer_fn npu_select_layer() {
+#ifdef NPU_X86
+    __builtin_cpu_init();
+#ifndef ACCEPT_NPU_NO_AVX512
+    if (__builtin_cpu_supports("avx512f"))
+        return npu_layer_avx512;
+#endif
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return npu_layer_avx2;
+#endif
+    return npu_layer_scalar;
+}
+
+
+// Quantized evaluation. Each layer's weights are quantized with a single
+// scale (the largest weight maps to the largest integer), and each batch of
+// normalized inputs with a scale chosen from its largest magnitude. Hidden
+// layers map the dequantized pre-activation through a sigmoid table whose
+// entries are already quantized activations, so activations stay integers
+// from layer to layer; only the linear output layer is produced as floats.
+//
+// Activations are stored feature-major like the float path, but with the
+// inputs of each invocation interleaved in groups: quads of bytes for int8
+// and pairs of int16s for int16, so that each 32-bit lane holds one group of
+// one invocation. A layer is then a sequence of group dot products against
+// a broadcast group of weights: vpdpbusd (AVX-512 VNNI) or pmaddubsw +
+// pmaddwd (AVX2) for int8, and pmaddwd for int16.
+//
+// Ranges are chosen so that no instruction saturates and int32
+// accumulators cannot overflow for the small networks used here: int8
+// activations are 7-bit (0..127, inputs offset by 64) against 8-bit
+// weights, and int16 activations and weights are 12-bit.
+
+enum { NPU_PREC_FLOAT = 0, NPU_PREC_INT16 = 1, NPU_PREC_INT8 = 2 };
+
+#define NPU_Q8_ACT 127
+#define NPU_Q8_IN 63
+#define NPU_Q8_ZERO 64
+#define NPU_Q8_WEIGHT 127
+#define NPU_Q16_ACT 2047
+#define NPU_Q16_WEIGHT 2047
+#define NPU_LUT_SIZE 2048
+#define NPU_LUT_RANGE 8.0f  // The sigmoid table covers [-8, 8).
+
+struct npu_qlayer {
+    int nin;
+    int nout;
+    int ngroups;     // Groups of inputs per neuron.
+    uint8_t *w;      // nout x ngroups groups of 4 bytes, zero-padded.
+    int32_t *wsum;   // Sum of each neuron's quantized weights.
+    float wscale;    // Weight = quantized weight * wscale.
+    const float *b;
+};
+
+typedef void (*npu_qdot_fn)(const struct npu_qlayer *, const uint8_t *,
+                            int32_t *, int, int);
+typedef void (*npu_qact_fn)(const struct npu_qlayer *, const int32_t *,
+                            float, int32_t, int, uint8_t *, int, int);
+
+// Quantized sigmoid tables for int8 and int16 activations.
+static int32_t npu_lut[2][NPU_LUT_SIZE];
+static npu_qdot_fn npu_qdot8_impl = NULL;
+static npu_qdot_fn npu_qdot16_impl = NULL;
+static npu_qact_fn npu_qact_impl = NULL;
+
+static int32_t npu_group(const struct npu_qlayer *l, int j, int g) {
+    int32_t v;
+    memcpy(&v, l->w + 4 * (j * l->ngroups + g), 4);
+    return v;
+}
+
+// Dot-product kernels. Each computes acc[j][b] = sum over groups g of
+// act[g][b] . w[j][g] for b < n (a multiple of NPU_LANES).
+
+static void npu_qdot8_scalar(const struct npu_qlayer *l, const uint8_t *act,
+                             int32_t *acc, int n, int stride) {
+    int j, g, b, k;
+    for (j = 0; j < l->nout; ++j) {
+        for (b = 0; b < n; ++b) {
+            int32_t sum = 0;
+            for (g = 0; g < l->ngroups; ++g) {
+                const int8_t *w = (const int8_t *)l->w + 4 * (j * l->ngroups + g);
+                const uint8_t *a = act + 4 * (g * stride + b);
+                for (k = 0; k < 4; ++k)
+                    sum += a[k] * w[k];
+            }
+            acc[j * stride + b] = sum;
+        }
+    }
+}
+
+static void npu_qdot16_scalar(const struct npu_qlayer *l, const uint8_t *act,
+                              int32_t *acc, int n, int stride) {
+    int j, g, b, k;
+    for (j = 0; j < l->nout; ++j) {
+        for (b = 0; b < n; ++b) {
+            int32_t sum = 0;
+            for (g = 0; g < l->ngroups; ++g) {
+                int16_t w[2], a[2];
+                memcpy(w, l->w + 4 * (j * l->ngroups + g), 4);
+                memcpy(a, act + 4 * (g * stride + b), 4);
+                for (k = 0; k < 2; ++k)
+                    sum += a[k] * w[k];
+            }
+            acc[j * stride + b] = sum;
+        }
+    }
+}
+
+static int npu_lut_index(float z) {
+    float t = (z + NPU_LUT_RANGE) * (NPU_LUT_SIZE / (2.0f * NPU_LUT_RANGE));
+    if (t < 0.0f)
+        return 0;
+    if (t > NPU_LUT_SIZE - 1)
+        return NPU_LUT_SIZE - 1;
+    return (int)t;
+}
+
+// Activation kernels. Each dequantizes a hidden layer's accumulators
+// (removing the input zero point, scaling, and adding the bias), maps them
+// through the sigmoid table, and writes the quantized activations in the
+// next layer's grouped layout.
+
+static void npu_qact_scalar(const struct npu_qlayer *l, const int32_t *acc,
+                            float scale, int32_t zero, int int8,
+                            uint8_t *next, int n, int stride) {
+    const int32_t *lut = npu_lut[int8 ? 0 : 1];
+    int per_group = int8 ? 4 : 2;
+    int j, b;
+    for (j = 0; j < l->nout; ++j) {
+        const int32_t *a = acc + j * stride;
+        int32_t offset = zero * l->wsum[j];
+        uint8_t *group = next + 4 * (j / per_group) * stride;
+        for (b = 0; b < n; ++b) {
+            int32_t v = lut[npu_lut_index((a[b] - offset) * scale + l->b[j])];
+            if (int8) {
+                group[4 * b + j % 4] = (uint8_t)v;
+            } else {
+                int16_t h = (int16_t)v;
+                memcpy(group + 4 * b + 2 * (j % 2), &h, 2);
+            }
+        }
+    }
+}
+
+#ifdef NPU_X86
+
+__attribute__((target("avx2,fma")))
+static void npu_qact_avx2(const struct npu_qlayer *l, const int32_t *acc,
+                          float scale, int32_t zero, int int8,
+                          uint8_t *next, int n, int stride) {
+    const int32_t *lut = npu_lut[int8 ? 0 : 1];
+    const __m256 lo = _mm256_setzero_ps();
+    const __m256 hi = _mm256_set1_ps(NPU_LUT_SIZE - 1);
+    const __m256 k = _mm256_set1_ps(NPU_LUT_SIZE / (2.0f * NPU_LUT_RANGE));
+    int per_group = int8 ? 4 : 2;
+    int bits = int8 ? 8 : 16;
+    int ngroups = (l->nout + per_group - 1) / per_group;
+    int g, j, b;
+
+    for (g = 0; g < ngroups; ++g) {
+        for (b = 0; b < n; b += 8) {
+            __m256i packed = _mm256_setzero_si256();
+            for (j = g * per_group; j < l->nout && j < (g + 1) * per_group; ++j) {
+                __m256i a = _mm256_load_si256((const __m256i *)(acc + j * stride + b));
+                __m256 z = _mm256_cvtepi32_ps(_mm256_sub_epi32(
+                    a, _mm256_set1_epi32(zero * l->wsum[j])));
+                z = _mm256_fmadd_ps(z, _mm256_set1_ps(scale),
+                                    _mm256_set1_ps(l->b[j] + NPU_LUT_RANGE));
+                z = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(z, k), lo), hi);
+                __m256i v = _mm256_i32gather_epi32(lut, _mm256_cvttps_epi32(z), 4);
+                packed = _mm256_or_si256(packed, _mm256_sll_epi32(
+                    v, _mm_cvtsi32_si128((j % per_group) * bits)));
+            }
+            _mm256_store_si256((__m256i *)(next + 4 * (g * stride + b)), packed);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void npu_qdot8_avx2(const struct npu_qlayer *l, const uint8_t *act,
+                           int32_t *acc, int n, int stride) {
+    const __m256i ones = _mm256_set1_epi16(1);
+    int j, g, b;
+    for (j = 0; j < l->nout; ++j) {
+        for (b = 0; b < n; b += 8) {
+            __m256i sum = _mm256_setzero_si256();
+            for (g = 0; g < l->ngroups; ++g) {
+                __m256i a = _mm256_load_si256(
+                    (const __m256i *)(act + 4 * (g * stride + b)));
+                __m256i w = _mm256_set1_epi32(npu_group(l, j, g));
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(
+                    _mm256_maddubs_epi16(a, w), ones));
+            }
+            _mm256_store_si256((__m256i *)(acc + j * stride + b), sum);
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void npu_qdot16_avx2(const struct npu_qlayer *l, const uint8_t *act,
+                            int32_t *acc, int n, int stride) {
+    int j, g, b;
+    for (j = 0; j < l->nout; ++j) {
+        for (b = 0; b < n; b += 8) {
+            __m256i sum = _mm256_setzero_si256();
+            for (g = 0; g < l->ngroups; ++g) {
+                __m256i a = _mm256_load_si256(
+                    (const __m256i *)(act + 4 * (g * stride + b)));
+                __m256i w = _mm256_set1_epi32(npu_group(l, j, g));
+                sum = _mm256_add_epi32(sum, _mm256_madd_epi16(a, w));
+            }
+            _mm256_store_si256((__m256i *)(acc + j * stride + b), sum);
+        }
+    }
+}
+
+#ifndef ACCEPT_NPU_NO_AVX512
+
+__attribute__((target("avx512f,avx512vnni")))
+static void npu_qdot8_vnni(const struct npu_qlayer *l, const uint8_t *act,
+                           int32_t *acc, int n, int stride) {
+    int j, g, b;
+    for (j = 0; j < l->nout; ++j) {
+        for (b = 0; b < n; b += 16) {
+            __m512i sum = _mm512_setzero_si512();
+            for (g = 0; g < l->ngroups; ++g) {
+                __m512i a = _mm512_load_si512(act + 4 * (g * stride + b));
+                __m512i w = _mm512_set1_epi32(npu_group(l, j, g));
+                sum = _mm512_dpbusd_epi32(sum, a, w);
+            }
+            _mm512_store_si512(acc + j * stride + b, sum);
+        }
+    }
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void npu_qdot16_avx512(const struct npu_qlayer *l, const uint8_t *act,
+                              int32_t *acc, int n, int stride) {
+    int j, g, b;
+    for (j = 0; j < l->nout; ++j) {
+        for (b = 0; b < n; b += 16) {
+            __m512i sum = _mm512_setzero_si512();
+            for (g = 0; g < l->ngroups; ++g) {
+                __m512i a = _mm512_load_si512(act + 4 * (g * stride + b));
+                __m512i w = _mm512_set1_epi32(npu_group(l, j, g));
+                sum = _mm512_add_epi32(sum, _mm512_madd_epi16(a, w));
+            }
+            _mm512_store_si512(acc + j * stride + b, sum);
+        }
+    }
+}
+
+#endif  // ACCEPT_NPU_NO_AVX512
+#endif  // NPU_X86
+
+static void npu_select_qdot() {
+    npu_qdot8_impl = npu_qdot8_scalar;
+    npu_qdot16_impl = npu_qdot16_scalar;
+    npu_qact_impl = npu_qact_scalar;
+#ifdef NPU_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        npu_qdot8_impl = npu_qdot8_avx2;
+        npu_qdot16_impl = npu_qdot16_avx2;
+        if (__builtin_cpu_supports("fma"))
+            npu_qact_impl = npu_qact_avx2;
+    }
+#ifndef ACCEPT_NPU_NO_AVX512
+    if (__builtin_cpu_supports("avx512vnni"))
+        npu_qdot8_impl = npu_qdot8_vnni;
+    if (__builtin_cpu_supports("avx512bw"))
+        npu_qdot16_impl = npu_qdot16_avx512;
+#endif
+#endif
+}
+
+static void npu_build_luts() {
+    int i;
+    for (i = 0; i < NPU_LUT_SIZE; ++i) {
+        float x = ((i + 0.5f) / NPU_LUT_SIZE * 2.0f - 1.0f) * NPU_LUT_RANGE;
+        float y = npu_sigmoid(x);
+        npu_lut[0][i] = lrintf(y * NPU_Q8_ACT);
+        npu_lut[1][i] = lrintf(y * NPU_Q16_ACT);
+    }
+}
+
+// Round to the nearest integer; exact for |x| < 2^22 and, unlike lrintf,
+// vectorizable.
+static int32_t npu_round(float x) {
+    float y = x + 12582912.0f;  // 1.5 * 2^23
+    int32_t bits;
+    memcpy(&bits, &y, 4);
+    return bits - 0x4B400000;
+}
+
+// Quantize the network's weights for the region's precision.
+static struct npu_qlayer *npu_quantize(const struct npu_net *net,
+                                       int precision) {
+    struct npu_qlayer *qlayers = calloc(net->nlayers,
+                                        sizeof(struct npu_qlayer));
+    int per_group = precision == NPU_PREC_INT8 ? 4 : 2;
+    float qmax = precision == NPU_PREC_INT8 ? NPU_Q8_WEIGHT : NPU_Q16_WEIGHT;
+    int l, i, j;
+
+    for (l = 0; l < net->nlayers; ++l) {
+        const struct npu_layer *layer = &net->layers[l];
+        struct npu_qlayer *q = &qlayers[l];
+        float maxw = 0.0f;
+
+        q->nin = layer->nin;
+        q->nout = layer->nout;
+        q->ngroups = (layer->nin + per_group - 1) / per_group;
+        q->w = npu_alloc(4 * q->ngroups * q->nout);
+        q->wsum = calloc(q->nout, sizeof(int32_t));
+        q->b = layer->b;
+
+        for (i = 0; i < layer->nin * layer->nout; ++i) {
+            if (fabsf(layer->w[i]) > maxw)
+                maxw = fabsf(layer->w[i]);
+        }
+        q->wscale = maxw > 0.0f ? maxw / qmax : 1.0f;
+
+        for (j = 0; j < layer->nout; ++j) {
+            uint8_t *row = q->w + 4 * q->ngroups * j;
+            for (i = 0; i < layer->nin; ++i) {
+                long v = lrintf(layer->w[j * layer->nin + i] / q->wscale);
+                q->wsum[j] += v;
+                if (precision == NPU_PREC_INT8) {
+                    row[i] = (uint8_t)(int8_t)v;
+                } else {
+                    int16_t h = (int16_t)v;
+                    memcpy(row + 2 * i, &h, 2);
+                }
+            }
+        }
+    }
+    return qlayers;
+}
+
+// Evaluate the network on the normalized inputs in `in` (feature-major
+// floats, as in the float path), leaving the outputs in `out`.
+static void npu_qeval(struct npu_region *r, const float *in, float *out,
+                      long count, int n) {
+    const struct npu_net *net = r->net;
+    int int8 = r->precision == NPU_PREC_INT8;
+    int per_group = int8 ? 4 : 2;
+    int stride = r->stride;
+    uint8_t *act = r->qact[0];
+    uint8_t *next = r->qact[1];
+    uint8_t *tmp;
+    float maxin = 0.0f, xscale, inv;
+    int32_t zero;
+    int g, i, j, l;
+    long b;
+
+    // Quantize the inputs with a scale for the whole batch.
+    for (i = 0; i < r->nin; ++i) {
+        const float *x = in + i * stride;
+        for (b = 0; b < count; ++b)
+            maxin = fabsf(x[b]) > maxin ? fabsf(x[b]) : maxin;
+    }
+    xscale = maxin > 0.0f ? maxin / (int8 ? NPU_Q8_IN : NPU_Q16_ACT) : 1.0f;
+    inv = 1.0f / xscale;
+    zero = int8 ? NPU_Q8_ZERO : 0;
+    for (g = 0; g < (r->nin + per_group - 1) / per_group; ++g) {
+        // Each invocation's group is written as one little-endian word.
+        uint32_t *group = (uint32_t *)(act + 4 * g * stride);
+        int bits = int8 ? 8 : 16;
+        uint32_t mask = int8 ? 0xff : 0xffff;
+        for (b = 0; b < count; ++b)
+            group[b] = 0;
+        for (i = g * per_group; i < r->nin && i < (g + 1) * per_group; ++i) {
+            const float *x = in + i * stride;
+            int shift = (i % per_group) * bits;
+            for (b = 0; b < count; ++b)
+                group[b] |= ((uint32_t)(npu_round(x[b] * inv) + zero) & mask)
+                            << shift;
+        }
+    }
+
+    for (l = 0; l < net->nlayers; ++l) {
+        const struct npu_qlayer *q = &r->qlayers[l];
+        float scale = xscale * q->wscale;
+
+        (int8 ? npu_qdot8_impl : npu_qdot16_impl)(q, act, r->qacc, n, stride);
+
+        if (l == net->nlayers - 1) {
+            // The output layer is linear.
+            for (j = 0; j < q->nout; ++j) {
+                const int32_t *acc = r->qacc + j * stride;
+                float *o = out + j * stride;
+                float bias = q->b[j] - zero * q->wsum[j] * scale;
+                for (b = 0; b < n; ++b)
+                    o[b] = acc[b] * scale + bias;
+            }
+            break;
+        }
+
+        npu_qact_impl(q, r->qacc, scale, zero, int8, next, n, stride);
+
+        // Hidden activations are quantized sigmoid outputs.
+        xscale = 1.0f / (int8 ? NPU_Q8_ACT : NPU_Q16_ACT);
+        zero = 0;
+        tmp = act;
+        act = next;
+        next = tmp;
+    }
+}
+
+// Interface used by the generated code.
+
+// Each site (loop) replacing a function gets its own region, since sites
+// choose their buffer sizes (and precisions) independently. Sites
+// replacing the same function share its network.
+void *accept_npu_open(const char *site, const char *name, int nin, int nout,
+                      int bufsize) {
+    struct npu_region *r;
+    struct npu_net *net;
+    int width, l;
+
+    for (r = npu_regions; r; r = r->next) {
+        if (!strcmp(r->site, site))
+            return r;
+    }
+
+    if (!npu_loaded) {
+        npu_load();
+        npu_layer_impl = npu_select_layer();
+    }
+
+    r = calloc(1, sizeof(struct npu_region));
+    strncpy(r->site, site, NPU_MAX_NAME - 1);
+    strncpy(r->name, name, NPU_MAX_NAME - 1);
+    r->nin = nin;
+    r->nout = nout;
+    r->capacity = nin ? (bufsize + nin - 1) / nin : bufsize;
+    if (r->capacity < 1)
+        r->capacity = 1;
+    r->stride = (r->capacity + NPU_LANES - 1) / NPU_LANES * NPU_LANES;
+
+    for (net = npu_nets; net; net = net->next) {
+        if (!strcmp(net->name, name))
+            break;
+    }
+    if (!net) {
+        fprintf(stderr, "ACCEPT: no network for NPU region %s\n", name);
+    } else if (net->layers[0].nin != nin ||
+               net->layers[net->nlayers - 1].nout != nout) {
+        fprintf(stderr, "ACCEPT: network for NPU region %s has the wrong "
+                "topology\n", name);
+        net = NULL;
+    }
+    r->net = net;
+
+    // Activation buffers hold the widest layer.
+    width = nin > nout ? nin : nout;
+    if (net) {
+        for (l = 0; l < net->nlayers; ++l) {
+            if (net->layers[l].nout > width)
+                width = net->layers[l].nout;
+        }
+    }
+    r->ibuff = npu_alloc(sizeof(float) * (r->capacity + 1) * (nin ? nin : 1));
+    r->obuff = npu_alloc(sizeof(float) * (r->capacity + 1) * (nout ? nout : 1));
+    r->act[0] = npu_alloc(sizeof(float) * width * r->stride);
+    r->act[1] = npu_alloc(sizeof(float) * width * r->stride);
+    r->width = width;
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    pthread_cond_init(&r->idle, NULL);
+
+    r->next = npu_regions;
+    npu_regions = r;
+    return r;
+}
+
+float *accept_npu_ibuff(void *handle) {
+    return ((struct npu_region *)handle)->ibuff;
+}
+
+float *accept_npu_obuff(void *handle) {
+    return ((struct npu_region *)handle)->obuff;
+}
+
+// Select the region's precision: 0 for float, 1 for int16, 2 for int8.
+// Called on every entry to the site's loop. Each site has its own region,
+// so the precision only changes (and the network is only re-quantized)
+// the first time.
+void accept_npu_set_precision(void *handle, int precision) {
+    struct npu_region *r = handle;
+    int l;
+
+    if (precision < NPU_PREC_FLOAT || precision > NPU_PREC_INT8)
+        precision = NPU_PREC_INT8;
+    if (precision == r->precision || !r->net)
+        return;
+
+    if (!npu_qdot8_impl) {
+        npu_select_qdot();
+        npu_build_luts();
+    }
+    if (r->qlayers) {
+        for (l = 0; l < r->net->nlayers; ++l) {
+            free(r->qlayers[l].w);
+            free(r->qlayers[l].wsum);
+        }
+        free(r->qlayers);
+        r->qlayers = NULL;
+    }
+    r->precision = precision;
+    if (precision == NPU_PREC_FLOAT)
+        return;
+
+    r->qlayers = npu_quantize(r->net, precision);
+    if (!r->qact[0]) {
+        // Groups of up to four inputs, 4 bytes per group and invocation.
+        size_t size = 4 * ((r->width + 1) / 2) * (size_t)r->stride;
+        r->qact[0] = npu_alloc(size);
+        r->qact[1] = npu_alloc(size);
+        r->qacc = npu_alloc(sizeof(int32_t) * r->width * r->stride);
+    }
+}
+
+// Evaluate the `count` buffered invocations starting at `start`.
+static void npu_eval(struct npu_region *r, long start, long count) {
+    struct npu_net *net = r->net;
+    const float *ibuff = r->ibuff + start * r->nin;
+    float *obuff = r->obuff + start * r->nout;
+    float *in, *out, *tmp;
+    int n, i, b, l;
+
+    if (!net) {
+        memset(obuff, 0, sizeof(float) * count * r->nout);
+        return;
+    }
+    n = (count + NPU_LANES - 1) / NPU_LANES * NPU_LANES;
+
+    // Transpose and normalize the inputs.
+    in = r->act[0];
+    out = r->act[1];
+    for (b = 0; b < count; ++b) {
+        for (i = 0; i < r->nin; ++i)
+            in[i * r->stride + b] = (ibuff[b * r->nin + i] -
+                                     net->in_offset[i]) * net->in_scale[i];
+    }
+
+    if (r->precision != NPU_PREC_FLOAT) {
+        npu_qeval(r, in, out, count, n);
+        in = out;
+    } else {
+        for (l = 0; l < net->nlayers; ++l) {
+            npu_layer_impl(&net->layers[l], in, out, n, r->stride,
+                           l != net->nlayers - 1);
+            tmp = in;
+            in = out;
+            out = tmp;
+        }
+    }
+
+    // Transpose and scale the outputs.
+    for (b = 0; b < count; ++b) {
+        for (i = 0; i < r->nout; ++i)
+            obuff[b * r->nout + i] = in[i * r->stride + b] *
+                                     net->out_scale[i] + net->out_offset[i];
+    }
+}
+
+// Evaluate `count` buffered invocations.
+void accept_npu_invoke(void *handle, long count) {
+    struct npu_region *r = handle;
+    if (count > r->capacity)
+        count = r->capacity;
+    npu_eval(r, 0, count);
+}
+
+static void *npu_worker(void *arg) {
+    struct npu_region *r = arg;
+    long count, start, n;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (!r->pending)
+            pthread_cond_wait(&r->wake, &r->lock);
+        count = r->pending;
+        pthread_mutex_unlock(&r->lock);
+
+        for (start = 0; start < count; start += n) {
+            n = count - start < NPU_CHUNK ? count - start : NPU_CHUNK;
+            npu_eval(r, start, n);
+            __atomic_store_n(&r->ready, start + n, __ATOMIC_RELEASE);
+        }
+
+        pthread_mutex_lock(&r->lock);
+        r->pending = 0;
+        pthread_cond_broadcast(&r->idle);
+    }
+    return NULL;
+}
+
+// Start evaluating `count` buffered invocations on the region's worker
+// thread. The outputs of invocation i may be read once accept_npu_wait(i)
+// returns.
+void accept_npu_invoke_async(void *handle, long count) {
+    struct npu_region *r = handle;
+
+    if (count > r->capacity)
+        count = r->capacity;
+
+    // Small batches and regions without a network are not worth the
+    // hand-off; evaluate them directly.
+    if (count <= NPU_CHUNK || !r->net) {
+        npu_eval(r, 0, count);
+        __atomic_store_n(&r->ready, count, __ATOMIC_RELEASE);
+        return;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if (!r->worker_started) {
+        if (pthread_create(&r->worker, NULL, npu_worker, r)) {
+            pthread_mutex_unlock(&r->lock);
+            npu_eval(r, 0, count);
+            __atomic_store_n(&r->ready, count, __ATOMIC_RELEASE);
+            return;
+        }
+        pthread_detach(r->worker);
+        r->worker_started = 1;
+    }
+
+    // The previous batch's outputs have all been consumed, but the worker
+    // may not have gone idle yet.
+    while (r->pending)
+        pthread_cond_wait(&r->idle, &r->lock);
+    __atomic_store_n(&r->ready, 0, __ATOMIC_RELAXED);
+    r->pending = count;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Wait until the outputs of buffered invocation `index` are available.
+void accept_npu_wait(void *handle, long index) {
+    struct npu_region *r = handle;
+    int spins = 0;
+
+    while (__atomic_load_n(&r->ready, __ATOMIC_ACQUIRE) <= index) {
+        if (++spins < NPU_SPINS) {
+#ifdef NPU_X86
+            _mm_pause();
+#endif
+        } else {
+            sched_yield();
+        }
+    }
+}
+
+
+// Trace capture for training (-accept-npu-trace). Samples are streamed to
+// accept_npu_trace.bin, which consists of a header followed by records, all
+// little-endian:
+//
+//   header: "ANPT" <u32 version>
+//   region: 'R' <u16 id> <u16 nin> <u16 nout> <u16 name length> <name>
+//   sample: 'S' <u16 id> <(nin + nout) f32 values>
+//
+// A region record precedes the region's first sample. At most
+// ACCEPT_NPU_TRACE_MAX (default 100000) samples are kept per region.
+
+#define NPU_TRACE_FILE "accept_npu_trace.bin"
+#define NPU_TRACE_VERSION 1
+#define NPU_TRACE_DEFAULT_MAX 100000
+
+struct npu_trace_region {
+    char name[NPU_MAX_NAME];
+    unsigned short id;
+    unsigned short nin;
+    unsigned short nout;
+    long samples;
+    struct npu_trace_region *next;
+};
+
+static FILE *npu_trace_file = NULL;
+static struct npu_trace_region *npu_trace_regions = NULL;
+static unsigned short npu_trace_count = 0;
+static long npu_trace_max = NPU_TRACE_DEFAULT_MAX;
+
+static void npu_trace_close() {
+    if (npu_trace_file)
+        fclose(npu_trace_file);
+    npu_trace_file = NULL;
+}
+
+static void npu_trace_u16(unsigned short v) {
+    unsigned char b[2];
+    b[0] = v & 0xff;
+    b[1] = v >> 8;
+    fwrite(b, 1, 2, npu_trace_file);
+}
+
+void *accept_npu_trace_open(const char *name, int nin, int nout) {
+    struct npu_trace_region *r;
+    size_t len;
+
+    for (r = npu_trace_regions; r; r = r->next) {
+        if (!strcmp(r->name, name))
+            return r;
+    }
+
+    if (!npu_trace_file) {
+        const char *max = getenv("ACCEPT_NPU_TRACE_MAX");
+        unsigned char version[4] = {NPU_TRACE_VERSION, 0, 0, 0};
+        if (max)
+            npu_trace_max = atol(max);
+        npu_trace_file = fopen(NPU_TRACE_FILE, "wb");
+        if (!npu_trace_file) {
+            perror("ACCEPT: " NPU_TRACE_FILE);
+            exit(1);
+        }
+        setvbuf(npu_trace_file, NULL, _IOFBF, 1 << 20);
+        fwrite("ANPT", 1, 4, npu_trace_file);
+        fwrite(version, 1, 4, npu_trace_file);
+        atexit(npu_trace_close);
+    }
+
+    r = calloc(1, sizeof(struct npu_trace_region));
+    strncpy(r->name, name, NPU_MAX_NAME - 1);
+    r->id = npu_trace_count++;
+    r->nin = nin;
+    r->nout = nout;
+    r->next = npu_trace_regions;
+    npu_trace_regions = r;
+
+    len = strlen(r->name);
+    fputc('R', npu_trace_file);
+    npu_trace_u16(r->id);
+    npu_trace_u16(r->nin);
+    npu_trace_u16(r->nout);
+    npu_trace_u16(len);
+    fwrite(r->name, 1, len, npu_trace_file);
+    return r;
+}
+
+void accept_npu_trace(void *handle, const float *values) {
+    struct npu_trace_region *r = handle;
+    int i;
+
+    if (r->samples >= npu_trace_max)
+        return;
+    ++r->samples;
+
+    fputc('S', npu_trace_file);
+    npu_trace_u16(r->id);
+    for (i = 0; i < r->nin + r->nout; ++i) {
+        // Values are written in the host's byte order, assumed little-endian.
+        fwrite(&values[i], sizeof(float), 1, npu_trace_file);
+    }
+}
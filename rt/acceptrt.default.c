@@ -21,3 +21,506 @@ void accept_roi_end() {
     fprintf(f, "%f\n", delta);
     fclose(f);
 }
+
+// Contention profiling for lock and barrier sites (-accept-sync-profile).
+// Each thread accumulates wait and hold times in its own table, keyed by the
+// site name string emitted by the compiler. The tables are linked into a
+// global list so they can be merged and written out when the program exits.
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SYNCPROF_SITES 256
+
+struct syncprof_entry {
+    const char *site;
+    unsigned long long wait;  // Microseconds.
+    unsigned long long hold;
+    unsigned long long count;
+};
+
+struct syncprof_table {
+    struct syncprof_entry entries[SYNCPROF_SITES];
+    struct syncprof_table *next;
+};
+
+static struct syncprof_table *syncprof_tables = NULL;
+static __thread struct syncprof_table *syncprof_local = NULL;
+static int syncprof_registered = 0;
+
+static void syncprof_dump() {
+    FILE *f = fopen("accept_syncprof.txt", "w");
+    struct syncprof_table *t;
+    struct syncprof_table merged;
+    int i, j;
+
+    // Merge the per-thread tables by site name.
+    memset(&merged, 0, sizeof(merged));
+    for (t = syncprof_tables; t; t = t->next) {
+        for (i = 0; i < SYNCPROF_SITES; ++i) {
+            struct syncprof_entry *e = &t->entries[i];
+            if (!e->site)
+                continue;
+            for (j = 0; j < SYNCPROF_SITES; ++j) {
+                if (!merged.entries[j].site ||
+                        !strcmp(merged.entries[j].site, e->site))
+                    break;
+            }
+            if (j == SYNCPROF_SITES)
+                continue;
+            merged.entries[j].site = e->site;
+            merged.entries[j].wait += e->wait;
+            merged.entries[j].hold += e->hold;
+            merged.entries[j].count += e->count;
+        }
+    }
+
+    // One line per site: wait seconds, hold seconds, count, site name.
+    for (j = 0; j < SYNCPROF_SITES && merged.entries[j].site; ++j) {
+        struct syncprof_entry *e = &merged.entries[j];
+        fprintf(f, "%f %f %llu %s\n", e->wait * 1e-6, e->hold * 1e-6,
+                e->count, e->site);
+    }
+    fclose(f);
+}
+
+static struct syncprof_entry *syncprof_entry(const char *site) {
+    struct syncprof_table *t = syncprof_local;
+    unsigned i, h;
+
+    if (!t) {
+        t = calloc(1, sizeof(struct syncprof_table));
+        syncprof_local = t;
+        do {
+            t->next = syncprof_tables;
+        } while (!__sync_bool_compare_and_swap(&syncprof_tables, t->next, t));
+        if (__sync_bool_compare_and_swap(&syncprof_registered, 0, 1))
+            atexit(syncprof_dump);
+    }
+
+    // Open addressing on the site pointer.
+    h = (unsigned)(((unsigned long)site >> 3) % SYNCPROF_SITES);
+    for (i = 0; i < SYNCPROF_SITES; ++i) {
+        struct syncprof_entry *e = &t->entries[(h + i) % SYNCPROF_SITES];
+        if (e->site == site)
+            return e;
+        if (!e->site) {
+            e->site = site;
+            return e;
+        }
+    }
+    return NULL;  // Table full; drop the sample.
+}
+
+unsigned long long accept_sync_now() {
+    struct timeval t;
+    gettimeofday(&t,NULL);
+    return (unsigned long long)t.tv_sec * 1000000 + t.tv_usec;
+}
+
+unsigned long long accept_sync_acquired(const char *site,
+                                        unsigned long long t0) {
+    unsigned long long t1 = accept_sync_now();
+    struct syncprof_entry *e = syncprof_entry(site);
+    if (e) {
+        e->wait += t1 - t0;
+        e->count += 1;
+    }
+    return t1;
+}
+
+void accept_sync_release(const char *site, unsigned long long t1) {
+    struct syncprof_entry *e = syncprof_entry(site);
+    if (e)
+        e->hold += accept_sync_now() - t1;
+}
+
+// Miss profiling for approximate loads (-accept-load-profile). Before each
+// candidate load, the probe times a read of the same address with the cycle
+// counter; reads slower than LOADPROF_SLOW_CYCLES are counted as misses.
+// The counts live in per-thread tables like the contention profile's and
+// are written to accept_loadprof.txt at exit.
+
+#define LOADPROF_SITES 256
+#define LOADPROF_SLOW_CYCLES 150
+
+struct loadprof_entry {
+    const char *site;
+    unsigned long long count;
+    unsigned long long slow;
+    unsigned long long cycles;
+};
+
+struct loadprof_table {
+    struct loadprof_entry entries[LOADPROF_SITES];
+    struct loadprof_table *next;
+};
+
+static struct loadprof_table *loadprof_tables = NULL;
+static __thread struct loadprof_table *loadprof_local = NULL;
+static int loadprof_registered = 0;
+
+static void loadprof_dump() {
+    FILE *f = fopen("accept_loadprof.txt", "w");
+    struct loadprof_table *t;
+    struct loadprof_table merged;
+    int i, j;
+
+    memset(&merged, 0, sizeof(merged));
+    for (t = loadprof_tables; t; t = t->next) {
+        for (i = 0; i < LOADPROF_SITES; ++i) {
+            struct loadprof_entry *e = &t->entries[i];
+            if (!e->site)
+                continue;
+            for (j = 0; j < LOADPROF_SITES; ++j) {
+                if (!merged.entries[j].site ||
+                        !strcmp(merged.entries[j].site, e->site))
+                    break;
+            }
+            if (j == LOADPROF_SITES)
+                continue;
+            merged.entries[j].site = e->site;
+            merged.entries[j].count += e->count;
+            merged.entries[j].slow += e->slow;
+            merged.entries[j].cycles += e->cycles;
+        }
+    }
+
+    // One line per site: count, slow reads, total cycles, site name.
+    for (j = 0; j < LOADPROF_SITES && merged.entries[j].site; ++j) {
+        struct loadprof_entry *e = &merged.entries[j];
+        fprintf(f, "%llu %llu %llu %s\n", e->count, e->slow, e->cycles,
+                e->site);
+    }
+    fclose(f);
+}
+
+static struct loadprof_entry *loadprof_entry(const char *site) {
+    struct loadprof_table *t = loadprof_local;
+    unsigned i, h;
+
+    if (!t) {
+        t = calloc(1, sizeof(struct loadprof_table));
+        loadprof_local = t;
+        do {
+            t->next = loadprof_tables;
+        } while (!__sync_bool_compare_and_swap(&loadprof_tables, t->next, t));
+        if (__sync_bool_compare_and_swap(&loadprof_registered, 0, 1))
+            atexit(loadprof_dump);
+    }
+
+    h = (unsigned)(((unsigned long)site >> 3) % LOADPROF_SITES);
+    for (i = 0; i < LOADPROF_SITES; ++i) {
+        struct loadprof_entry *e = &t->entries[(h + i) % LOADPROF_SITES];
+        if (e->site == site)
+            return e;
+        if (!e->site) {
+            e->site = site;
+            return e;
+        }
+    }
+    return NULL;
+}
+
+// Keep the timed read from overlapping the counter reads.
+static inline void loadprof_fence() {
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("lfence" ::: "memory");
+#endif
+}
+
+void accept_load_probe(const char *site, const volatile char *addr) {
+    unsigned long long t0, t1;
+    struct loadprof_entry *e;
+
+    loadprof_fence();
+    t0 = __builtin_readcyclecounter();
+    loadprof_fence();
+    (void)*addr;
+    loadprof_fence();
+    t1 = __builtin_readcyclecounter();
+
+    e = loadprof_entry(site);
+    if (e) {
+        e->count += 1;
+        e->cycles += t1 - t0;
+        if (t1 - t0 > LOADPROF_SLOW_CYCLES)
+            e->slow += 1;
+    }
+}
+
+// Relaxed condition variable waits (the "condvar wait" optimization). The
+// compiler only substitutes this for pthread_cond_wait calls that are
+// re-checked by a loop in an approximate critical section, so returning
+// without a signal is always allowed. Each wait episode first polls the
+// predicate by briefly releasing the mutex; once the polling budget
+// (which grows with the level) is spent, it blocks with a short timeout
+// so a late or lost signal costs at most one timeout.
+// The pthread symbols are weak so programs without threads still link.
+
+#include <pthread.h>
+#include <sched.h>
+
+#pragma weak pthread_mutex_lock
+#pragma weak pthread_mutex_unlock
+#pragma weak pthread_cond_timedwait
+
+#define CONDWAIT_TIMEOUT_US 100
+#define CONDWAIT_EPISODE_GAP_US 1000
+
+static __thread unsigned condwait_polls = 0;
+static __thread unsigned long long condwait_last = 0;
+
+int accept_cond_wait_relaxed(pthread_cond_t *cond, pthread_mutex_t *mutex,
+                             int level) {
+    unsigned long long now = accept_sync_now();
+    unsigned budget = level > 1 ? 1u << (level + 2) : 0;
+    struct timespec deadline;
+    unsigned long long until;
+    int ret;
+
+    // A call long after the previous one starts a new wait episode.
+    if (now - condwait_last > CONDWAIT_EPISODE_GAP_US)
+        condwait_polls = 0;
+
+    if (condwait_polls < budget) {
+        // Poll: let the producer in and return to re-check the predicate.
+        ++condwait_polls;
+        pthread_mutex_unlock(mutex);
+        sched_yield();
+        pthread_mutex_lock(mutex);
+        condwait_last = accept_sync_now();
+        return 0;
+    }
+
+    // Block, but only briefly.
+    until = now + CONDWAIT_TIMEOUT_US;
+    deadline.tv_sec = until / 1000000;
+    deadline.tv_nsec = (until % 1000000) * 1000;
+    ret = pthread_cond_timedwait(cond, mutex, &deadline);
+    condwait_last = accept_sync_now();
+    if (ret == 0)
+        condwait_polls = 0;  // Signaled: the next wait is a new episode.
+    return 0;
+}
+
+// Half-precision conversions for reduced-precision storage ("precision"
+// sites at level 2). The compiler emits these as library calls when the
+// target has no conversion instructions.
+
+#include <stdint.h>
+
+// Shift right, rounding to nearest even.
+static uint32_t halfround(uint32_t v, int shift) {
+    uint32_t rest = v & ((1u << shift) - 1);
+    uint32_t half = 1u << (shift - 1);
+    v >>= shift;
+    if (rest > half || (rest == half && (v & 1)))
+        ++v;
+    return v;
+}
+
+unsigned short __gnu_f2h_ieee(float f) {
+    union { float f; uint32_t u; } in;
+    uint32_t sign, mant;
+    int exp;
+    in.f = f;
+    sign = (in.u >> 16) & 0x8000;
+    exp = (int)((in.u >> 23) & 0xff) - 127 + 15;
+    mant = in.u & 0x7fffff;
+
+    if (((in.u >> 23) & 0xff) == 0xff)  // Infinity or NaN.
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    if (exp >= 0x1f)  // Overflow.
+        return sign | 0x7c00;
+    if (exp <= 0) {  // Subnormal or zero.
+        if (exp < -10)
+            return sign;
+        mant |= 0x800000;
+        return sign | halfround(mant, 14 - exp);
+    }
+    // A carry out of the mantissa correctly bumps the exponent.
+    return sign | halfround(((uint32_t)exp << 23) | mant, 13);
+}
+
+float __gnu_h2f_ieee(unsigned short h) {
+    union { float f; uint32_t u; } out;
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+
+    if (exp == 0x1f) {
+        out.u = sign | 0x7f800000 | (mant << 13);
+    } else if (exp == 0) {
+        // Zero or subnormal: the value is mant * 2^-24.
+        out.f = (float)mant * (1.0f / 16777216.0f);
+        out.u |= sign;
+    } else {
+        out.u = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+    }
+    return out.f;
+}
+
+// Storage compaction at the fixed-point level ("storage" sites at level 3).
+// Each array has a power-of-two scale (state[0], with its inverse in
+// state[1]). When a value does not fit, the scale is doubled until it does
+// and the elements already stored are shifted to match.
+
+#include <math.h>
+
+void accept_compact_rescale(signed char *data, unsigned long n, float *state,
+                            float v) {
+    float scale = state[0];
+    unsigned long i;
+    int shift = 0;
+
+    if (!(fabsf(v) <= 3.4e38f))
+        return;  // NaN or infinity: let the store saturate.
+    while (fabsf(v) > 127.0f * scale) {
+        scale *= 2.0f;
+        ++shift;
+    }
+    if (!shift)
+        return;
+
+    for (i = 0; i < n; ++i) {
+        int d = data[i];
+        if (shift > 7)
+            data[i] = 0;
+        else
+            data[i] = (signed char)((d + (1 << (shift - 1))) >> shift);
+    }
+    state[0] = scale;
+    state[1] = 1.0f / scale;
+}
+
+// Parallel loops ("parallel loop" sites). The compiler outlines the body of
+// a loop whose iterations only communicate through approximate data and
+// calls accept_parallel_for with the iteration range. Iterations are handed
+// out in chunks to a pool of worker threads that persists between loops;
+// the calling thread takes part too. Iterations may race. Loops nested in
+// a parallel loop, loops started while another is running, and programs
+// linked without threads run sequentially.
+
+#pragma weak pthread_create
+#pragma weak pthread_mutex_trylock
+#pragma weak pthread_cond_wait
+#pragma weak pthread_cond_signal
+#pragma weak pthread_cond_broadcast
+
+#define PARALLEL_MAX_THREADS 64
+#define PARALLEL_CHUNKS_PER_THREAD 8
+
+typedef void (*parallel_body)(long long, void *);
+
+static struct {
+    pthread_mutex_t busy;  // Held while a parallel loop runs.
+    pthread_mutex_t lock;  // Protects the rest.
+    pthread_cond_t start;
+    pthread_cond_t done;
+    int workers;           // Threads created so far.
+    int participants;      // Workers taking part in the current loop.
+    int pending;           // Participants not yet finished with it.
+    unsigned generation;   // Counts loops started.
+    unsigned started[PARALLEL_MAX_THREADS];  // Generation at creation.
+    parallel_body body;
+    void *env;
+    long long next;
+    long long end;
+    long long chunk;
+} parallel_pool = {
+    .busy = PTHREAD_MUTEX_INITIALIZER,
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static __thread int parallel_inside = 0;
+
+static void parallel_run(void) {
+    long long i, stop;
+    for (;;) {
+        i = __sync_fetch_and_add(&parallel_pool.next, parallel_pool.chunk);
+        if (i >= parallel_pool.end)
+            break;
+        stop = i + parallel_pool.chunk;
+        if (stop > parallel_pool.end)
+            stop = parallel_pool.end;
+        for (; i < stop; ++i)
+            parallel_pool.body(i, parallel_pool.env);
+    }
+}
+
+static void *parallel_worker(void *arg) {
+    int id = (int)(long)arg;
+    unsigned seen;
+
+    parallel_inside = 1;
+    pthread_mutex_lock(&parallel_pool.lock);
+    seen = parallel_pool.started[id];
+    for (;;) {
+        while (parallel_pool.generation == seen)
+            pthread_cond_wait(&parallel_pool.start, &parallel_pool.lock);
+        seen = parallel_pool.generation;
+        if (id >= parallel_pool.participants)
+            continue;
+
+        pthread_mutex_unlock(&parallel_pool.lock);
+        parallel_run();
+        pthread_mutex_lock(&parallel_pool.lock);
+        if (--parallel_pool.pending == 0)
+            pthread_cond_signal(&parallel_pool.done);
+    }
+    return NULL;
+}
+
+void accept_parallel_for(parallel_body body, void *env, long long begin,
+                         long long end, int nthreads) {
+    long long i;
+    int helpers;
+
+    if (nthreads > PARALLEL_MAX_THREADS)
+        nthreads = PARALLEL_MAX_THREADS;
+    if (nthreads < 2 || end - begin < 2 || parallel_inside ||
+            !pthread_create || pthread_mutex_trylock(&parallel_pool.busy)) {
+        for (i = begin; i < end; ++i)
+            body(i, env);
+        return;
+    }
+
+    pthread_mutex_lock(&parallel_pool.lock);
+    while (parallel_pool.workers < nthreads - 1) {
+        pthread_t thread;
+        int id = parallel_pool.workers;
+        parallel_pool.started[id] = parallel_pool.generation;
+        if (pthread_create(&thread, NULL, parallel_worker, (void *)(long)id))
+            break;
+        ++parallel_pool.workers;
+    }
+    helpers = parallel_pool.workers < nthreads - 1 ?
+        parallel_pool.workers : nthreads - 1;
+
+    parallel_pool.body = body;
+    parallel_pool.env = env;
+    parallel_pool.next = begin;
+    parallel_pool.end = end;
+    parallel_pool.chunk =
+        (end - begin) / ((helpers + 1) * PARALLEL_CHUNKS_PER_THREAD);
+    if (parallel_pool.chunk < 1)
+        parallel_pool.chunk = 1;
+    parallel_pool.participants = helpers;
+    parallel_pool.pending = helpers;
+    ++parallel_pool.generation;
+    pthread_cond_broadcast(&parallel_pool.start);
+    pthread_mutex_unlock(&parallel_pool.lock);
+
+    parallel_inside = 1;
+    parallel_run();
+    parallel_inside = 0;
+
+    pthread_mutex_lock(&parallel_pool.lock);
+    while (parallel_pool.pending)
+        pthread_cond_wait(&parallel_pool.done, &parallel_pool.lock);
+    pthread_mutex_unlock(&parallel_pool.lock);
+    pthread_mutex_unlock(&parallel_pool.busy);
+}